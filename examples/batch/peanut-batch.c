@@ -0,0 +1,340 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Runs many instances of a ROM headless on a pool of threads, and prints the
+ * total number of frames emulated per second for an increasing number of
+ * threads. With --lockstep, also compares running the instances one after
+ * another on one thread with running them in lockstep, when started from the
+ * same state and given one of a few inputs each.
+ */
+#define _GNU_SOURCE
+
+#ifndef ENABLE_LCD
+# define ENABLE_LCD 1
+#endif
+
+/* Sound is disabled for this project. */
+#ifndef ENABLE_SOUND
+# define ENABLE_SOUND 0
+#endif
+
+/* Import emulator library. */
+#include "../../peanut_gb.h"
+#include "peanut_batch.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+struct instance_s
+{
+	struct gb_s gb;
+	uint8_t *cart_ram;
+#if ENABLE_LCD
+	/* Frame buffer, as would be given to an agent. */
+	uint8_t fb[LCD_HEIGHT][LCD_WIDTH];
+#endif
+	/* Number of times the instance completed a run. */
+	unsigned int runs;
+};
+
+/**
+ * Maps a ROM file into memory as read only, so that it is only held once in
+ * memory however many instances use it. Must be unmapped with munmap().
+ */
+static uint8_t *map_rom(const char *file_name, size_t *rom_size_out)
+{
+	int fd = open(file_name, O_RDONLY);
+	struct stat st;
+	void *rom;
+
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	rom = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if(rom == MAP_FAILED)
+		return NULL;
+
+	*rom_size_out = st.st_size;
+	return rom;
+}
+
+static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err,
+		const uint16_t addr)
+{
+	(void)gb;
+	fprintf(stderr, "Error %d occurred at %04X. Exiting.\n", gb_err, addr);
+	exit(EXIT_FAILURE);
+}
+
+static void instance_done(struct gb_s *gb, size_t index, void *user)
+{
+	struct instance_s *inst = gb->direct.priv;
+	(void)index;
+	(void)user;
+	inst->runs++;
+}
+
+#if ENABLE_LCD
+static void instance_copy(struct gb_s *from, struct gb_s *to, void *user)
+{
+	struct instance_s *src = from->direct.priv;
+	struct instance_s *dst = to->direct.priv;
+	(void)user;
+	memcpy(dst->fb, src->fb, sizeof(dst->fb));
+}
+#endif
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int instances = 256;
+	unsigned int frames = 600;
+	unsigned int max_threads = 0;
+	unsigned int actions = 0;
+	int pin = 1;
+	char *rom_file_name = NULL;
+	uint8_t *rom_data;
+	size_t rom_size;
+	struct gb_rom_s rom;
+	struct instance_s **inst;
+	struct gb_s **gb;
+	double base_fps = 0.0;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+			instances = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			max_threads = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--no-pin") == 0)
+			pin = 0;
+		else if(strcmp(argv[i], "--lockstep") == 0 && i + 1 < argc)
+			actions = atoi(argv[++i]);
+		else
+			rom_file_name = argv[i];
+	}
+
+	if(rom_file_name == NULL || instances == 0 || frames == 0)
+	{
+		fprintf(stderr, "Syntax: %s [--instances <n>] [--frames <f>] "
+				"[--threads <max>] [--no-pin] "
+				"[--lockstep <inputs>] <ROM>\n",
+				argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(max_threads == 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		max_threads = cores > 0 ? cores : 1;
+	}
+
+	/* All instances share the same ROM, of which the header is only
+	 * checked once. */
+	if((rom_data = map_rom(rom_file_name, &rom_size)) == NULL)
+	{
+		fprintf(stderr, "Unable to read %s\n", rom_file_name);
+		exit(EXIT_FAILURE);
+	}
+
+	if(gb_rom_init(&rom, rom_data, rom_size) != GB_INIT_NO_ERROR)
+	{
+		fprintf(stderr, "Unsupported or invalid ROM\n");
+		exit(EXIT_FAILURE);
+	}
+
+	inst = calloc(instances, sizeof(*inst));
+	gb = calloc(instances, sizeof(*gb));
+	if(inst == NULL || gb == NULL)
+		exit(EXIT_FAILURE);
+
+	printf("%u instances, %u frames each\n", instances, frames);
+	printf("threads, frames/s, speedup, steals\n");
+
+	for(unsigned int threads = 1; threads <= max_threads;
+			threads = threads < max_threads && threads * 2 > max_threads ?
+				max_threads : threads * 2)
+	{
+		struct gb_batch_s *batch;
+		size_t steals = 0;
+		double start, fps;
+
+		/* Each instance is started again, so that every run emulates
+		 * the same frames. Instances are allocated separately so
+		 * that they do not share cache lines. */
+		for(unsigned int i = 0; i < instances; i++)
+		{
+			size_t save_size = 0;
+
+			if(inst[i] == NULL)
+				inst[i] = calloc(1, sizeof(*inst[i]));
+			else
+				gb_release_rom(&inst[i]->gb);
+
+			if(inst[i] == NULL)
+				exit(EXIT_FAILURE);
+
+			if(gb_init_rom(&inst[i]->gb, &rom, NULL, 0,
+					&gb_error, inst[i]) != GB_INIT_NO_ERROR)
+			{
+				fprintf(stderr, "Peanut-GB failed to initialise\n");
+				exit(EXIT_FAILURE);
+			}
+
+			gb_get_save_size_s(&inst[i]->gb, &save_size);
+			free(inst[i]->cart_ram);
+			inst[i]->cart_ram = malloc(save_size);
+			gb_set_cart_ram(&inst[i]->gb, inst[i]->cart_ram, save_size);
+#if ENABLE_LCD
+			gb_init_framebuffer(&inst[i]->gb, inst[i]->fb,
+					sizeof(inst[i]->fb[0]),
+					GB_FRAMEBUFFER_INDEX8, NULL);
+#endif
+			inst[i]->runs = 0;
+			gb[i] = &inst[i]->gb;
+		}
+
+		batch = gb_batch_create(threads, pin);
+		if(batch == NULL)
+		{
+			fprintf(stderr, "Unable to create %u threads\n", threads);
+			exit(EXIT_FAILURE);
+		}
+
+		start = now();
+		if(gb_batch_run(batch, gb, instances, frames, instance_done,
+				NULL) != 0)
+			exit(EXIT_FAILURE);
+		fps = (double)instances * frames / (now() - start);
+
+		for(unsigned int i = 0; i < batch->threads; i++)
+			steals += batch->worker[i].steals;
+
+		gb_batch_destroy(batch);
+
+		for(unsigned int i = 0; i < instances; i++)
+		{
+			if(inst[i]->runs != 1)
+			{
+				fprintf(stderr, "Instance %u ran %u times\n",
+						i, inst[i]->runs);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if(threads == 1)
+			base_fps = fps;
+
+		printf("%u, %.0f, %.2f, %zu\n", threads, fps, fps / base_fps,
+				steals);
+	}
+
+	if(actions != 0)
+	{
+		struct gb_lockstep_s ls;
+		size_t runs = 0;
+		size_t state_size = gb_state_size(gb[0]);
+		uint8_t *state = malloc(state_size);
+		double start, fps;
+
+		if(state == NULL)
+			exit(EXIT_FAILURE);
+
+		/* Both passes start from the state of the first instance. */
+		gb_state_save(gb[0], state);
+
+		if(gb_lockstep_init(&ls, gb, instances,
+#if ENABLE_LCD
+					instance_copy,
+#else
+					NULL,
+#endif
+					NULL) != 0)
+			exit(EXIT_FAILURE);
+
+		printf("mode, frames/s, frames run\n");
+
+		/* Each instance presses one of the given number of buttons.
+		 * The instances are run one after another, and then again in
+		 * lockstep from the same state. */
+		for(int lockstep = 0; lockstep < 2; lockstep++)
+		{
+			/* The serial pass changed each instance without the
+			 * lockstep runner, so every instance is detached
+			 * before being started again. */
+			for(unsigned int i = 0; i < instances; i++)
+				gb_lockstep_detach(&ls, i);
+
+			if(gb_state_load(gb[0], state, state_size) !=
+					GB_STATE_NO_ERROR)
+				exit(EXIT_FAILURE);
+
+			for(unsigned int i = 1; i < instances; i++)
+				gb_lockstep_join(&ls, 0, i);
+
+			for(unsigned int i = 0; i < instances; i++)
+				gb[i]->direct.joypad = ~(1 << (i % actions % 8));
+
+			runs = 0;
+			start = now();
+			for(unsigned int f = 0; f < frames; f++)
+			{
+				if(lockstep)
+				{
+					gb_lockstep_run_frame(&ls);
+					runs += ls.runs;
+					continue;
+				}
+
+				for(unsigned int i = 0; i < instances; i++)
+					gb_run_frame(gb[i]);
+
+				runs += instances;
+			}
+			fps = (double)instances * frames / (now() - start);
+
+			printf("%s, %.0f, %zu\n", lockstep ? "lockstep" : "serial",
+					fps, runs);
+		}
+
+		gb_lockstep_free(&ls);
+		free(state);
+	}
+
+	for(unsigned int i = 0; i < instances; i++)
+	{
+		if(gb_release_rom(&inst[i]->gb) == 0)
+			munmap(rom_data, rom_size);
+
+		free(inst[i]->cart_ram);
+		free(inst[i]);
+	}
+
+	free(inst);
+	free(gb);
+
+	return EXIT_SUCCESS;
+}
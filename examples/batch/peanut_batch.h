@@ -0,0 +1,591 @@
+/**
+ * MIT License
+ * Copyright (c) 2018-2023 Mahyar Koshkouei
+ *
+ * Runs many Peanut-GB contexts at once on a pool of threads.
+ *
+ * Each call to gb_batch_run() advances every context by the same number of
+ * frames. The contexts are dealt out to one deque per thread. A thread runs
+ * the contexts in its own deque, and then steals contexts from the other
+ * deques, so that threads that are given quick contexts help threads that are
+ * given slow ones. Each context is only ever run by one thread at a time, so
+ * the contexts need no locking. The ROM buffer given to gb_init_direct() may
+ * be shared by all contexts, as it is never written to.
+ *
+ * gb_lockstep_run_frame() instead advances many contexts of the same game by
+ * one frame on the calling thread, such as for many copies of one game that
+ * are given different inputs. Contexts that are known to be in the same state
+ * and that are given the same input are grouped together. Only the first
+ * context of each group is run, and its state is then copied to the others
+ * with gb_fork(), which is much quicker than running a frame. Groups are split
+ * when their inputs differ, and are joined with gb_lockstep_join().
+ *
+ * peanut_gb.h must be included before this file. Requires POSIX threads.
+ * Threads are pinned to a core on Linux if _GNU_SOURCE was defined before
+ * including any system header.
+ */
+
+#ifndef PEANUT_BATCH_H
+#define PEANUT_BATCH_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+# include <sched.h>
+# define PEANUT_BATCH_PIN 1
+#else
+# define PEANUT_BATCH_PIN 0
+#endif
+
+/**
+ * Called by a thread of the pool when a context has run all of its frames.
+ *
+ * \param gb	Context that was run.
+ * \param index	Index of the context in the array given to gb_batch_run().
+ * \param user	Pointer given to gb_batch_run().
+ */
+typedef void (*gb_batch_done_fn)(struct gb_s *gb, size_t index, void *user);
+
+/* Deque of indices of contexts to run. The owner takes from the bottom and
+ * other threads steal from the top. The lock is only held for a few
+ * instructions per context, which is negligible compared with running a
+ * frame. */
+struct gb_batch_deque_s
+{
+	pthread_mutex_t lock;
+	size_t *task;
+	size_t top;
+	size_t bottom;
+};
+
+struct gb_batch_worker_s
+{
+	struct gb_batch_s *batch;
+	pthread_t thread;
+	unsigned int id;
+	struct gb_batch_deque_s deque;
+
+	/* Statistics of the last call to gb_batch_run(). */
+	size_t runs;
+	size_t steals;
+};
+
+struct gb_batch_s
+{
+	struct gb_batch_worker_s *worker;
+	unsigned int threads;
+	int pin;
+
+	/* Job given to the threads by gb_batch_run(). */
+	struct gb_s **gb;
+	uint_fast32_t frames;
+	gb_batch_done_fn done;
+	void *user;
+
+	/* Incremented for each job, to wake the threads. */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t finish;
+	unsigned long job;
+	unsigned int active;
+	int quit;
+};
+
+/**
+ * Called by gb_lockstep_run_frame() after the state of a context was copied to
+ * another context of the same group, so that the front-end may copy anything
+ * that gb_fork() does not, such as the frame buffer.
+ *
+ * \param from	Context that was run.
+ * \param to	Context that the state was copied to.
+ * \param user	Pointer given to gb_lockstep_init().
+ */
+typedef void (*gb_lockstep_copy_fn)(struct gb_s *from, struct gb_s *to,
+		void *user);
+
+struct gb_lockstep_s
+{
+	struct gb_s **gb;
+	size_t count;
+
+	/* Index of the context that is run for each context. A context that
+	 * is run is its own leader. */
+	size_t *leader;
+	/* Leaders before the groups were split by input. */
+	size_t *prev;
+
+	gb_lockstep_copy_fn copy;
+	void *user;
+
+	/* Number of contexts that were run by the last call to
+	 * gb_lockstep_run_frame(). */
+	size_t runs;
+};
+
+#ifndef PEANUT_BATCH_HEADER_ONLY
+
+/**
+ * Internal function used to take a task from the bottom of a deque.
+ * Returns 0 if the deque is empty.
+ */
+static int __gb_batch_take(struct gb_batch_deque_s *d, size_t *task)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top)
+	{
+		*task = d->task[--d->bottom];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return ret;
+}
+
+/**
+ * Internal function used to steal a task from the top of a deque.
+ * Returns 0 if the deque is empty.
+ */
+static int __gb_batch_steal(struct gb_batch_deque_s *d, size_t *task)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top)
+	{
+		*task = d->task[d->top++];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return ret;
+}
+
+/**
+ * Internal function used to get the next context to run, from the deque of
+ * the thread or stolen from another thread.
+ */
+static int __gb_batch_next(struct gb_batch_worker_s *w, size_t *task)
+{
+	struct gb_batch_s *b = w->batch;
+	unsigned int i;
+
+	if(__gb_batch_take(&w->deque, task))
+		return 1;
+
+	/* Start with the next thread, so that thieves are spread out. */
+	for(i = 1; i < b->threads; i++)
+	{
+		struct gb_batch_worker_s *victim =
+			&b->worker[(w->id + i) % b->threads];
+
+		if(__gb_batch_steal(&victim->deque, task))
+		{
+			w->steals++;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void *__gb_batch_thread(void *arg)
+{
+	struct gb_batch_worker_s *w = arg;
+	struct gb_batch_s *b = w->batch;
+	unsigned long job = 0;
+
+#if PEANUT_BATCH_PIN
+	if(b->pin)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->id % (cores > 0 ? cores : 1), &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+#endif
+
+	while(1)
+	{
+		size_t task;
+		int quit;
+
+		pthread_mutex_lock(&b->lock);
+		while(b->job == job && !b->quit)
+			pthread_cond_wait(&b->start, &b->lock);
+
+		job = b->job;
+		quit = b->quit;
+		pthread_mutex_unlock(&b->lock);
+
+		if(quit)
+			break;
+
+		while(__gb_batch_next(w, &task))
+		{
+			struct gb_s *gb = b->gb[task];
+			uint_fast32_t f;
+
+			for(f = 0; f < b->frames; f++)
+				gb_run_frame(gb);
+
+			w->runs++;
+			if(b->done != NULL)
+				b->done(gb, task, b->user);
+		}
+
+		pthread_mutex_lock(&b->lock);
+		if(--b->active == 0)
+			pthread_cond_signal(&b->finish);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+struct gb_batch_s *gb_batch_create(unsigned int threads, int pin)
+{
+	struct gb_batch_s *b;
+	unsigned int i;
+
+	if(threads == 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? cores : 1;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if(b == NULL)
+		return NULL;
+
+	b->worker = calloc(threads, sizeof(*b->worker));
+	if(b->worker == NULL)
+	{
+		free(b);
+		return NULL;
+	}
+
+	b->pin = pin;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->start, NULL);
+	pthread_cond_init(&b->finish, NULL);
+
+	for(i = 0; i < threads; i++)
+	{
+		struct gb_batch_worker_s *w = &b->worker[i];
+
+		w->batch = b;
+		w->id = i;
+		pthread_mutex_init(&w->deque.lock, NULL);
+
+		if(pthread_create(&w->thread, NULL, __gb_batch_thread, w) != 0)
+		{
+			pthread_mutex_destroy(&w->deque.lock);
+			break;
+		}
+
+		b->threads++;
+	}
+
+	if(b->threads == 0)
+	{
+		pthread_cond_destroy(&b->finish);
+		pthread_cond_destroy(&b->start);
+		pthread_mutex_destroy(&b->lock);
+		free(b->worker);
+		free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+int gb_batch_run(struct gb_batch_s *b, struct gb_s **gb, size_t count,
+		uint_fast32_t frames, gb_batch_done_fn done, void *user)
+{
+	unsigned int i;
+	size_t j;
+
+	/* Deal the contexts out to the threads. */
+	for(i = 0; i < b->threads; i++)
+	{
+		struct gb_batch_worker_s *w = &b->worker[i];
+		size_t *task = realloc(w->deque.task,
+				(count / b->threads + 1) * sizeof(*task));
+
+		if(task == NULL)
+			return -1;
+
+		w->deque.task = task;
+		w->deque.top = 0;
+		w->deque.bottom = 0;
+		w->runs = 0;
+		w->steals = 0;
+	}
+
+	for(j = 0; j < count; j++)
+	{
+		struct gb_batch_deque_s *d = &b->worker[j % b->threads].deque;
+		d->task[d->bottom++] = j;
+	}
+
+	pthread_mutex_lock(&b->lock);
+	b->gb = gb;
+	b->frames = frames;
+	b->done = done;
+	b->user = user;
+	b->active = b->threads;
+	b->job++;
+	pthread_cond_broadcast(&b->start);
+
+	while(b->active != 0)
+		pthread_cond_wait(&b->finish, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+
+	return 0;
+}
+
+void gb_batch_destroy(struct gb_batch_s *b)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&b->lock);
+	b->quit = 1;
+	pthread_cond_broadcast(&b->start);
+	pthread_mutex_unlock(&b->lock);
+
+	for(i = 0; i < b->threads; i++)
+	{
+		pthread_join(b->worker[i].thread, NULL);
+		pthread_mutex_destroy(&b->worker[i].deque.lock);
+		free(b->worker[i].deque.task);
+	}
+
+	pthread_cond_destroy(&b->finish);
+	pthread_cond_destroy(&b->start);
+	pthread_mutex_destroy(&b->lock);
+	free(b->worker);
+	free(b);
+}
+
+int gb_lockstep_init(struct gb_lockstep_s *ls, struct gb_s **gb,
+		size_t count, gb_lockstep_copy_fn copy, void *user)
+{
+	size_t i;
+
+	ls->leader = malloc(count * sizeof(*ls->leader));
+	ls->prev = malloc(count * sizeof(*ls->prev));
+	if(ls->leader == NULL || ls->prev == NULL)
+	{
+		free(ls->leader);
+		free(ls->prev);
+		return -1;
+	}
+
+	for(i = 0; i < count; i++)
+		ls->leader[i] = i;
+
+	ls->gb = gb;
+	ls->count = count;
+	ls->copy = copy;
+	ls->user = user;
+	ls->runs = 0;
+
+	return 0;
+}
+
+void gb_lockstep_detach(struct gb_lockstep_s *ls, size_t lane)
+{
+	size_t next = lane;
+	size_t i;
+
+	/* Any other context of the group leads the contexts that followed
+	 * this one, as they all hold the same state. */
+	for(i = 0; i < ls->count; i++)
+	{
+		if(i == lane || ls->leader[i] != lane)
+			continue;
+
+		if(next == lane)
+			next = i;
+
+		ls->leader[i] = next;
+	}
+
+	ls->leader[lane] = lane;
+}
+
+enum gb_state_error_e gb_lockstep_join(struct gb_lockstep_s *ls, size_t src,
+		size_t dst)
+{
+	enum gb_state_error_e err;
+
+	if(ls->leader[src] == ls->leader[dst])
+		return GB_STATE_NO_ERROR;
+
+	err = gb_fork(ls->gb[src], ls->gb[dst]);
+	if(err != GB_STATE_NO_ERROR)
+		return err;
+
+	if(ls->copy != NULL)
+		ls->copy(ls->gb[src], ls->gb[dst], ls->user);
+
+	gb_lockstep_detach(ls, dst);
+	ls->leader[dst] = ls->leader[src];
+
+	return GB_STATE_NO_ERROR;
+}
+
+void gb_lockstep_run_frame(struct gb_lockstep_s *ls)
+{
+	struct gb_s **gb = ls->gb;
+	size_t i, j;
+
+	/* Split each group by the input given to each context. A context
+	 * that is not given the same input as its leader follows the first
+	 * context of the group that was given the same input, or leads a new
+	 * group. */
+	memcpy(ls->prev, ls->leader, ls->count * sizeof(*ls->prev));
+
+	for(i = 0; i < ls->count; i++)
+	{
+		const size_t l = ls->prev[i];
+
+		if(l == i || gb[i]->direct.joypad == gb[l]->direct.joypad)
+			continue;
+
+		ls->leader[i] = i;
+		for(j = 0; j < i; j++)
+		{
+			if(ls->prev[j] == l && ls->leader[j] != l &&
+					gb[j]->direct.joypad ==
+					gb[i]->direct.joypad)
+			{
+				ls->leader[i] = ls->leader[j];
+				break;
+			}
+		}
+	}
+
+	ls->runs = 0;
+	for(i = 0; i < ls->count; i++)
+	{
+		if(ls->leader[i] != i)
+			continue;
+
+		gb_run_frame(gb[i]);
+		ls->runs++;
+	}
+
+	for(i = 0; i < ls->count; i++)
+	{
+		const size_t l = ls->leader[i];
+
+		if(l == i)
+			continue;
+
+		gb_fork(gb[l], gb[i]);
+		if(ls->copy != NULL)
+			ls->copy(gb[l], gb[i], ls->user);
+	}
+}
+
+void gb_lockstep_free(struct gb_lockstep_s *ls)
+{
+	free(ls->leader);
+	free(ls->prev);
+}
+
+#endif /* PEANUT_BATCH_HEADER_ONLY */
+
+/**
+ * Creates a pool of threads.
+ *
+ * \param threads	Number of threads. If 0, one thread is created for
+ *			each online core.
+ * \param pin		Pin thread n to core n, if supported.
+ * \returns		Pool of threads, or NULL on error.
+ */
+struct gb_batch_s *gb_batch_create(unsigned int threads, int pin);
+
+/**
+ * Runs each context for the given number of frames, and returns once all
+ * contexts have been run. Must not be called from a completion callback.
+ *
+ * \param b	Pool of threads.
+ * \param gb	Array of count initialised contexts. Each context must only
+ *		appear once.
+ * \param count	Number of contexts.
+ * \param frames Number of frames to run each context for.
+ * \param done	Called once for each context after it has run, from the
+ *		thread that ran it. May be NULL.
+ * \param user	Given to done.
+ * \returns	0 on success, or -1 if memory could not be allocated.
+ */
+int gb_batch_run(struct gb_batch_s *b, struct gb_s **gb, size_t count,
+		uint_fast32_t frames, gb_batch_done_fn done, void *user);
+
+/**
+ * Stops the threads and frees the pool.
+ */
+void gb_batch_destroy(struct gb_batch_s *b);
+
+/**
+ * Initialises a lockstep runner, in which every context leads its own group.
+ *
+ * \param ls	Lockstep runner to initialise.
+ * \param gb	Array of count contexts initialised with the same game. Must
+ *		remain valid for the lifetime of ls.
+ * \param count	Number of contexts.
+ * \param copy	Called after the state of a context was copied to another.
+ *		May be NULL.
+ * \param user	Given to copy.
+ * \returns	0 on success, or -1 if memory could not be allocated.
+ */
+int gb_lockstep_init(struct gb_lockstep_s *ls, struct gb_s **gb,
+		size_t count, gb_lockstep_copy_fn copy, void *user);
+
+/**
+ * Copies the state of context src to context dst, and adds dst to the group
+ * of src, such as when starting every context from the same state.
+ *
+ * \param ls	Lockstep runner.
+ * \param src	Index of the context to copy from.
+ * \param dst	Index of the context to copy to.
+ * \returns	Value returned by gb_fork().
+ */
+enum gb_state_error_e gb_lockstep_join(struct gb_lockstep_s *ls, size_t src,
+		size_t dst);
+
+/**
+ * Removes a context from its group. Must be called before the state of a
+ * context is changed other than by gb_lockstep_run_frame(), such as by
+ * gb_reset() or gb_state_load().
+ *
+ * \param ls	Lockstep runner.
+ * \param lane	Index of the context.
+ */
+void gb_lockstep_detach(struct gb_lockstep_s *ls, size_t lane);
+
+/**
+ * Runs each context for one frame with the input set in its joypad. Only one
+ * context of each group that is given the same input is run, and the others
+ * are given a copy of its state. The number of contexts that were run is set
+ * in ls->runs.
+ *
+ * \param ls	Lockstep runner.
+ */
+void gb_lockstep_run_frame(struct gb_lockstep_s *ls);
+
+/**
+ * Frees the memory allocated by gb_lockstep_init().
+ */
+void gb_lockstep_free(struct gb_lockstep_s *ls);
+
+#endif /* PEANUT_BATCH_H */
@@ -34,38 +34,10 @@ struct priv_t
 	uint16_t fb[LCD_HEIGHT][LCD_WIDTH];
 };
 
-/**
- * Returns a byte from the ROM file at the given address.
- */
-static uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr)
-{
-	const struct priv_t * const p = gb->direct.priv;
-	return p->rom[addr];
-}
-
-/**
- * Returns a byte from the cartridge RAM at the given address.
- */
-static uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr)
-{
-	const struct priv_t * const p = gb->direct.priv;
-	return p->cart_ram[addr];
-}
-
-/**
- * Writes a given byte to the cartridge RAM at the given address.
- */
-static void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr,
-		const uint8_t val)
-{
-	const struct priv_t * const p = gb->direct.priv;
-	p->cart_ram[addr] = val;
-}
-
 /**
  * Returns a pointer to the allocated space containing the ROM. Must be freed.
  */
-static uint8_t *read_rom_to_ram(const char *file_name)
+static uint8_t *read_rom_to_ram(const char *file_name, size_t *rom_size_out)
 {
 	FILE *rom_file = fopen(file_name, "rb");
 	size_t rom_size;
@@ -87,6 +59,7 @@ static uint8_t *read_rom_to_ram(const char *file_name)
 	}
 
 	fclose(rom_file);
+	*rom_size_out = rom_size;
 	return rom;
 }
 
@@ -114,24 +87,12 @@ static void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16
 }
 
 #if ENABLE_LCD
-/**
- * Draws scanline into framebuffer.
- */
-static void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
-		const uint_fast8_t line)
-{
-	struct priv_t *priv = gb->direct.priv;
-	const uint16_t palette[] = { 0x7FFF, 0x5294, 0x294A, 0x0000 };
-
-	for (unsigned int x = 0; x < LCD_WIDTH; x++)
-	{
-#if PEANUT_GB_16BIT_COLOUR
-		priv->fb[line][x] = palette[pixels[x] & 3];
-#else
-		priv->fb[line][x] = palette[pixels[x]];
-#endif
-	}
-}
+/* Colours of the OBJ0, OBJ1 and BG layers, from white to black. */
+static const uint32_t lcd_palette[12] = {
+	0xFFFF, 0xAD55, 0x52AA, 0x0000,
+	0xFFFF, 0xAD55, 0x52AA, 0x0000,
+	0xFFFF, 0xAD55, 0x52AA, 0x0000
+};
 #endif
 
 int main(int argc, char **argv)
@@ -154,11 +115,15 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	printf("Opcode dispatch: %s\n",
+		PEANUT_GB_THREADED_DISPATCH ? "threaded" : "switch");
+
 	for(unsigned int i = 0; i < 5; i++)
 	{
 		/* Start benchmark. */
 		struct gb_s gb;
 		struct priv_t priv;
+		size_t rom_size;
 		size_t save_size;
 
 		clock_t start_time;
@@ -166,15 +131,16 @@ int main(int argc, char **argv)
 		enum gb_init_error_e ret;
 
 		/* Copy input ROM file to allocated memory. */
-		if((priv.rom = read_rom_to_ram(rom_file_name)) == NULL)
+		if((priv.rom = read_rom_to_ram(rom_file_name, &rom_size)) == NULL)
 		{
 			printf("%d: %s\n", __LINE__, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 
-		/* Initialise context. */
-		ret = gb_init(&gb, &gb_rom_read, &gb_cart_ram_read,
-				&gb_cart_ram_write, &gb_error, &priv);
+		/* Initialise context. The ROM is accessed directly by
+		 * Peanut-GB. Cart RAM is set once its size is known. */
+		ret = gb_init_direct(&gb, priv.rom, rom_size, NULL, 0,
+				&gb_error, &priv);
 
 		if(ret != GB_INIT_NO_ERROR)
 		{
@@ -191,9 +157,12 @@ int main(int argc, char **argv)
 		}
 
 		priv.cart_ram = malloc(save_size);
+		gb_set_cart_ram(&gb, priv.cart_ram, save_size);
 
 #if ENABLE_LCD
-		gb_init_lcd(&gb, &lcd_draw_line);
+		/* Lines are written straight into the frame buffer. */
+		gb_init_framebuffer(&gb, priv.fb, sizeof(priv.fb[0]),
+				GB_FRAMEBUFFER_RGB565, lcd_palette);
 		// gb.direct.interlace = true;
 #endif
 
@@ -211,7 +180,13 @@ int main(int argc, char **argv)
 			double duration =
 				(double)(clock() - start_time) / CLOCKS_PER_SEC;
 			double fps = frames / duration;
-			printf("%f FPS, dur: %f\n", fps, duration);
+			printf("%f FPS, dur: %f", fps, duration);
+#if PEANUT_GB_IDLE_LOOP_SKIP
+			/* Share of emulated time spent in skipped idle loops. */
+			printf(", idle: %.1f%%", 100.0 * gb_get_idle_cycles(&gb) /
+					((double)frames * LCD_FRAME_CYCLES));
+#endif
+			printf("\n");
 		}
 
 		free(priv.cart_ram);
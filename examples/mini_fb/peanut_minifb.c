@@ -105,18 +105,12 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t val)
 }
 
 #if ENABLE_LCD
-/**
- * Draws scanline into framebuffer.
- */
-void lcd_draw_line(struct gb_s *gb, const uint8_t pixels[160],
-		   const uint_fast8_t line)
-{
-	struct priv_t *priv = gb->direct.priv;
-	const uint32_t palette[] = { 0xFFFFFF, 0xA5A5A5, 0x525252, 0x000000 };
-
-	for(unsigned int x = 0; x < LCD_WIDTH; x++)
-		priv->fb[line][x] = palette[pixels[x] & 3];
-}
+/* Colours of the OBJ0, OBJ1 and BG layers, from white to black. */
+static const uint32_t lcd_palette[12] = {
+	0xFFFFFF, 0xA5A5A5, 0x525252, 0x000000,
+	0xFFFFFF, 0xA5A5A5, 0x525252, 0x000000,
+	0xFFFFFF, 0xA5A5A5, 0x525252, 0x000000
+};
 #endif
 
 int main(int argc, char **argv)
@@ -158,7 +152,8 @@ int main(int argc, char **argv)
 	priv.cart_ram = malloc(gb_get_save_size(&gb));
 
 #if ENABLE_LCD
-	gb_init_lcd(&gb, &lcd_draw_line);
+	gb_init_framebuffer(&gb, priv.fb, sizeof(priv.fb[0]),
+			GB_FRAMEBUFFER_XRGB8888, lcd_palette);
 	// gb.direct.interlace = true;
 #endif
 
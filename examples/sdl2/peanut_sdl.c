@@ -20,6 +20,11 @@
 uint8_t audio_read(uint16_t addr);
 void audio_write(uint16_t addr, uint8_t val);
 
+/* Only upload and show frames that differ from the last. */
+#ifndef PEANUT_GB_USE_LINE_HASH
+# define PEANUT_GB_USE_LINE_HASH 1
+#endif
+
 #include "../../peanut_gb.h"
 
 enum {
@@ -632,6 +637,12 @@ int main(int argc, char **argv)
 	enum gb_init_error_e gb_ret;
 	unsigned int fast_mode = 1;
 	unsigned int fast_mode_timer = 1;
+	/* Rewind history of about a minute of gameplay, and whether the rewind
+	 * key is held. */
+	const size_t rewind_arena_size = 1024 * 1024;
+	void *rewind_arena = NULL;
+	struct gb_rewind_s rewind_history;
+	unsigned int rewinding = 0;
 	/* Record save file every 60 seconds. */
 	int save_timer = 60;
 	/* Must be freed */
@@ -844,6 +855,18 @@ int main(int argc, char **argv)
 	if(priv.save_size > 0)
 		read_cart_ram_file(save_file_name, &priv.cart_ram, priv.save_size);
 
+	/* Rewind is disabled if the arena cannot be allocated. */
+	rewind_arena = SDL_malloc(rewind_arena_size);
+	if(rewind_arena == NULL || gb_rewind_init(&rewind_history, &gb,
+				rewind_arena, rewind_arena_size) < 0)
+	{
+		SDL_LogMessage(LOG_CATERGORY_PEANUTSDL,
+				SDL_LOG_PRIORITY_WARN,
+				"Unable to initialise rewind");
+		SDL_free(rewind_arena);
+		rewind_arena = NULL;
+	}
+
 	/* Set the RTC of the game cartridge. Only used by games that support it. */
 	{
 		time_t rawtime;
@@ -1029,6 +1052,10 @@ int main(int argc, char **argv)
 		static double rtc_timer = 0;
 		static unsigned int selected_palette = 3;
 		static unsigned int dump_bmp = 0;
+		static unsigned int frame_skip_mode = 0;
+		/* Set when the screen must be drawn again even if the frame is
+		 * the same, such as when the palette or window changes. */
+		static unsigned int redraw = 1;
 
 		/* Calculate the time taken to draw frame, then later add a
 		 * delay to cap at 60 fps. */
@@ -1044,6 +1071,10 @@ int main(int argc, char **argv)
 			case SDL_QUIT:
 				goto quit;
 
+			case SDL_WINDOWEVENT:
+				redraw = 1;
+				break;
+
 			case SDL_CONTROLLERBUTTONDOWN:
 				switch(event.cbutton.button)
 				{
@@ -1186,6 +1217,10 @@ int main(int argc, char **argv)
 				case SDLK_r:
 					gb_reset(&gb);
 					break;
+
+				case SDLK_w:
+					rewinding = rewind_arena != NULL;
+					break;
 #if ENABLE_LCD
 
 				case SDLK_i:
@@ -1193,7 +1228,12 @@ int main(int argc, char **argv)
 					break;
 
 				case SDLK_o:
-					gb.direct.frame_skip = !gb.direct.frame_skip;
+					/* Cycle between no frame skip, 30 FPS and
+					 * adaptive frame skip. */
+					frame_skip_mode = (frame_skip_mode + 1) % 3;
+					gb.direct.frame_skip = frame_skip_mode == 1;
+					gb_set_frame_skip_auto(&gb,
+							frame_skip_mode == 2 ? 3 : 0);
 					break;
 
 				case SDLK_b:
@@ -1215,6 +1255,7 @@ int main(int argc, char **argv)
 					if(event.key.keysym.mod == KMOD_LSHIFT)
 					{
 						auto_assign_palette(&priv, gb_colour_hash(&gb));
+						redraw = 1;
 						break;
 					}
 
@@ -1222,6 +1263,7 @@ int main(int argc, char **argv)
 						selected_palette = 0;
 
 					manual_assign_palette(&priv, selected_palette);
+					redraw = 1;
 					break;
 				}
 
@@ -1274,6 +1316,10 @@ int main(int argc, char **argv)
 					fast_mode = 1;
 					break;
 
+				case SDLK_w:
+					rewinding = 0;
+					break;
+
 				case SDLK_f:
 					if(fullscreen)
 					{
@@ -1311,9 +1357,22 @@ int main(int argc, char **argv)
 			}
 		}
 
+		/* Whilst rewinding, go back one frame and run it to redraw the
+		 * screen. Otherwise, add each frame to the rewind history. */
+		if(rewinding)
+			gb_rewind_pop(&rewind_history, &gb);
+
 		/* Execute CPU cycles until the screen has to be redrawn. */
 		gb_run_frame(&gb);
 
+#if PEANUT_GB_USE_LINE_HASH
+		/* Frames not shown in fast mode may still have changed. */
+		redraw |= gb_frame_changed(&gb);
+#endif
+
+		if(!rewinding && rewind_arena != NULL)
+			gb_rewind_push(&rewind_history, &gb);
+
 		/* Tick the internal RTC when 1 second has passed. */
 		rtc_timer += target_speed_ms / (double) fast_mode;
 
@@ -1340,11 +1399,19 @@ int main(int argc, char **argv)
 #endif
 
 #if ENABLE_LCD
-		/* Copy frame buffer to SDL screen. */
-		SDL_UpdateTexture(texture, NULL, &priv.fb, LCD_WIDTH * sizeof(uint16_t));
-		SDL_RenderClear(renderer);
-		SDL_RenderCopy(renderer, texture, NULL, NULL);
-		SDL_RenderPresent(renderer);
+		/* Copy frame buffer to SDL screen, unless it is the same as
+		 * the frame already shown. */
+		if(redraw)
+		{
+			SDL_UpdateTexture(texture, NULL, &priv.fb,
+					LCD_WIDTH * sizeof(uint16_t));
+			SDL_RenderClear(renderer);
+			SDL_RenderCopy(renderer, texture, NULL, NULL);
+			SDL_RenderPresent(renderer);
+#if PEANUT_GB_USE_LINE_HASH
+			redraw = 0;
+#endif
+		}
 
 		if(dump_bmp)
 		{
@@ -1366,6 +1433,12 @@ int main(int argc, char **argv)
 		/* Use a delay that will draw the screen at a rate of 59.7275 Hz. */
 		new_ticks = SDL_GetTicks();
 
+#if ENABLE_LCD
+		/* Let the adaptive frame skip know whether we are keeping up. */
+		gb_frame_skip_report(&gb, (new_ticks - old_ticks) * 1000,
+				target_speed_ms * 1000);
+#endif
+
 		/* Since we can only delay for a maximum resolution of 1ms, we
 		 * can accumulate the error and compensate for the delay
 		 * accuracy when the delay compensation surpasses 1ms. */
@@ -1446,6 +1519,7 @@ quit:
 out:
 	SDL_free(priv.rom);
 	SDL_free(priv.cart_ram);
+	SDL_free(rewind_arena);
 
 	/* If the save file name was automatically generated (which required memory
 	 * allocated on the help), then free it here. */
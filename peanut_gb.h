@@ -105,6 +105,143 @@
 # define PEANUT_GB_USE_INTRINSICS 1
 #endif
 
+/* Keep a table of host pointers for each 4 KiB page of the Game Boy address
+ * space, so that most memory accesses are a single indexed load instead of
+ * being decoded by __gb_read() and __gb_write(). Increases the size of the
+ * emulator context by 256 bytes on 64-bit platforms. */
+#ifndef PEANUT_GB_USE_PAGE_TABLE
+# define PEANUT_GB_USE_PAGE_TABLE 1
+#endif
+
+/* Dispatch opcodes through a table of label addresses instead of a switch
+ * statement, so that each instruction jumps directly to the next one while no
+ * event is due. CB prefixed opcodes are also dispatched to one of 256
+ * specialised handlers instead of being decoded at run time. This increases
+ * code size, and requires the "labels as values" extension of GCC and Clang.
+ * The switch statement is used on other compilers. */
+#ifndef PEANUT_GB_THREADED_DISPATCH
+# define PEANUT_GB_THREADED_DISPATCH 0
+#endif
+#if PEANUT_GB_THREADED_DISPATCH && !defined(__GNUC__)
+# undef PEANUT_GB_THREADED_DISPATCH
+# define PEANUT_GB_THREADED_DISPATCH 0
+#endif
+
+/* Cache the ROM that is read through the gb_rom_read() callback in lines of
+ * 64 bytes, so that the instructions and data of hot loops are not read
+ * through the callback again and again. This is only useful with gb_init() and
+ * a slow gb_rom_read(), such as one reading from external flash, as
+ * gb_init_direct() reads the ROM directly. Increases the size of the emulator
+ * context by 68 bytes for each line. */
+#ifndef PEANUT_GB_USE_ROM_CACHE
+# define PEANUT_GB_USE_ROM_CACHE 0
+#endif
+
+/* Number of lines in the ROM cache. Must be a power of two. */
+#ifndef PEANUT_GB_ROM_CACHE_LINES
+# define PEANUT_GB_ROM_CACHE_LINES 64
+#endif
+
+/* Keep a copy of the 384 tiles in VRAM with one byte for each pixel, so that
+ * the background and window are drawn with a table lookup per pixel instead
+ * of extracting each pixel from the two bit planes of the tile. Tiles are
+ * decoded when they are drawn after being written to. Increases the size of
+ * the emulator context by about 24 KiB, and writes to VRAM are no longer done
+ * through the page table. */
+#ifndef PEANUT_GB_USE_TILE_CACHE
+# define PEANUT_GB_USE_TILE_CACHE 0
+#endif
+#if PEANUT_GB_USE_TILE_CACHE && !ENABLE_LCD
+# undef PEANUT_GB_USE_TILE_CACHE
+# define PEANUT_GB_USE_TILE_CACHE 0
+#endif
+
+/* Keep the list of sprites to draw on each line, sorted by priority, and only
+ * rebuild it when the position of a sprite or the sprite size changes. Without
+ * this, all 40 sprites are checked and sorted for each line. Only used with
+ * PEANUT_GB_HIGH_LCD_ACCURACY. Increases the size of the emulator context by
+ * about 1.6 KiB. */
+#ifndef PEANUT_GB_USE_SPRITE_LINES
+# define PEANUT_GB_USE_SPRITE_LINES 1
+#endif
+#if PEANUT_GB_USE_SPRITE_LINES && (!ENABLE_LCD || !PEANUT_GB_HIGH_LCD_ACCURACY)
+# undef PEANUT_GB_USE_SPRITE_LINES
+# define PEANUT_GB_USE_SPRITE_LINES 0
+#endif
+
+/* Shade and compose the background, window and sprites several pixels at a
+ * time with SSE2 (x86) or NEON (ARM) instructions. Requires the tile cache.
+ * The portable code is used if neither instruction set is available. */
+#ifndef PEANUT_GB_USE_SIMD
+# define PEANUT_GB_USE_SIMD 0
+#endif
+#if PEANUT_GB_USE_SIMD && PEANUT_GB_USE_TILE_CACHE
+# if defined(__SSE2__) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define PGB_SIMD_SSE2 1
+#  include <emmintrin.h>
+#  ifdef __SSSE3__
+#   include <tmmintrin.h>
+#  endif
+# elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define PGB_SIMD_NEON 1
+#  include <arm_neon.h>
+# endif
+#endif
+#ifndef PGB_SIMD_SSE2
+# define PGB_SIMD_SSE2 0
+#endif
+#ifndef PGB_SIMD_NEON
+# define PGB_SIMD_NEON 0
+#endif
+
+/* Detect loops that only poll LY, STAT, IF, WRAM or HRAM, such as
+ * "LDH A, (LY); CP n; JR NZ", and skip their iterations until the next LCD,
+ * timer or serial event is due. The CPU state is the same as if every
+ * iteration had been executed. */
+#ifndef PEANUT_GB_IDLE_LOOP_SKIP
+# define PEANUT_GB_IDLE_LOOP_SKIP 1
+#endif
+
+/* Keep a bitmap of the 256 byte pages of WRAM, VRAM, OAM and Cart RAM that
+ * were written to since they were last cleared with gb_dirty_clear(). This
+ * adds a few instructions to each write to memory, and increases the size of
+ * the emulator context by about 200 bytes. */
+#ifndef PEANUT_GB_USE_DIRTY_PAGES
+# define PEANUT_GB_USE_DIRTY_PAGES 0
+#endif
+
+/* Let the front-end allocate WRAM, VRAM, OAM and the I/O registers with
+ * gb_init_memory(), instead of holding them within the emulator context. This
+ * allows them to be placed anywhere, such as in shared memory or in one arena
+ * for many contexts, and reduces the size of the context by about 16 KiB.
+ * Each access to these memories then reads the pointer from the context. */
+#ifndef PEANUT_GB_EXTERNAL_MEMORY
+# define PEANUT_GB_EXTERNAL_MEMORY 0
+#endif
+
+/* Track the 256 byte pages of WRAM, VRAM and Cart RAM that were written to
+ * since the context was last given to gb_fork(), so that forking again from
+ * the same unchanged source only copies the pages that were written to. This
+ * adds a store to each write to memory, and increases the size of the
+ * emulator context by about 600 bytes. */
+#ifndef PEANUT_GB_USE_FORK_TRACKING
+# define PEANUT_GB_USE_FORK_TRACKING 0
+#endif
+
+/* Keep a hash of each line as it is drawn, so that the front-end may find out
+ * with gb_frame_changed() and gb_lines_changed() which lines differ from the
+ * previous frame, such as to not upload or encode a frame that is the same.
+ * Adds the hash of 160 bytes to each line drawn, and increases the size of the
+ * emulator context by about 600 bytes. Requires ENABLE_LCD. */
+#ifndef PEANUT_GB_USE_LINE_HASH
+# define PEANUT_GB_USE_LINE_HASH 0
+#endif
+#if PEANUT_GB_USE_LINE_HASH && !ENABLE_LCD
+# undef PEANUT_GB_USE_LINE_HASH
+# define PEANUT_GB_USE_LINE_HASH 0
+#endif
+
 /* Only include function prototypes. At least one file must *not* have this
  * defined. */
 // #define PEANUT_GB_HEADER_ONLY
@@ -144,6 +281,30 @@
 #define CRAM_BANK_SIZE  0x2000
 #define VRAM_BANK_SIZE  0x2000
 
+/* Page table characteristics. Each page covers 4 KiB of the address space,
+ * which is the granularity of the PEANUT_GB_GET_MSN16() decode. */
+#define MEM_PAGE_COUNT	0x10
+#define MEM_PAGE_SIZE	0x1000
+#define MEM_PAGE_MASK	(MEM_PAGE_SIZE - 1)
+
+/* Size of each page of memory tracked by PEANUT_GB_USE_DIRTY_PAGES, and the
+ * largest Cart RAM that may be tracked. */
+#define DIRTY_PAGE_SIZE	0x100
+#define DIRTY_CRAM_SIZE	0x20000
+
+/* Flags of each page tracked by PEANUT_GB_USE_FORK_TRACKING. A page is written
+ * to since the context was last forked into, or since it was last forked
+ * from. */
+#define FORK_WRITTEN_DST	0x01
+#define FORK_WRITTEN_SRC	0x02
+#define FORK_WRITTEN		(FORK_WRITTEN_DST | FORK_WRITTEN_SRC)
+
+/* Maximum length in bytes of the body of an idle loop, excluding the JR. */
+#define IDLE_LOOP_MAX_LEN	0x10
+
+/* Size of each line of the ROM cache. */
+#define ROM_CACHE_LINE_SIZE	0x40
+
 /* DIV Register is incremented at rate of 16384Hz.
  * 4194304 / 16384 = 256 clock cycles for one increment. */
 #define DIV_CYCLES          256
@@ -221,6 +382,9 @@
 #define VRAM_BMAP_2         (0x9C00 - VRAM_ADDR)
 #define VRAM_TILES_3        (0x8000 - VRAM_ADDR + VRAM_BANK_SIZE)
 #define VRAM_TILES_4        (0x8800 - VRAM_ADDR + VRAM_BANK_SIZE)
+#define VRAM_TILES_SIZE     0x1800
+#define VRAM_TILE_SIZE      0x10
+#define VRAM_TILE_COUNT     (VRAM_TILES_SIZE / VRAM_TILE_SIZE)
 
 /* Interrupt jump addresses */
 #define VBLANK_INTR_ADDR    0x0040
@@ -281,6 +445,18 @@
 # endif
 #endif /* !defined(PGB_UNREACHABLE) */
 
+/* The PGB_NOINLINE macro keeps rarely used slow paths out of the functions
+ * that call them. */
+#if !defined(PGB_NOINLINE)
+# if defined(__GNUC__)
+#  define PGB_NOINLINE __attribute__((noinline))
+# elif defined(_MSC_VER) && _MSC_VER >= 1300
+#  define PGB_NOINLINE __declspec(noinline)
+# else
+#  define PGB_NOINLINE
+# endif
+#endif /* !defined(PGB_NOINLINE) */
+
 #if !defined(PGB_UNLIKELY)
 # if __has_builtin(__builtin_expect)
 #  define PGB_UNLIKELY(expr) __builtin_expect(!!(expr), 0)
@@ -313,43 +489,68 @@
 # endif
 #endif /* PEANUT_GB_USE_INTRINSICS */
 
+/* Bits of the flag register. */
+#define PEANUT_GB_CPUFLAG_BIT_ZERO	7
+#define PEANUT_GB_CPUFLAG_BIT_ARITH	6
+#define PEANUT_GB_CPUFLAG_BIT_HALFC	5
+#define PEANUT_GB_CPUFLAG_BIT_CARRY	4
+#define PEANUT_GB_CPUFLAG_MASK_ZERO	(1 << PEANUT_GB_CPUFLAG_BIT_ZERO)
+#define PEANUT_GB_CPUFLAG_MASK_ARITH	(1 << PEANUT_GB_CPUFLAG_BIT_ARITH)
+#define PEANUT_GB_CPUFLAG_MASK_HALFC	(1 << PEANUT_GB_CPUFLAG_BIT_HALFC)
+#define PEANUT_GB_CPUFLAG_MASK_CARRY	(1 << PEANUT_GB_CPUFLAG_BIT_CARRY)
+
+/* The PGB_SET_* macros move a flag value of 0 or 1 to its bit in the flag
+ * register, so that all the flags changed by an instruction are written to
+ * gb->cpu_reg.f.reg at once, instead of with a read-modify-write of each
+ * bit-field. The PGB_GET_* macros return the value of a flag in f. */
+#define PGB_SET_ZERO(x)		((uint8_t)(!!(x)) << PEANUT_GB_CPUFLAG_BIT_ZERO)
+#define PGB_SET_ARITH(x)	((uint8_t)(!!(x)) << PEANUT_GB_CPUFLAG_BIT_ARITH)
+#define PGB_SET_HALFC(x)	((uint8_t)(!!(x)) << PEANUT_GB_CPUFLAG_BIT_HALFC)
+#define PGB_SET_CARRY(x)	((uint8_t)(!!(x)) << PEANUT_GB_CPUFLAG_BIT_CARRY)
+#define PGB_GET_ZERO(f)		(((f) >> PEANUT_GB_CPUFLAG_BIT_ZERO) & 1)
+#define PGB_GET_ARITH(f)	(((f) >> PEANUT_GB_CPUFLAG_BIT_ARITH) & 1)
+#define PGB_GET_HALFC(f)	(((f) >> PEANUT_GB_CPUFLAG_BIT_HALFC) & 1)
+#define PGB_GET_CARRY(f)	(((f) >> PEANUT_GB_CPUFLAG_BIT_CARRY) & 1)
+
 #if defined(PGB_INTRIN_SBC)
 # define PGB_INSTR_SBC_R8(r,cin)						\
 	{									\
 		uint8_t temp;							\
-		gb->cpu_reg.f.f_bits.c = PGB_INTRIN_SBC(gb->cpu_reg.a,r,cin,temp);\
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0;\
-		gb->cpu_reg.f.f_bits.n = 1;					\
-		gb->cpu_reg.f.f_bits.z = (temp == 0x00);			\
+		const bool carry = PGB_INTRIN_SBC(gb->cpu_reg.a,r,cin,temp);	\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(temp == 0x00) |		\
+			PGB_SET_ARITH(1) |					\
+			PGB_SET_HALFC((gb->cpu_reg.a ^ r ^ temp) & 0x10) |	\
+			PGB_SET_CARRY(carry);					\
 		gb->cpu_reg.a = temp;						\
 	}
 
 # define PGB_INSTR_CP_R8(r)							\
 	{									\
 		uint8_t temp;							\
-		gb->cpu_reg.f.f_bits.c = PGB_INTRIN_SBC(gb->cpu_reg.a,r,0,temp);\
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0;\
-		gb->cpu_reg.f.f_bits.n = 1;					\
-		gb->cpu_reg.f.f_bits.z = (temp == 0x00);			\
+		const bool carry = PGB_INTRIN_SBC(gb->cpu_reg.a,r,0,temp);	\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(temp == 0x00) |		\
+			PGB_SET_ARITH(1) |					\
+			PGB_SET_HALFC((gb->cpu_reg.a ^ r ^ temp) & 0x10) |	\
+			PGB_SET_CARRY(carry);					\
 	}
 #else
 # define PGB_INSTR_SBC_R8(r,cin)						\
 	{									\
 		uint16_t temp = gb->cpu_reg.a - (r + cin);			\
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;		\
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f.f_bits.n = 1;					\
-		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);		\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO((temp & 0xFF) == 0x00) |	\
+			PGB_SET_ARITH(1) |					\
+			PGB_SET_HALFC((gb->cpu_reg.a ^ r ^ temp) & 0x10) |	\
+			PGB_SET_CARRY(temp & 0xFF00);				\
 		gb->cpu_reg.a = (temp & 0xFF);					\
 	}
 
 # define PGB_INSTR_CP_R8(r)							\
 	{									\
 		uint16_t temp = gb->cpu_reg.a - r;				\
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;		\
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f.f_bits.n = 1;					\
-		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);		\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO((temp & 0xFF) == 0x00) |	\
+			PGB_SET_ARITH(1) |					\
+			PGB_SET_HALFC((gb->cpu_reg.a ^ r ^ temp) & 0x10) |	\
+			PGB_SET_CARRY(temp & 0xFF00);				\
 	}
 #endif  /* PGB_INTRIN_SBC */
 
@@ -357,51 +558,46 @@
 # define PGB_INSTR_ADC_R8(r,cin)						\
 	{									\
 		uint8_t temp;							\
-		gb->cpu_reg.f.f_bits.c = PGB_INTRIN_ADC(gb->cpu_reg.a,r,cin,temp);\
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f.f_bits.n = 0;					\
-		gb->cpu_reg.f.f_bits.z = (temp == 0x00);			\
+		const bool carry = PGB_INTRIN_ADC(gb->cpu_reg.a,r,cin,temp);	\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(temp == 0x00) |		\
+			PGB_SET_HALFC((gb->cpu_reg.a ^ r ^ temp) & 0x10) |	\
+			PGB_SET_CARRY(carry);					\
 		gb->cpu_reg.a = temp;						\
 	}
 #else
 # define PGB_INSTR_ADC_R8(r,cin)						\
 	{									\
 		uint16_t temp = gb->cpu_reg.a + r + cin;			\
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;		\
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.a ^ r ^ temp) & 0x10) > 0; \
-		gb->cpu_reg.f.f_bits.n = 0;					\
-		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);		\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO((temp & 0xFF) == 0x00) |	\
+			PGB_SET_HALFC((gb->cpu_reg.a ^ r ^ temp) & 0x10) |	\
+			PGB_SET_CARRY(temp & 0xFF00);				\
 		gb->cpu_reg.a = (temp & 0xFF);					\
 	}
 #endif /* PGB_INTRIN_ADC */
 
 #define PGB_INSTR_INC_R8(r)							\
 	r++;									\
-	gb->cpu_reg.f.f_bits.h = ((r & 0x0F) == 0x00);				\
-	gb->cpu_reg.f.f_bits.n = 0;						\
-	gb->cpu_reg.f.f_bits.z = (r == 0x00)
+	gb->cpu_reg.f.reg = (gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_CARRY) |\
+		PGB_SET_ZERO(r == 0x00) | PGB_SET_HALFC((r & 0x0F) == 0x00)
 
 #define PGB_INSTR_DEC_R8(r)							\
 	r--;									\
-	gb->cpu_reg.f.f_bits.h = ((r & 0x0F) == 0x0F);				\
-	gb->cpu_reg.f.f_bits.n = 1;						\
-	gb->cpu_reg.f.f_bits.z = (r == 0x00)
+	gb->cpu_reg.f.reg = (gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_CARRY) |\
+		PGB_SET_ZERO(r == 0x00) | PGB_SET_ARITH(1) |			\
+		PGB_SET_HALFC((r & 0x0F) == 0x0F)
 
 #define PGB_INSTR_XOR_R8(r)							\
 	gb->cpu_reg.a ^= r;							\
-	gb->cpu_reg.f.reg = 0;							\
-	gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0x00)
+	gb->cpu_reg.f.reg = PGB_SET_ZERO(gb->cpu_reg.a == 0x00)
 
 #define PGB_INSTR_OR_R8(r)							\
 	gb->cpu_reg.a |= r;							\
-        gb->cpu_reg.f.reg = 0;							\
-	gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0x00)
+	gb->cpu_reg.f.reg = PGB_SET_ZERO(gb->cpu_reg.a == 0x00)
 
 #define PGB_INSTR_AND_R8(r)							\
 	gb->cpu_reg.a &= r;							\
-	gb->cpu_reg.f.reg = 0;							\
-	gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0x00);			\
-	gb->cpu_reg.f.f_bits.h = 1
+	gb->cpu_reg.f.reg = PGB_SET_ZERO(gb->cpu_reg.a == 0x00) |		\
+		PGB_SET_HALFC(1)
 
 #if PEANUT_GB_IS_LITTLE_ENDIAN
 # define PEANUT_GB_GET_LSB16(x) (x & 0xFF)
@@ -425,13 +621,23 @@ struct cpu_registers_s
 # define PEANUT_GB_LE_REG(x,y) y,x
 #endif
 	/* Define specific bits of Flag register. */
+	/* Bit-fields are allocated in the same order as bytes, so that the
+	 * flags are at the same bits of reg on big endian platforms. */
 	union {
 		struct {
+#if PEANUT_GB_IS_LITTLE_ENDIAN
 			uint8_t  : 4; /* Unused. */
 			uint8_t c: 1; /* Carry flag. */
 			uint8_t h: 1; /* Half carry flag. */
 			uint8_t n: 1; /* Add/sub flag. */
 			uint8_t z: 1; /* Zero flag. */
+#else
+			uint8_t z: 1; /* Zero flag. */
+			uint8_t n: 1; /* Add/sub flag. */
+			uint8_t h: 1; /* Half carry flag. */
+			uint8_t c: 1; /* Carry flag. */
+			uint8_t  : 4; /* Unused. */
+#endif
 		} f_bits;
 		uint8_t reg;
 	} f;
@@ -494,6 +700,11 @@ struct count_s
 	uint_fast16_t serial_count;	/* Serial Counter */
 	uint_fast32_t rtc_count;	/* RTC Counter */
 	uint_fast32_t lcd_off_count;	/* Cycles LCD has been disabled */
+	uint_fast32_t sched_cycles;	/* Cycles not yet applied to counters */
+	uint_fast32_t sched_next;	/* Cycles until next counter event */
+#if PEANUT_GB_IDLE_LOOP_SKIP
+	uint_least64_t idle_cycles;	/* Cycles skipped in idle loops */
+#endif
 };
 
 #if ENABLE_LCD
@@ -547,6 +758,70 @@ enum gb_init_error_e
 	GB_INIT_INVALID_MAX
 };
 
+/**
+ * Errors that may occur when loading a saved state.
+ */
+enum gb_state_error_e
+{
+	GB_STATE_NO_ERROR = 0,
+	/* The buffer is too small or does not hold a saved state. */
+	GB_STATE_INVALID,
+	/* The state was saved by an incompatible version of Peanut-GB. */
+	GB_STATE_UNSUPPORTED_VERSION,
+	/* The state was saved with a different game. */
+	GB_STATE_ROM_MISMATCH,
+
+	GB_STATE_INVALID_MAX
+};
+
+/**
+ * Memories tracked by PEANUT_GB_USE_DIRTY_PAGES.
+ */
+enum gb_dirty_mem_e
+{
+	GB_DIRTY_WRAM = 0,
+	GB_DIRTY_VRAM,
+	GB_DIRTY_OAM,
+	GB_DIRTY_CART_RAM,
+
+	GB_DIRTY_MEM_MAX
+};
+
+#if PEANUT_GB_EXTERNAL_MEMORY
+/**
+ * Memory of an emulator context, which may be given to gb_init_memory().
+ */
+struct gb_memory_s
+{
+	uint8_t wram[WRAM_SIZE];
+	uint8_t vram[VRAM_SIZE];
+	uint8_t oam[OAM_SIZE];
+	uint8_t hram_io[HRAM_IO_SIZE];
+};
+#endif
+
+/**
+ * A ROM held in memory that may be shared by any number of emulator contexts.
+ * The cartridge header is checked and decoded once by gb_rom_init(), instead
+ * of for each context. Set with gb_rom_init(), and given to gb_init_rom().
+ */
+struct gb_rom_s
+{
+	const uint8_t *data;
+	size_t size;
+
+	/* Number of contexts that were given this ROM with gb_init_rom() and
+	 * not yet released with gb_release_rom(). */
+	unsigned int refs;
+
+	/* Decoded cartridge header. */
+	int8_t mbc;
+	uint8_t cart_ram;
+	uint16_t num_rom_banks_mask;
+	uint8_t num_ram_banks;
+	bool cart_is_mbc3O;
+};
+
 /**
  * Return codes for serial receive function, mainly for clarity.
  */
@@ -556,6 +831,30 @@ enum gb_serial_rx_ret_e
 	GB_SERIAL_RX_NO_CONNECTION = 1
 };
 
+/**
+ * Flags given to gb_run_frames().
+ */
+enum gb_run_flags_e
+{
+	/* Do not draw the last frame either. */
+	GB_RUN_NO_RENDER = 0x01
+};
+
+/**
+ * Pixel formats of a host frame buffer set with gb_init_framebuffer().
+ */
+enum gb_framebuffer_format_e
+{
+	/* One byte per pixel, being the low byte of the LUT entry. */
+	GB_FRAMEBUFFER_INDEX8 = 0,
+	/* One native endian uint16_t per pixel. */
+	GB_FRAMEBUFFER_RGB565,
+	/* One native endian uint32_t per pixel. */
+	GB_FRAMEBUFFER_XRGB8888,
+
+	GB_FRAMEBUFFER_FORMAT_MAX
+};
+
 union cart_rtc
 {
 	struct
@@ -621,6 +920,29 @@ struct gb_s
 	/* Read byte from boot ROM at given address. */
 	uint8_t (*gb_bootrom_read)(struct gb_s*, const uint_fast16_t addr);
 
+	/* ROM and cart RAM buffers given by gb_init_direct() or
+	 * gb_set_cart_ram(). NULL if the front-end callbacks are used. */
+	struct
+	{
+		const uint8_t *rom;
+		size_t rom_size;
+		uint8_t *ram;
+		size_t ram_size;
+		/* Shared ROM given to gb_init_rom(), or NULL. */
+		struct gb_rom_s *shared;
+	} cart_mem;
+
+#if PEANUT_GB_USE_ROM_CACHE
+	/* Lines of ROM read through gb_rom_read(). Each line is tagged with
+	 * its ROM address divided by ROM_CACHE_LINE_SIZE plus one, so that a
+	 * tag of 0 marks an empty line. */
+	struct
+	{
+		uint_least32_t tag[PEANUT_GB_ROM_CACHE_LINES];
+		uint8_t line[PEANUT_GB_ROM_CACHE_LINES][ROM_CACHE_LINE_SIZE];
+	} rom_cache;
+#endif
+
 	struct
 	{
 		bool gb_halt	: 1;
@@ -658,11 +980,93 @@ struct gb_s
 	//struct gb_registers_s gb_reg;
 	struct count_s counter;
 
-	/* TODO: Allow implementation to allocate WRAM, VRAM and Frame Buffer. */
+#if PEANUT_GB_EXTERNAL_MEMORY
+	/* Set by gb_init_memory(). */
+	uint8_t *wram;
+	uint8_t *vram;
+	uint8_t *oam;
+	uint8_t *hram_io;
+#else
 	uint8_t wram[WRAM_SIZE];
 	uint8_t vram[VRAM_SIZE];
 	uint8_t oam[OAM_SIZE];
 	uint8_t hram_io[HRAM_IO_SIZE];
+#endif
+
+#if PEANUT_GB_USE_PAGE_TABLE
+	/* Host pointers to the start of each 4 KiB page of the address space.
+	 * A NULL entry means that the page must be decoded by __gb_read() or
+	 * __gb_write(), such as for memory mapped I/O or the cartridge.
+	 * Rebuilt by __gb_update_page_table() whenever the mapping changes.
+	 * As these point within the context, the context must not be copied
+	 * by value. */
+	struct
+	{
+		const uint8_t *read[MEM_PAGE_COUNT];
+		uint8_t *write[MEM_PAGE_COUNT];
+#if PEANUT_GB_USE_DIRTY_PAGES
+		/* Dirty page bitmap of each page that may be written. */
+		uint8_t *dirty[MEM_PAGE_COUNT];
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		/* Fork flags of each page that may be written. */
+		uint8_t *fork[MEM_PAGE_COUNT];
+#endif
+	} page_table;
+#endif
+
+#if PEANUT_GB_USE_TILE_CACHE
+	/* Colour index of each pixel of each tile, from left to right. A tile
+	 * is decoded again from VRAM when its bit in dirty is set. */
+	struct
+	{
+		uint8_t pixel[VRAM_TILE_COUNT][8][8];
+		uint8_t dirty[VRAM_TILE_COUNT / 8];
+	} tile_cache;
+#endif
+
+#if PEANUT_GB_USE_SPRITE_LINES
+	/* Sprites to draw on each line, from highest to lowest priority. */
+	struct
+	{
+		uint8_t count[LCD_HEIGHT];
+		uint8_t sprite[LCD_HEIGHT][MAX_SPRITES_LINE];
+		/* Set when the lists must be rebuilt before the next line is
+		 * drawn. */
+		bool dirty;
+	} sprite_lines;
+#endif
+
+#if PEANUT_GB_USE_DIRTY_PAGES
+	/* Bit n of each bitmap is set when page n of that memory is written
+	 * to. Read with gb_dirty_get(). */
+	struct
+	{
+		uint8_t wram[WRAM_SIZE / DIRTY_PAGE_SIZE / 8];
+		uint8_t vram[VRAM_SIZE / DIRTY_PAGE_SIZE / 8];
+		uint8_t oam[1];
+		uint8_t cart_ram[DIRTY_CRAM_SIZE / DIRTY_PAGE_SIZE / 8];
+	} dirty;
+#endif
+
+#if PEANUT_GB_USE_FORK_TRACKING
+	/* FORK_WRITTEN_* flags of each page of each memory, used by
+	 * gb_fork(). */
+	struct
+	{
+		uint8_t wram[WRAM_SIZE / DIRTY_PAGE_SIZE];
+		uint8_t vram[VRAM_SIZE / DIRTY_PAGE_SIZE];
+		uint8_t cart_ram[DIRTY_CRAM_SIZE / DIRTY_PAGE_SIZE];
+		/* Context this context was last forked from, and its serial
+		 * at that time. */
+		const struct gb_s *parent;
+		unsigned long parent_serial;
+		/* Changed to a new serial when this context is initialised, and
+		 * when it is forked from after any of its pages were written
+		 * to. */
+		unsigned long serial;
+	} fork;
+#endif
 
 	struct
 	{
@@ -689,6 +1093,15 @@ struct gb_s
 				const uint8_t *pixels,
 				const uint_fast8_t line);
 
+		/* Host frame buffer set by gb_init_framebuffer(). Lines are
+		 * written here instead of calling lcd_draw_line when this is
+		 * not NULL. */
+		void *fb;
+		size_t fb_pitch;
+		enum gb_framebuffer_format_e fb_format;
+		/* Colour of each pixel value, including the layer bits. */
+		uint32_t fb_lut[0x24];
+
 		/* Palettes */
 		uint8_t bg_palette[4];
 		uint8_t sp_palette[8];
@@ -696,9 +1109,35 @@ struct gb_s
 		uint8_t window_clear;
 		uint8_t WY;
 
-		/* Only support 30fps frame skip. */
-		bool frame_skip_count : 1;
+		/* Set if the lines of the current frame are not drawn because
+		 * of frame skip. */
+		bool skip_frame : 1;
 		bool interlace_count : 1;
+		/* Set by gb_run_frames() while lines must not be drawn. */
+		bool skip_render : 1;
+
+		/* Number of frames skipped since the last frame was drawn. */
+		uint8_t frame_skip_count;
+		/* Number of frames skipped for each frame drawn, set by
+		 * gb_set_frame_skip(). If 0, direct.frame_skip skips every
+		 * other frame. */
+		uint8_t frame_skip_ratio;
+		/* Most frames skipped in a row by the adaptive frame skip set
+		 * by gb_set_frame_skip_auto(), or 0 if it is not enabled. */
+		uint8_t frame_skip_max;
+		/* Time that the front-end is behind by, as reported by
+		 * gb_frame_skip_report(). */
+		uint_fast32_t frame_debt;
+		/* Frames drawn and skipped since the last reset. */
+		uint_fast32_t frames_drawn;
+		uint_fast32_t frames_skipped;
+
+#if PEANUT_GB_USE_LINE_HASH
+		/* Hash of each line when it was last drawn, and a bitmap of
+		 * the lines that changed when drawn in the current frame. */
+		uint32_t line_hash[LCD_HEIGHT];
+		uint8_t line_changed[LCD_HEIGHT / 8];
+#endif
 	} display;
 
 	/**
@@ -741,6 +1180,69 @@ struct gb_s
 	} direct;
 };
 
+/**
+ * Rewind history. Holds the newest saved state in full, and the older states
+ * as deltas in a ring within an arena given by the front-end. When the ring is
+ * full, the oldest deltas are discarded. Set with gb_rewind_init().
+ */
+struct gb_rewind_s
+{
+	/* Newest saved state, and a buffer for the next state. */
+	uint8_t *state;
+	uint8_t *next;
+	size_t state_size;
+	/* Whether the newest saved state is valid. */
+	bool has_state;
+
+	/* Each delta is stored as its length, the encoded delta and its length
+	 * again, so that the ring may be walked from either end. */
+	uint8_t *ring;
+	size_t ring_size;
+	/* Offset of the end of the newest delta. */
+	size_t head;
+	/* Number of bytes used in the ring. */
+	size_t used;
+	/* Number of deltas in the ring. */
+	uint_fast32_t count;
+};
+
+/**
+ * Log of the joypad input of a recording, from a saved state, which may be
+ * replayed from any frame. States are saved at regular intervals while the log
+ * is recorded or replayed, so that seeking only replays the frames since the
+ * nearest of these keyframes. Set with gb_input_log_init() or
+ * gb_input_log_open().
+ */
+struct gb_input_log_s
+{
+	/* Buffer holding the number of frames in the log and its size in
+	 * bytes, the saved state at the first frame, and each change of the
+	 * joypad. A change is stored as the number of frames since the
+	 * previous change, followed by the joypad. The first used bytes of
+	 * this buffer, or all of it, may be written to a file as is. */
+	uint8_t *data;
+	size_t size;
+	size_t used;
+	size_t state_size;
+	uint_fast32_t frames;
+
+	/* Saved states of every interval frames, starting from frame
+	 * interval, of which the first keyframe_count are valid. */
+	uint8_t *keyframes;
+	uint_fast32_t keyframe_max;
+	uint_fast32_t keyframe_count;
+	uint_fast32_t interval;
+
+	/* Frame to be recorded or replayed next, and the joypad at that
+	 * frame. */
+	uint_fast32_t frame;
+	uint8_t joypad;
+	/* When recording, the frame of the last change. When replaying, the
+	 * frame of the next change, which is stored at pos. */
+	uint_fast32_t change_frame;
+	size_t pos;
+};
+
 #ifndef PEANUT_GB_HEADER_ONLY
 
 #define IO_JOYP	0x00
@@ -769,6 +1271,9 @@ struct gb_s
 #define IO_TAC_RATE_MASK	0x3
 #define IO_TAC_ENABLE_MASK	0x4
 
+/* Cycles between each increment of TIMA, selected by the TAC rate. */
+static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+
 /* LCD Mode defines. */
 #define IO_STAT_MODE_HBLANK		0
 #define IO_STAT_MODE_VBLANK		1
@@ -776,11 +1281,266 @@ struct gb_s
 #define IO_STAT_MODE_LCD_DRAW		3
 #define IO_STAT_MODE_VBLANK_OR_TRANSFER_MASK 0x1
 
+static void __gb_service_events(struct gb_s *gb);
+
+/**
+ * Internal function used to calculate the number of cycles until the next
+ * event: a TIMA overflow, serial transfer completion, RTC tick or LCD mode
+ * change. Increments of DIV and TIMA are not events, as these registers are
+ * brought up to date by __gb_sync_events() before they are accessed.
+ */
+static void __gb_schedule_next_event(struct gb_s *gb)
+{
+	/* Limit the number of cycles between updates so that the counters do
+	 * not overflow on platforms with 16-bit integers. */
+	uint_fast32_t next = SERIAL_CYCLES;
+
+	if(gb->hram_io[IO_LCDC] & LCDC_ENABLE)
+	{
+		uint_fast32_t lcd_event;
+
+		switch(gb->hram_io[IO_STAT] & STAT_MODE)
+		{
+		case IO_STAT_MODE_OAM_SCAN:
+			lcd_event = LCD_MODE2_OAM_SCAN_END;
+			break;
+
+		case IO_STAT_MODE_LCD_DRAW:
+			lcd_event = LCD_MODE3_LCD_DRAW_END;
+			break;
+
+		default:
+			lcd_event = LCD_LINE_CYCLES;
+			break;
+		}
+
+		/* The LCD may already be late for its next mode change if
+		 * more than one was due during the last update. */
+		if(gb->counter.lcd_count >= lcd_event)
+			next = 0;
+		else if(lcd_event - gb->counter.lcd_count < next)
+			next = lcd_event - gb->counter.lcd_count;
+	}
+	else if(LCD_FRAME_CYCLES - gb->counter.lcd_off_count < next)
+		next = LCD_FRAME_CYCLES - gb->counter.lcd_off_count;
+
+	if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START &&
+			SERIAL_CYCLES - gb->counter.serial_count < next)
+		next = SERIAL_CYCLES - gb->counter.serial_count;
+
+	if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+	{
+		const uint_fast32_t tac_cycles =
+			TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+		const uint_fast32_t overflow_cycles =
+			(0xFF - gb->hram_io[IO_TIMA]) * tac_cycles +
+			tac_cycles - gb->counter.tima_count;
+
+		if(overflow_cycles < next)
+			next = overflow_cycles;
+	}
+
+	if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0 &&
+			RTC_CYCLES - gb->counter.rtc_count < next)
+		next = RTC_CYCLES - gb->counter.rtc_count;
+
+	gb->counter.sched_next = next;
+}
+
+/**
+ * Internal function used to bring the timers, serial, RTC and LCD up to date
+ * before they are accessed by the CPU.
+ */
+static void __gb_sync_events(struct gb_s *gb)
+{
+	if(gb->counter.sched_cycles != 0)
+		__gb_service_events(gb);
+}
+
+#if PEANUT_GB_USE_PAGE_TABLE
+/**
+ * Internal function used to rebuild the page table. Must be called whenever
+ * the memory banking or the boot ROM mapping changes.
+ */
+static void __gb_update_page_table(struct gb_s *gb)
+{
+	uint_fast8_t i;
+
+	for(i = 0; i < MEM_PAGE_COUNT; i++)
+	{
+		gb->page_table.read[i] = NULL;
+		gb->page_table.write[i] = NULL;
+	}
+
+	/* ROM banks. Pages that are not entirely within the ROM buffer are
+	 * left to the slow path, which handles reads past the end of ROM. */
+	if(gb->cart_mem.rom != NULL)
+	{
+		int_fast32_t bank_offset;
+
+		if(gb->mbc == 1 && gb->cart_mode_select)
+			bank_offset = ((gb->selected_rom_bank & 0x1F) - 1) *
+				ROM_BANK_SIZE;
+		else
+			bank_offset = (gb->selected_rom_bank - 1) * ROM_BANK_SIZE;
+
+		for(i = PEANUT_GB_GET_MSN16(ROM_0_ADDR);
+				i < PEANUT_GB_GET_MSN16(VRAM_ADDR); i++)
+		{
+			int_fast32_t start = i * MEM_PAGE_SIZE;
+
+			if(i >= PEANUT_GB_GET_MSN16(ROM_N_ADDR))
+				start += bank_offset;
+
+			if(start < 0 ||
+				(size_t)start + MEM_PAGE_SIZE > gb->cart_mem.rom_size)
+				continue;
+
+			gb->page_table.read[i] = &gb->cart_mem.rom[start];
+		}
+
+		/* The boot ROM is mapped over the first 256 bytes. */
+		if(gb->hram_io[IO_BOOT] == 0)
+			gb->page_table.read[PEANUT_GB_GET_MSN16(ROM_0_ADDR)] = NULL;
+	}
+
+	/* Cart RAM. MBC2 RAM and the MBC3 RTC registers are not plain memory,
+	 * so they always use the slow path. */
+	if(gb->cart_mem.ram != NULL && gb->cart_ram && gb->enable_cart_ram &&
+			gb->mbc != 2 && !(gb->mbc == 3 && gb->cart_ram_bank >= 0x08))
+	{
+		size_t bank_offset = 0;
+
+		if((gb->cart_mode_select || gb->mbc != 1) &&
+				gb->cart_ram_bank < gb->num_ram_banks)
+			bank_offset = gb->cart_ram_bank * CRAM_BANK_SIZE;
+
+		for(i = 0; i < CRAM_BANK_SIZE / MEM_PAGE_SIZE; i++)
+		{
+			size_t start = bank_offset + i * MEM_PAGE_SIZE;
+
+			if(start + MEM_PAGE_SIZE > gb->cart_mem.ram_size)
+				break;
+
+			gb->page_table.read[PEANUT_GB_GET_MSN16(CART_RAM_ADDR) + i] =
+				&gb->cart_mem.ram[start];
+			gb->page_table.write[PEANUT_GB_GET_MSN16(CART_RAM_ADDR) + i] =
+				&gb->cart_mem.ram[start];
+#if PEANUT_GB_USE_DIRTY_PAGES
+			gb->page_table.dirty[PEANUT_GB_GET_MSN16(CART_RAM_ADDR) + i] =
+				&gb->dirty.cart_ram[start / DIRTY_PAGE_SIZE / 8];
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+			gb->page_table.fork[PEANUT_GB_GET_MSN16(CART_RAM_ADDR) + i] =
+				&gb->fork.cart_ram[start / DIRTY_PAGE_SIZE];
+#endif
+		}
+	}
+
+	/* VRAM. Writes take the slow path when the tile cache must be told
+	 * which tiles have changed. */
+	for(i = 0; i < VRAM_SIZE / MEM_PAGE_SIZE; i++)
+	{
+		uint8_t *p = &gb->vram[i * MEM_PAGE_SIZE];
+		gb->page_table.read[PEANUT_GB_GET_MSN16(VRAM_ADDR) + i] = p;
+#if !PEANUT_GB_USE_TILE_CACHE
+		gb->page_table.write[PEANUT_GB_GET_MSN16(VRAM_ADDR) + i] = p;
+#endif
+#if PEANUT_GB_USE_DIRTY_PAGES
+		gb->page_table.dirty[PEANUT_GB_GET_MSN16(VRAM_ADDR) + i] =
+			&gb->dirty.vram[i * MEM_PAGE_SIZE / DIRTY_PAGE_SIZE / 8];
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->page_table.fork[PEANUT_GB_GET_MSN16(VRAM_ADDR) + i] =
+			&gb->fork.vram[i * MEM_PAGE_SIZE / DIRTY_PAGE_SIZE];
+#endif
+	}
+
+	/* WRAM and the first page of its echo. The last page of echo RAM
+	 * shares its page with OAM and I/O, so it is not mapped. */
+	for(i = 0; i < WRAM_SIZE / MEM_PAGE_SIZE; i++)
+	{
+		uint8_t *p = &gb->wram[i * MEM_PAGE_SIZE];
+		gb->page_table.read[PEANUT_GB_GET_MSN16(WRAM_0_ADDR) + i] = p;
+		gb->page_table.write[PEANUT_GB_GET_MSN16(WRAM_0_ADDR) + i] = p;
+#if PEANUT_GB_USE_DIRTY_PAGES
+		gb->page_table.dirty[PEANUT_GB_GET_MSN16(WRAM_0_ADDR) + i] =
+			&gb->dirty.wram[i * MEM_PAGE_SIZE / DIRTY_PAGE_SIZE / 8];
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->page_table.fork[PEANUT_GB_GET_MSN16(WRAM_0_ADDR) + i] =
+			&gb->fork.wram[i * MEM_PAGE_SIZE / DIRTY_PAGE_SIZE];
+#endif
+	}
+
+	gb->page_table.read[PEANUT_GB_GET_MSN16(ECHO_ADDR)] = gb->wram;
+	gb->page_table.write[PEANUT_GB_GET_MSN16(ECHO_ADDR)] = gb->wram;
+#if PEANUT_GB_USE_DIRTY_PAGES
+	gb->page_table.dirty[PEANUT_GB_GET_MSN16(ECHO_ADDR)] = gb->dirty.wram;
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+	gb->page_table.fork[PEANUT_GB_GET_MSN16(ECHO_ADDR)] = gb->fork.wram;
+#endif
+}
+#endif
+
+/**
+ * Reads a byte of ROM at the given ROM address, which includes the offset of
+ * the selected bank. Lines are tagged by ROM address, and the ROM is read
+ * only, so the ROM cache never needs to be invalidated on bank switches.
+ */
+static uint8_t __gb_read_rom(struct gb_s *gb, const uint_fast32_t addr)
+{
+#if PEANUT_GB_USE_ROM_CACHE
+	const uint_fast32_t tag = (addr / ROM_CACHE_LINE_SIZE) + 1;
+	const uint_fast16_t i = tag % PEANUT_GB_ROM_CACHE_LINES;
+	uint8_t *line = gb->rom_cache.line[i];
+
+	if(PGB_UNLIKELY(gb->rom_cache.tag[i] != tag))
+	{
+		const uint_fast32_t start = addr & ~(uint_fast32_t)
+			(ROM_CACHE_LINE_SIZE - 1);
+		uint_fast8_t j;
+
+		for(j = 0; j < ROM_CACHE_LINE_SIZE; j++)
+			line[j] = gb->gb_rom_read(gb, start + j);
+
+		gb->rom_cache.tag[i] = tag;
+	}
+
+	return line[addr & (ROM_CACHE_LINE_SIZE - 1)];
+#else
+	return gb->gb_rom_read(gb, addr);
+#endif
+}
+
+#if PEANUT_GB_USE_PAGE_TABLE
+static PGB_NOINLINE uint8_t __gb_read_slow(struct gb_s *gb, uint16_t addr);
+
 /**
  * Internal function used to read bytes.
  * addr is host platform endian.
+ * Only the page table lookup is done here, so that the compiler may inline it
+ * into the CPU core.
  */
 uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+{
+	const uint8_t *page = gb->page_table.read[PEANUT_GB_GET_MSN16(addr)];
+
+	if(PGB_LIKELY(page != NULL))
+		return page[addr & MEM_PAGE_MASK];
+
+	return __gb_read_slow(gb, addr);
+}
+
+/**
+ * Reads from memory that is not mapped by the page table, such as I/O
+ * registers and ROM that is read through gb_rom_read().
+ */
+static uint8_t __gb_read_slow(struct gb_s *gb, uint16_t addr)
+#else
+uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
+#endif
 {
 	switch(PEANUT_GB_GET_MSN16(addr))
 	{
@@ -796,17 +1556,17 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 	case 0x1:
 	case 0x2:
 	case 0x3:
-		return gb->gb_rom_read(gb, addr);
+		return __gb_read_rom(gb, addr);
 
 	case 0x4:
 	case 0x5:
 	case 0x6:
 	case 0x7:
 		if(gb->mbc == 1 && gb->cart_mode_select)
-			return gb->gb_rom_read(gb,
+			return __gb_read_rom(gb,
 					       addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE);
 		else
-			return gb->gb_rom_read(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
+			return __gb_read_rom(gb, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE);
 
 	case 0x8:
 	case 0x9:
@@ -856,6 +1616,10 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 		if(addr < IO_ADDR)
 			return 0xFF;
 
+		/* I/O registers may have changed since the last event. */
+		if(addr < HRAM_ADDR)
+			__gb_sync_events(gb);
+
 		/* APU registers. */
 		if((addr >= 0xFF10) && (addr <= 0xFF3F))
 		{
@@ -888,31 +1652,125 @@ uint8_t __gb_read(struct gb_s *gb, uint16_t addr)
 }
 
 /**
- * Internal function used to write bytes.
+ * Internal function used to get a host pointer to the 256 byte block of plain
+ * memory starting at addr, such as WRAM, VRAM or a ROM buffer.
+ *
+ * \param addr	Address aligned to 256 bytes.
+ * \returns	NULL if the block must be read with __gb_read().
  */
-void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+static const uint8_t *__gb_get_block(struct gb_s *gb, uint_fast16_t addr)
 {
-	switch(PEANUT_GB_GET_MSN16(addr))
-	{
-	case 0x0:
-	case 0x1:
-		/* Set RAM enable bit. MBC2 is handled in fall-through. */
-		if (gb->mbc > 0 && gb->mbc != 2)
-		{
-			if (gb->cart_ram)
-				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-			return;
-		}
+#if PEANUT_GB_USE_PAGE_TABLE
+	const uint8_t *page = gb->page_table.read[PEANUT_GB_GET_MSN16(addr)];
 
-		/* Intentional fall through. */
-	case 0x2:
-		if (gb->mbc == 5)
-		{
-			gb->selected_rom_bank =
-				(gb->selected_rom_bank & 0x100) | val;
-			gb->selected_rom_bank =
+	if(page == NULL)
+		return NULL;
+
+	return &page[addr & MEM_PAGE_MASK];
+#else
+	if(addr >= VRAM_ADDR && addr < CART_RAM_ADDR)
+		return &gb->vram[addr - VRAM_ADDR];
+
+	if(addr >= WRAM_0_ADDR && addr < ECHO_ADDR)
+		return &gb->wram[addr - WRAM_0_ADDR];
+
+	if(addr >= ECHO_ADDR && addr < OAM_ADDR)
+		return &gb->wram[addr - ECHO_ADDR];
+
+	return NULL;
+#endif
+}
+
+#if PEANUT_GB_USE_DIRTY_PAGES
+/**
+ * Internal function used to mark the page holding the byte at the given offset
+ * of a memory as dirty.
+ */
+static inline void __gb_dirty_set(uint8_t *bitmap, uint_fast32_t offset)
+{
+	const uint_fast16_t page = offset / DIRTY_PAGE_SIZE;
+	bitmap[page / 8] |= 1 << (page % 8);
+}
+#endif
+
+#if PEANUT_GB_USE_FORK_TRACKING
+/* Last serial given to a context. Serials are shared by all contexts so that a
+ * context that is initialised again is never given a serial that it had
+ * before. */
+static unsigned long __gb_fork_serial;
+
+/**
+ * Internal function used to mark all pages as written to, when the memory is
+ * changed without the pages being marked.
+ */
+static void __gb_fork_set_all(struct gb_s *gb)
+{
+	memset(gb->fork.wram, FORK_WRITTEN, sizeof(gb->fork.wram));
+	memset(gb->fork.vram, FORK_WRITTEN, sizeof(gb->fork.vram));
+	memset(gb->fork.cart_ram, FORK_WRITTEN, sizeof(gb->fork.cart_ram));
+}
+#endif
+
+/**
+ * Internal function used to write bytes.
+ */
+#if PEANUT_GB_USE_PAGE_TABLE
+static PGB_NOINLINE void __gb_write_slow(struct gb_s *gb, uint_fast16_t addr,
+		uint8_t val);
+
+/* Only the page table lookup is done here, so that the compiler may inline it
+ * into the CPU core. */
+void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+{
+	uint8_t *page = gb->page_table.write[PEANUT_GB_GET_MSN16(addr)];
+
+	if(PGB_LIKELY(page != NULL))
+	{
+		page[addr & MEM_PAGE_MASK] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+		__gb_dirty_set(gb->page_table.dirty[PEANUT_GB_GET_MSN16(addr)],
+				addr & MEM_PAGE_MASK);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->page_table.fork[PEANUT_GB_GET_MSN16(addr)]
+			[(addr & MEM_PAGE_MASK) / DIRTY_PAGE_SIZE] = FORK_WRITTEN;
+#endif
+		return;
+	}
+
+	__gb_write_slow(gb, addr, val);
+}
+
+/**
+ * Writes to memory that is not mapped by the page table, such as the MBC,
+ * I/O registers and OAM.
+ */
+static void __gb_write_slow(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+#else
+void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
+#endif
+{
+	switch(PEANUT_GB_GET_MSN16(addr))
+	{
+	case 0x0:
+	case 0x1:
+		/* Set RAM enable bit. MBC2 is handled in fall-through. */
+		if (gb->mbc > 0 && gb->mbc != 2)
+		{
+			if (gb->cart_ram)
+				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
+			break;
+		}
+
+		/* Intentional fall through. */
+	case 0x2:
+		if (gb->mbc == 5)
+		{
+			gb->selected_rom_bank =
+				(gb->selected_rom_bank & 0x100) | val;
+			gb->selected_rom_bank =
 				gb->selected_rom_bank & gb->num_rom_banks_mask;
-			return;
+			break;
 		}
 
 	/* Intentional fall through. */
@@ -939,7 +1797,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			else
 			{
 				gb->enable_cart_ram = ((val & 0x0F) == 0x0A);
-				return;
+				break;
 			}
 		}
 		else if(gb->mbc == 3)
@@ -955,7 +1813,7 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			gb->selected_rom_bank = (val & 0x01) << 8 | (gb->selected_rom_bank & 0xFF);
 
 		gb->selected_rom_bank = gb->selected_rom_bank & gb->num_rom_banks_mask;
-		return;
+		break;
 
 	case 0x4:
 	case 0x5:
@@ -978,21 +1836,37 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		else if(gb->mbc == 5)
 			gb->cart_ram_bank = (val & 0x0F);
 
-		return;
+		break;
 
 	case 0x6:
 	case 0x7:
 		val &= 1;
 		if(gb->mbc == 3 && val && gb->cart_mode_select == 0)
+		{
+			__gb_sync_events(gb);
 			memcpy(&gb->rtc_latched.bytes, &gb->rtc_real.bytes, sizeof(gb->rtc_latched.bytes));
+		}
 
 		/* Set banking mode select. */
 		gb->cart_mode_select = val;
-		return;
+		break;
 
 	case 0x8:
 	case 0x9:
 		gb->vram[addr - VRAM_ADDR] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+		__gb_dirty_set(gb->dirty.vram, addr - VRAM_ADDR);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->fork.vram[(addr - VRAM_ADDR) / DIRTY_PAGE_SIZE] = FORK_WRITTEN;
+#endif
+#if PEANUT_GB_USE_TILE_CACHE
+		if(addr - VRAM_ADDR < VRAM_TILES_SIZE)
+		{
+			uint_fast16_t tile = (addr - VRAM_ADDR) / VRAM_TILE_SIZE;
+			gb->tile_cache.dirty[tile >> 3] |= 1 << (tile & 7);
+		}
+#endif
 		return;
 
 	case 0xA:
@@ -1005,58 +1879,104 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			uint8_t reg = gb->cart_ram_bank - 0x08;
 			//if(reg == 0) gb->counter.rtc_count = 0;
 
+			/* The RTC may be halted or resumed by this write. */
+			__gb_sync_events(gb);
+			gb->counter.sched_next = 0;
 			gb->rtc_real.bytes[reg] = val & rtc_reg_mask[reg];
 		}
 		/* Do not write to RAM if unavailable or disabled. */
 		else if(gb->cart_ram && gb->enable_cart_ram)
 		{
+			uint_fast32_t ram_addr;
+
 			if(gb->mbc == 2)
 			{
 				/* Only 9 bits are available in address. */
-				addr &= 0x1FF;
+				ram_addr = addr & 0x1FF;
 				/* Data is only 4 bits wide in MBC2 RAM. */
 				val &= 0x0F;
 				/* Upper nibble is set to high. */
 				val |= 0xF0;
-				gb->gb_cart_ram_write(gb, addr, val);
 			}
 			/* If cart has RAM, use this. If MBC1, only the first
 			 * RAM bank can be written to if the advanced banking
 			 * mode is selected. */
 			else if(((gb->mbc == 1 && gb->cart_mode_select) || gb->mbc != 1) &&
 					gb->cart_ram_bank < gb->num_ram_banks)
-			{
-				gb->gb_cart_ram_write(gb,
-					addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE), val);
-			}
+				ram_addr = addr - CART_RAM_ADDR + (gb->cart_ram_bank * CRAM_BANK_SIZE);
 			else if(gb->num_ram_banks)
-				gb->gb_cart_ram_write(gb, addr - CART_RAM_ADDR, val);
+				ram_addr = addr - CART_RAM_ADDR;
+			else
+				return;
+
+			gb->gb_cart_ram_write(gb, ram_addr, val);
+#if PEANUT_GB_USE_DIRTY_PAGES
+			__gb_dirty_set(gb->dirty.cart_ram, ram_addr);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+			gb->fork.cart_ram[ram_addr / DIRTY_PAGE_SIZE] = FORK_WRITTEN;
+#endif
 		}
 
 		return;
 
 	case 0xC:
 		gb->wram[addr - WRAM_0_ADDR] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+		__gb_dirty_set(gb->dirty.wram, addr - WRAM_0_ADDR);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->fork.wram[(addr - WRAM_0_ADDR) / DIRTY_PAGE_SIZE] = FORK_WRITTEN;
+#endif
 		return;
 
 	case 0xD:
 		gb->wram[addr - WRAM_1_ADDR + WRAM_BANK_SIZE] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+		__gb_dirty_set(gb->dirty.wram,
+				addr - WRAM_1_ADDR + WRAM_BANK_SIZE);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->fork.wram[(addr - WRAM_1_ADDR + WRAM_BANK_SIZE) /
+			DIRTY_PAGE_SIZE] = FORK_WRITTEN;
+#endif
 		return;
 
 	case 0xE:
 		gb->wram[addr - ECHO_ADDR] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+		__gb_dirty_set(gb->dirty.wram, addr - ECHO_ADDR);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+		gb->fork.wram[(addr - ECHO_ADDR) / DIRTY_PAGE_SIZE] = FORK_WRITTEN;
+#endif
 		return;
 
 	case 0xF:
 		if(addr < OAM_ADDR)
 		{
 			gb->wram[addr - ECHO_ADDR] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+			__gb_dirty_set(gb->dirty.wram, addr - ECHO_ADDR);
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+			gb->fork.wram[(addr - ECHO_ADDR) / DIRTY_PAGE_SIZE] =
+				FORK_WRITTEN;
+#endif
 			return;
 		}
 
 		if(addr < UNUSED_ADDR)
 		{
 			gb->oam[addr - OAM_ADDR] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+			gb->dirty.oam[0] = 1;
+#endif
+#if PEANUT_GB_USE_SPRITE_LINES
+			/* Sprite Y or X position. */
+			if((addr & 0x02) == 0)
+				gb->sprite_lines.dirty = true;
+#endif
 			return;
 		}
 
@@ -1080,7 +2000,11 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			return;
 		}
 
-		/* IO and Interrupts. */
+		/* IO and Interrupts. Writes may change when the next event
+		 * occurs, so it is recalculated after this instruction. */
+		__gb_sync_events(gb);
+		gb->counter.sched_next = 0;
+
 		switch(PEANUT_GB_GET_LSB16(addr))
 		{
 		/* Joypad */
@@ -1138,6 +2062,11 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 			/* Check if LCD is already enabled. */
 			lcd_enabled = (gb->hram_io[IO_LCDC] & LCDC_ENABLE);
 
+#if PEANUT_GB_USE_SPRITE_LINES
+			if((gb->hram_io[IO_LCDC] ^ val) & LCDC_OBJ_SIZE)
+				gb->sprite_lines.dirty = true;
+#endif
+
 			gb->hram_io[IO_LCDC] = val;
 
 			/* Check if LCD is going to be switched on. */
@@ -1190,13 +2119,44 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		{
 			uint16_t dma_addr;
 			uint16_t i;
+			const uint8_t *src;
 
 			dma_addr = (uint_fast16_t)val << 8;
 			gb->hram_io[IO_DMA] = val;
+#if PEANUT_GB_USE_DIRTY_PAGES
+			gb->dirty.oam[0] = 1;
+#endif
+
+			/* Copy plain memory in one go. */
+			src = __gb_get_block(gb, dma_addr);
+			if(src != NULL)
+			{
+#if PEANUT_GB_USE_SPRITE_LINES
+				for(i = 0; i < OAM_SIZE; i += 4)
+				{
+					/* Sprite Y or X position changed. */
+					if(gb->oam[i] != src[i] ||
+						gb->oam[i + 1] != src[i + 1])
+					{
+						gb->sprite_lines.dirty = true;
+						break;
+					}
+				}
+#endif
+				memcpy(gb->oam, src, OAM_SIZE);
+				return;
+			}
 
 			for(i = 0; i < OAM_SIZE; i++)
 			{
-				gb->oam[i] = __gb_read(gb, dma_addr + i);
+				uint8_t v = __gb_read(gb, dma_addr + i);
+
+#if PEANUT_GB_USE_SPRITE_LINES
+				/* Sprite Y or X position changed. */
+				if((i & 0x02) == 0 && gb->oam[i] != v)
+					gb->sprite_lines.dirty = true;
+#endif
+				gb->oam[i] = v;
 			}
 
 			return;
@@ -1239,6 +2199,9 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		/* Turn off boot ROM */
 		case 0x50:
 			gb->hram_io[IO_BOOT] = 0x01;
+#if PEANUT_GB_USE_PAGE_TABLE
+			__gb_update_page_table(gb);
+#endif
 			return;
 
 		/* Interrupt Enable Register */
@@ -1248,10 +2211,195 @@ void __gb_write(struct gb_s *gb, uint_fast16_t addr, uint8_t val)
 		}
 	}
 
+#if PEANUT_GB_USE_PAGE_TABLE
+	/* Writes to the MBC may have changed the selected banks. */
+	if(addr < VRAM_ADDR)
+		__gb_update_page_table(gb);
+#endif
+
 	/* Invalid writes are ignored. */
 	return;
 }
 
+#if PEANUT_GB_THREADED_DISPATCH
+/* Operations of the CB prefixed opcodes on the value v. bit is the bit number
+ * used by BIT, RES and SET. */
+#define PGB_CB_RLC(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = (temp << 1) | (temp >> 7);				\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp >> 7);			\
+	}
+#define PGB_CB_RRC(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = (temp >> 1) | (temp << 7);				\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp & 0x01);			\
+	}
+#define PGB_CB_RL(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = (temp << 1) | gb->cpu_reg.f.f_bits.c;		\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp >> 7);			\
+	}
+#define PGB_CB_RR(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = (temp >> 1) | (gb->cpu_reg.f.f_bits.c << 7);	\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp & 0x01);			\
+	}
+#define PGB_CB_SLA(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = temp << 1;						\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp >> 7);			\
+	}
+#define PGB_CB_SRA(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = (temp >> 1) | (temp & 0x80);			\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp & 0x01);			\
+	}
+#define PGB_CB_SWAP(v,bit)						\
+	{								\
+		v = (v >> 4) | (v << 4);				\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00);		\
+	}
+#define PGB_CB_SRL(v,bit)						\
+	{								\
+		const uint8_t temp = v;					\
+		v = temp >> 1;						\
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(v == 0x00) |		\
+			PGB_SET_CARRY(temp & 0x01);			\
+	}
+#define PGB_CB_BIT(v,bit)						\
+	{								\
+		gb->cpu_reg.f.reg = (gb->cpu_reg.f.reg &		\
+				PEANUT_GB_CPUFLAG_MASK_CARRY) |		\
+			PGB_SET_ZERO(!((v >> bit) & 0x1)) |		\
+			PGB_SET_HALFC(1);				\
+	}
+#define PGB_CB_RES(v,bit)		{ v &= (uint8_t)~(0x1 << bit); }
+#define PGB_CB_SET(v,bit)		{ v |= (0x1 << bit); }
+
+/* Handlers of one CB prefixed operation for each of its operands. Operations
+ * on (HL) take 16 cycles, except for BIT which does not write back and takes
+ * 12 cycles. */
+#define PGB_CB_HANDLERS(name,op,bit)					\
+	cb_##name##_b: op(gb->cpu_reg.bc.bytes.b,bit) return 8;		\
+	cb_##name##_c: op(gb->cpu_reg.bc.bytes.c,bit) return 8;		\
+	cb_##name##_d: op(gb->cpu_reg.de.bytes.d,bit) return 8;		\
+	cb_##name##_e: op(gb->cpu_reg.de.bytes.e,bit) return 8;		\
+	cb_##name##_h: op(gb->cpu_reg.hl.bytes.h,bit) return 8;		\
+	cb_##name##_l: op(gb->cpu_reg.hl.bytes.l,bit) return 8;		\
+	cb_##name##_hl:							\
+	{								\
+		uint8_t val = __gb_read(gb, gb->cpu_reg.hl.reg);	\
+		op(val,bit)						\
+		__gb_write(gb, gb->cpu_reg.hl.reg, val);		\
+		return 16;						\
+	}								\
+	cb_##name##_a: op(gb->cpu_reg.a,bit) return 8;
+#define PGB_CB_BIT_HANDLERS(name,bit)					\
+	cb_##name##_b: PGB_CB_BIT(gb->cpu_reg.bc.bytes.b,bit) return 8;	\
+	cb_##name##_c: PGB_CB_BIT(gb->cpu_reg.bc.bytes.c,bit) return 8;	\
+	cb_##name##_d: PGB_CB_BIT(gb->cpu_reg.de.bytes.d,bit) return 8;	\
+	cb_##name##_e: PGB_CB_BIT(gb->cpu_reg.de.bytes.e,bit) return 8;	\
+	cb_##name##_h: PGB_CB_BIT(gb->cpu_reg.hl.bytes.h,bit) return 8;	\
+	cb_##name##_l: PGB_CB_BIT(gb->cpu_reg.hl.bytes.l,bit) return 8;	\
+	cb_##name##_hl:							\
+	{								\
+		const uint8_t val = __gb_read(gb, gb->cpu_reg.hl.reg);	\
+		PGB_CB_BIT(val,bit)					\
+		return 12;						\
+	}								\
+	cb_##name##_a: PGB_CB_BIT(gb->cpu_reg.a,bit) return 8;
+
+/* Handler addresses of one CB prefixed operation, in the order of the operand
+ * encoding: B, C, D, E, H, L, (HL), A. */
+#define PGB_CB_LABELS(name)						\
+	&&cb_##name##_b, &&cb_##name##_c, &&cb_##name##_d, &&cb_##name##_e,	\
+	&&cb_##name##_h, &&cb_##name##_l, &&cb_##name##_hl, &&cb_##name##_a
+
+uint8_t __gb_execute_cb(struct gb_s *gb)
+{
+	static const void *const cb_dispatch[0x100] =
+	{
+		PGB_CB_LABELS(rlc),	PGB_CB_LABELS(rrc),	/* 0x00 */
+		PGB_CB_LABELS(rl),	PGB_CB_LABELS(rr),	/* 0x10 */
+		PGB_CB_LABELS(sla),	PGB_CB_LABELS(sra),	/* 0x20 */
+		PGB_CB_LABELS(swap),	PGB_CB_LABELS(srl),	/* 0x30 */
+		PGB_CB_LABELS(bit0),	PGB_CB_LABELS(bit1),	/* 0x40 */
+		PGB_CB_LABELS(bit2),	PGB_CB_LABELS(bit3),	/* 0x50 */
+		PGB_CB_LABELS(bit4),	PGB_CB_LABELS(bit5),	/* 0x60 */
+		PGB_CB_LABELS(bit6),	PGB_CB_LABELS(bit7),	/* 0x70 */
+		PGB_CB_LABELS(res0),	PGB_CB_LABELS(res1),	/* 0x80 */
+		PGB_CB_LABELS(res2),	PGB_CB_LABELS(res3),	/* 0x90 */
+		PGB_CB_LABELS(res4),	PGB_CB_LABELS(res5),	/* 0xA0 */
+		PGB_CB_LABELS(res6),	PGB_CB_LABELS(res7),	/* 0xB0 */
+		PGB_CB_LABELS(set0),	PGB_CB_LABELS(set1),	/* 0xC0 */
+		PGB_CB_LABELS(set2),	PGB_CB_LABELS(set3),	/* 0xD0 */
+		PGB_CB_LABELS(set4),	PGB_CB_LABELS(set5),	/* 0xE0 */
+		PGB_CB_LABELS(set6),	PGB_CB_LABELS(set7)	/* 0xF0 */
+	};
+
+	goto *cb_dispatch[__gb_read(gb, gb->cpu_reg.pc.reg++)];
+
+	PGB_CB_HANDLERS(rlc, PGB_CB_RLC, 0)
+	PGB_CB_HANDLERS(rrc, PGB_CB_RRC, 0)
+	PGB_CB_HANDLERS(rl, PGB_CB_RL, 0)
+	PGB_CB_HANDLERS(rr, PGB_CB_RR, 0)
+	PGB_CB_HANDLERS(sla, PGB_CB_SLA, 0)
+	PGB_CB_HANDLERS(sra, PGB_CB_SRA, 0)
+	PGB_CB_HANDLERS(swap, PGB_CB_SWAP, 0)
+	PGB_CB_HANDLERS(srl, PGB_CB_SRL, 0)
+	PGB_CB_BIT_HANDLERS(bit0, 0)
+	PGB_CB_BIT_HANDLERS(bit1, 1)
+	PGB_CB_BIT_HANDLERS(bit2, 2)
+	PGB_CB_BIT_HANDLERS(bit3, 3)
+	PGB_CB_BIT_HANDLERS(bit4, 4)
+	PGB_CB_BIT_HANDLERS(bit5, 5)
+	PGB_CB_BIT_HANDLERS(bit6, 6)
+	PGB_CB_BIT_HANDLERS(bit7, 7)
+	PGB_CB_HANDLERS(res0, PGB_CB_RES, 0)
+	PGB_CB_HANDLERS(res1, PGB_CB_RES, 1)
+	PGB_CB_HANDLERS(res2, PGB_CB_RES, 2)
+	PGB_CB_HANDLERS(res3, PGB_CB_RES, 3)
+	PGB_CB_HANDLERS(res4, PGB_CB_RES, 4)
+	PGB_CB_HANDLERS(res5, PGB_CB_RES, 5)
+	PGB_CB_HANDLERS(res6, PGB_CB_RES, 6)
+	PGB_CB_HANDLERS(res7, PGB_CB_RES, 7)
+	PGB_CB_HANDLERS(set0, PGB_CB_SET, 0)
+	PGB_CB_HANDLERS(set1, PGB_CB_SET, 1)
+	PGB_CB_HANDLERS(set2, PGB_CB_SET, 2)
+	PGB_CB_HANDLERS(set3, PGB_CB_SET, 3)
+	PGB_CB_HANDLERS(set4, PGB_CB_SET, 4)
+	PGB_CB_HANDLERS(set5, PGB_CB_SET, 5)
+	PGB_CB_HANDLERS(set6, PGB_CB_SET, 6)
+	PGB_CB_HANDLERS(set7, PGB_CB_SET, 7)
+}
+
+#undef PGB_CB_RLC
+#undef PGB_CB_RRC
+#undef PGB_CB_RL
+#undef PGB_CB_RR
+#undef PGB_CB_SLA
+#undef PGB_CB_SRA
+#undef PGB_CB_SWAP
+#undef PGB_CB_SRL
+#undef PGB_CB_BIT
+#undef PGB_CB_RES
+#undef PGB_CB_SET
+#undef PGB_CB_HANDLERS
+#undef PGB_CB_BIT_HANDLERS
+#undef PGB_CB_LABELS
+#else
 uint8_t __gb_execute_cb(struct gb_s *gb)
 {
 	uint8_t inst_cycles;
@@ -1327,18 +2475,16 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 				uint8_t temp = val;
 				val = (val >> 1);
 				val |= cbop ? (gb->cpu_reg.f.f_bits.c << 7) : (temp << 7);
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f.f_bits.c = (temp & 0x01);
+				gb->cpu_reg.f.reg = PGB_SET_ZERO(val == 0x00) |
+					PGB_SET_CARRY(temp & 0x01);
 			}
 			else /* RLC R / RL R */
 			{
 				uint8_t temp = val;
 				val = (val << 1);
 				val |= cbop ? gb->cpu_reg.f.f_bits.c : (temp >> 7);
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
-				gb->cpu_reg.f.f_bits.c = (temp >> 7);
+				gb->cpu_reg.f.reg = PGB_SET_ZERO(val == 0x00) |
+					PGB_SET_CARRY(temp >> 7);
 			}
 
 			break;
@@ -1346,17 +2492,17 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		case 0x2:
 			if(d) /* SRA R */
 			{
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.c = val & 0x01;
+				uint8_t temp = val;
 				val = (val >> 1) | (val & 0x80);
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				gb->cpu_reg.f.reg = PGB_SET_ZERO(val == 0x00) |
+					PGB_SET_CARRY(temp & 0x01);
 			}
 			else /* SLA R */
 			{
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.c = (val >> 7);
+				uint8_t temp = val;
 				val = val << 1;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				gb->cpu_reg.f.reg = PGB_SET_ZERO(val == 0x00) |
+					PGB_SET_CARRY(temp >> 7);
 			}
 
 			break;
@@ -1364,18 +2510,17 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		case 0x3:
 			if(d) /* SRL R */
 			{
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.c = val & 0x01;
+				uint8_t temp = val;
 				val = val >> 1;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				gb->cpu_reg.f.reg = PGB_SET_ZERO(val == 0x00) |
+					PGB_SET_CARRY(temp & 0x01);
 			}
 			else /* SWAP R */
 			{
 				uint8_t temp = (val >> 4) & 0x0F;
 				temp |= (val << 4) & 0xF0;
 				val = temp;
-				gb->cpu_reg.f.reg = 0;
-				gb->cpu_reg.f.f_bits.z = (val == 0x00);
+				gb->cpu_reg.f.reg = PGB_SET_ZERO(val == 0x00);
 			}
 
 			break;
@@ -1384,9 +2529,9 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 		break;
 
 	case 0x1: /* BIT B, R */
-		gb->cpu_reg.f.f_bits.z = !((val >> b) & 0x1);
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = 1;
+		gb->cpu_reg.f.reg =
+			(gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_CARRY) |
+			PGB_SET_ZERO(!((val >> b) & 0x1)) | PGB_SET_HALFC(1);
 		writeback = 0;
 		break;
 
@@ -1438,14 +2583,70 @@ uint8_t __gb_execute_cb(struct gb_s *gb)
 	}
 	return inst_cycles;
 }
+#endif /* PEANUT_GB_THREADED_DISPATCH */
 
 #if ENABLE_LCD
+#if PEANUT_GB_USE_SPRITE_LINES
+/**
+ * Internal function used to rebuild the list of sprites to draw on each line.
+ * Up to ten sprites are drawn on each line. Sprites with a lower X position
+ * have priority, and then sprites earlier in OAM.
+ */
+static void __gb_update_sprite_lines(struct gb_s *gb)
+{
+	const uint_fast8_t height =
+		(gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE) ? 16 : 8;
+	uint_fast8_t s;
+
+	memset(gb->sprite_lines.count, 0, sizeof(gb->sprite_lines.count));
+
+	for(s = 0; s < NUM_SPRITES; s++)
+	{
+		/* Sprite Y position. The top of the sprite is at line Y-16. */
+		const int_fast16_t top = (int_fast16_t)gb->oam[4 * s + 0] - 16;
+		/* Sprite X position. */
+		const uint8_t OX = gb->oam[4 * s + 1];
+		int_fast16_t ly;
+
+		for(ly = (top < 0 ? 0 : top);
+				ly < top + height && ly < LCD_HEIGHT; ly++)
+		{
+			uint8_t *list = gb->sprite_lines.sprite[ly];
+			uint_fast8_t n = gb->sprite_lines.count[ly];
+			uint_fast8_t place, i;
+
+			/* Sprites are added in OAM order, so a sprite with the
+			 * same X position as one already listed goes after it. */
+			for(place = n; place != 0; place--)
+			{
+				if(gb->oam[4 * list[place - 1] + 1] <= OX)
+					break;
+			}
+
+			if(place >= MAX_SPRITES_LINE)
+				continue;
+
+			/* The sprite with the lowest priority is dropped if the
+			 * list is full. */
+			for(i = (n < MAX_SPRITES_LINE ? n : MAX_SPRITES_LINE - 1);
+					i > place; i--)
+				list[i] = list[i - 1];
+
+			if(n < MAX_SPRITES_LINE)
+				gb->sprite_lines.count[ly] = n + 1;
+
+			list[place] = s;
+		}
+	}
+
+	gb->sprite_lines.dirty = false;
+}
+#elif PEANUT_GB_HIGH_LCD_ACCURACY
 struct sprite_data {
 	uint8_t sprite_number;
 	uint8_t x;
 };
 
-#if PEANUT_GB_HIGH_LCD_ACCURACY
 static int compare_sprites(const struct sprite_data *const sd1, const struct sprite_data *const sd2)
 {
 	int x_res;
@@ -1458,97 +2659,461 @@ static int compare_sprites(const struct sprite_data *const sd1, const struct spr
 }
 #endif
 
-void __gb_draw_line(struct gb_s *gb)
+#if PEANUT_GB_USE_TILE_CACHE
+/**
+ * Internal function used to decode a tile into the tile cache.
+ */
+static PGB_NOINLINE void __gb_decode_tile(struct gb_s *gb, uint_fast16_t tile)
 {
-	uint8_t pixels[160] = {0};
-
-	/* If LCD not initialised by front-end, don't render anything. */
-	if(gb->display.lcd_draw_line == NULL)
-		return;
-
-	if(gb->direct.frame_skip && !gb->display.frame_skip_count)
-		return;
+	const uint8_t *t = &gb->vram[tile * VRAM_TILE_SIZE];
+	uint_fast8_t y, x;
 
-	/* If interlaced mode is activated, check if we need to draw the current
-	 * line. */
-	if(gb->direct.interlace)
+	for(y = 0; y < 8; y++, t += 2)
 	{
-		if((!gb->display.interlace_count
-				&& (gb->hram_io[IO_LY] & 1) == 0)
-				|| (gb->display.interlace_count
-				    && (gb->hram_io[IO_LY] & 1) == 1))
+		for(x = 0; x < 8; x++)
 		{
-			/* Compensate for missing window draw if required. */
-			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
-					&& gb->hram_io[IO_LY] >= gb->display.WY
-					&& gb->hram_io[IO_WX] <= 166)
-				gb->display.window_clear++;
-
-			return;
+			gb->tile_cache.pixel[tile][y][x] =
+				((t[0] >> (7 - x)) & 1) |
+				(((t[1] >> (7 - x)) & 1) << 1);
 		}
 	}
 
-	/* If background is enabled, draw it. */
-	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
-	{
-		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
-		uint16_t bg_map, tile;
+	gb->tile_cache.dirty[tile >> 3] &= ~(1 << (tile & 7));
+}
 
-		/* Calculate current background line to draw. Constant because
-		 * this function draws only this one line each time it is
-		 * called. */
-		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+/**
+ * Internal function used to get a row of pixels of a tile from the tile cache,
+ * decoding the tile first if VRAM has changed.
+ *
+ * \param tile	Tile number, from 0 to 383.
+ * \param py	Row of the tile, from 0 to 7.
+ * \returns	Colour index of the 8 pixels of the row, from left to right.
+ */
+static const uint8_t *__gb_tile_cache_row(struct gb_s *gb, uint_fast16_t tile,
+		uint_fast8_t py)
+{
+	if(gb->tile_cache.dirty[tile >> 3] & (1 << (tile & 7)))
+		__gb_decode_tile(gb, tile);
 
-		/* Get selected background map address for first tile
-		 * corresponding to current line.
-		 * 0x20 (32) is the width of a background tile, and the bit
-		 * shift is to calculate the address. */
-		bg_map =
-			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
-			 VRAM_BMAP_2 : VRAM_BMAP_1)
-			+ (bg_y >> 3) * 0x20;
+	return gb->tile_cache.pixel[tile][py];
+}
 
-		/* The displays (what the player sees) X coordinate, drawn right
-		 * to left. */
-		disp_x = LCD_WIDTH - 1;
+/**
+ * Internal function used to get a row of pixels of a background or window
+ * tile.
+ *
+ * \param idx	Tile index read from the tile map.
+ * \param py	Row of the tile, from 0 to 7.
+ * \returns	Colour index of the 8 pixels of the row, from left to right.
+ */
+static const uint8_t *__gb_tile_row(struct gb_s *gb, uint8_t idx,
+		uint_fast8_t py)
+{
+	uint_fast16_t tile;
 
-		/* The X coordinate to begin drawing the background at. */
-		bg_x = disp_x + gb->hram_io[IO_SCX];
+	/* Select addressing mode. */
+	if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+		tile = idx;
+	else
+		tile = 0x100 + (int8_t)idx;
 
-		/* Get tile index for current background tile. */
-		idx = gb->vram[bg_map + (bg_x >> 3)];
-		/* Y coordinate of tile pixel to draw. */
-		py = (bg_y & 0x07);
-		/* X coordinate of tile pixel to draw. */
-		px = 7 - (bg_x & 0x07);
+	return __gb_tile_cache_row(gb, tile, py);
+}
 
-		/* Select addressing mode. */
-		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-			tile = VRAM_TILES_1 + idx * 0x10;
-		else
-			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+#if PGB_SIMD_SSE2
+/* Select bytes of a where mask is set, and bytes of b elsewhere. */
+#define PGB_SSE2_SELECT(mask, a, b) \
+	_mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
 
-		tile += 2 * py;
+/**
+ * Internal function used to look up the shade of 16 colour indices from 0 to 3.
+ */
+static __m128i __gb_sse2_shade(__m128i c, const uint8_t pal[4])
+{
+#ifdef __SSSE3__
+	uint32_t lut;
 
-		/* fetch first tile */
-		t1 = gb->vram[tile] >> px;
-		t2 = gb->vram[tile + 1] >> px;
+	memcpy(&lut, pal, sizeof(lut));
+	return _mm_shuffle_epi8(_mm_cvtsi32_si128((int)lut), c);
+#else
+	__m128i s = _mm_set1_epi8((char)pal[0]);
+
+	s = PGB_SSE2_SELECT(_mm_cmpeq_epi8(c, _mm_set1_epi8(1)),
+			_mm_set1_epi8((char)pal[1]), s);
+	s = PGB_SSE2_SELECT(_mm_cmpeq_epi8(c, _mm_set1_epi8(2)),
+			_mm_set1_epi8((char)pal[2]), s);
+	s = PGB_SSE2_SELECT(_mm_cmpeq_epi8(c, _mm_set1_epi8(3)),
+			_mm_set1_epi8((char)pal[3]), s);
+	return s;
+#endif
+}
+#endif
 
-		for(; disp_x != 0xFF; disp_x--)
-		{
-			uint8_t c;
+/**
+ * Internal function used to shade the colour indices of the background and
+ * window.
+ *
+ * \param dst	Pixels to write.
+ * \param idx	Colour indices from 0 to 3.
+ * \param n	Number of pixels. The SIMD code may read and write up to 15
+ * 		pixels past the end.
+ * \param pal	Shade of each colour index.
+ */
+static void __gb_shade_line(uint8_t *dst, const uint8_t *idx, uint_fast8_t n,
+		const uint8_t pal[4])
+{
+	uint_fast8_t i;
 
-			if(px == 8)
-			{
-				/* fetch next tile */
-				px = 0;
-				bg_x = disp_x + gb->hram_io[IO_SCX];
-				idx = gb->vram[bg_map + (bg_x >> 3)];
+#if PGB_SIMD_SSE2
+	for(i = 0; i < n; i += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i *)&idx[i]);
+		_mm_storeu_si128((__m128i *)&dst[i], __gb_sse2_shade(c, pal));
+	}
+#elif PGB_SIMD_NEON
+	const uint8_t lut[8] = { pal[0], pal[1], pal[2], pal[3] };
+	const uint8x8_t l = vld1_u8(lut);
 
-				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
-					tile = VRAM_TILES_1 + idx * 0x10;
-				else
-					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+	for(i = 0; i < n; i += 8)
+		vst1_u8(&dst[i], vtbl1_u8(l, vld1_u8(&idx[i])));
+#else
+	for(i = 0; i < n; i++)
+		dst[i] = pal[idx[i]];
+#endif
+}
+
+/**
+ * Internal function used to draw a row of 8 sprite pixels over the line.
+ *
+ * \param dst	First of the 8 pixels covered by the sprite.
+ * \param row	Colour indices of the sprite row, from left to right.
+ * \param pal	Shade of each colour index, with the palette bits.
+ * \param flip	Draw the row from right to left.
+ * \param behind	Only draw over pixels with the shade of background
+ * 		colour 0.
+ * \param bg0	Shade of background colour 0.
+ */
+static void __gb_draw_sprite_row(uint8_t *dst, const uint8_t *row,
+		const uint8_t pal[4], bool flip, bool behind, uint8_t bg0)
+{
+#if PGB_SIMD_SSE2
+	__m128i c = _mm_loadl_epi64((const __m128i *)row);
+	__m128i d = _mm_loadl_epi64((const __m128i *)dst);
+	__m128i draw;
+
+	if(flip)
+	{
+		/* Reverse the order of the 8 colour indices. */
+		c = _mm_shufflelo_epi16(c, _MM_SHUFFLE(0, 1, 2, 3));
+		c = _mm_or_si128(_mm_slli_epi16(c, 8), _mm_srli_epi16(c, 8));
+	}
+
+	/* Colour 0 is transparent. */
+	draw = _mm_cmpeq_epi8(c, _mm_setzero_si128());
+	if(behind)
+		draw = _mm_andnot_si128(draw, _mm_cmpeq_epi8(
+				_mm_and_si128(d, _mm_set1_epi8(LCD_COLOUR)),
+				_mm_set1_epi8((char)bg0)));
+	else
+		draw = _mm_andnot_si128(draw, _mm_set1_epi8(-1));
+
+	d = PGB_SSE2_SELECT(draw, __gb_sse2_shade(c, pal), d);
+	_mm_storel_epi64((__m128i *)dst, d);
+#elif PGB_SIMD_NEON
+	const uint8_t lut[8] = { pal[0], pal[1], pal[2], pal[3] };
+	uint8x8_t c = vld1_u8(row);
+	uint8x8_t d = vld1_u8(dst);
+	uint8x8_t draw;
+
+	if(flip)
+		c = vrev64_u8(c);
+
+	/* Colour 0 is transparent. */
+	draw = vtst_u8(c, c);
+	if(behind)
+		draw = vand_u8(draw, vceq_u8(vand_u8(d, vdup_n_u8(LCD_COLOUR)),
+					vdup_n_u8(bg0)));
+
+	vst1_u8(dst, vbsl_u8(draw, vtbl1_u8(vld1_u8(lut), c), d));
+#else
+	uint_fast8_t x;
+
+	for(x = 0; x < 8; x++)
+	{
+		uint8_t c = row[flip ? 7 - x : x];
+
+		/* Colour 0 is transparent. */
+		if(c == 0 || (behind && (dst[x] & LCD_COLOUR) != bg0))
+			continue;
+
+		dst[x] = pal[c];
+	}
+#endif
+}
+
+#if PGB_SIMD_SSE2
+#undef PGB_SSE2_SELECT
+#endif
+#endif
+
+/**
+ * Internal function used to convert a line of pixels to the format of the host
+ * frame buffer set by gb_init_framebuffer(), and write it to the frame buffer.
+ */
+static void __gb_write_framebuffer(struct gb_s *gb, const uint8_t *pixels,
+		uint_fast8_t line)
+{
+	uint8_t *row = (uint8_t *)gb->display.fb + line * gb->display.fb_pitch;
+	const uint32_t *lut = gb->display.fb_lut;
+	uint_fast8_t x;
+
+	switch(gb->display.fb_format)
+	{
+	case GB_FRAMEBUFFER_INDEX8:
+		for(x = 0; x < LCD_WIDTH; x++)
+			row[x] = (uint8_t)lut[pixels[x]];
+		break;
+
+	case GB_FRAMEBUFFER_RGB565:
+	{
+		uint16_t *p = (uint16_t *)row;
+
+		for(x = 0; x < LCD_WIDTH; x++)
+			p[x] = (uint16_t)lut[pixels[x]];
+		break;
+	}
+
+	case GB_FRAMEBUFFER_XRGB8888:
+	{
+		uint32_t *p = (uint32_t *)row;
+
+		for(x = 0; x < LCD_WIDTH; x++)
+			p[x] = lut[pixels[x]];
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+#if PEANUT_GB_USE_LINE_HASH
+/**
+ * Internal function used to hash a line of pixels with 64-bit FNV-1a, taking
+ * eight pixels at a time to keep the chain of multiplies short. The hash is
+ * folded to 32 bits.
+ */
+static uint32_t __gb_hash_line(const uint8_t *pixels)
+{
+	uint64_t hash = 14695981039346656037u;
+	uint_fast8_t x;
+
+	for(x = 0; x < LCD_WIDTH; x += sizeof(uint64_t))
+	{
+		uint64_t word;
+
+		memcpy(&word, &pixels[x], sizeof(word));
+		hash ^= word;
+		hash *= 1099511628211u;
+	}
+
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * Internal function used to forget the hash of each line, so that each line
+ * is marked as changed when it is next drawn.
+ */
+static void __gb_reset_line_hash(struct gb_s *gb)
+{
+	memset(gb->display.line_hash, 0, sizeof(gb->display.line_hash));
+	memset(gb->display.line_changed, 0xFF,
+			sizeof(gb->display.line_changed));
+}
+#endif
+
+void __gb_draw_line(struct gb_s *gb)
+{
+#if PEANUT_GB_USE_TILE_CACHE
+	/* The background and window are drawn a whole tile row at a time, and
+	 * shaded up to 16 pixels at a time, so leave room for the pixels that
+	 * are off either side of the screen. */
+	uint8_t line[8 + LCD_WIDTH + 16] = {0};
+	uint8_t *const pixels = &line[8];
+	/* Colour indices of the background and window. */
+	uint8_t bg_line[8 + LCD_WIDTH + 16] = {0};
+	uint8_t *const bg = &bg_line[8];
+	/* First pixel drawn by the background or window. */
+	uint_fast8_t bg_start = LCD_WIDTH;
+	uint8_t bg_pal[4];
+	uint_fast8_t i;
+#else
+	uint8_t pixels[160] = {0};
+#endif
+
+	/* If LCD not initialised by front-end, don't render anything. */
+	if(gb->display.lcd_draw_line == NULL && gb->display.fb == NULL)
+		return;
+
+	if(gb->display.skip_frame)
+		return;
+
+	if(gb->display.skip_render)
+		return;
+
+	/* If interlaced mode is activated, check if we need to draw the current
+	 * line. */
+	if(gb->direct.interlace)
+	{
+		if((!gb->display.interlace_count
+				&& (gb->hram_io[IO_LY] & 1) == 0)
+				|| (gb->display.interlace_count
+				    && (gb->hram_io[IO_LY] & 1) == 1))
+		{
+			/* Compensate for missing window draw if required. */
+			if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+					&& gb->hram_io[IO_LY] >= gb->display.WY
+					&& gb->hram_io[IO_WX] <= 166)
+				gb->display.window_clear++;
+
+			return;
+		}
+	}
+
+#if PEANUT_GB_USE_TILE_CACHE
+	/* Background and window palette, with the layer bits. */
+	for(i = 0; i < 4; i++)
+	{
+		bg_pal[i] = gb->display.bg_palette[i];
+#if PEANUT_GB_12_COLOUR
+		bg_pal[i] |= LCD_PALETTE_BG;
+#endif
+	}
+
+	/* If background is enabled, draw it. */
+	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	{
+		uint8_t bg_y, bg_x;
+		uint16_t bg_map;
+		uint8_t *dst;
+
+		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+		bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+		bg_x = gb->hram_io[IO_SCX];
+
+		/* Copy whole tile rows, starting with the tile that is
+		 * partially scrolled off the left of the screen. */
+		for(dst = bg - (bg_x & 0x07); dst < bg + LCD_WIDTH;
+				dst += 8, bg_x += 8)
+		{
+			memcpy(dst, __gb_tile_row(gb,
+					gb->vram[bg_map + (bg_x >> 3)],
+					bg_y & 0x07), 8);
+		}
+
+		bg_start = 0;
+	}
+
+	/* draw window */
+	if(gb->hram_io[IO_LCDC] & LCDC_WINDOW_ENABLE
+			&& gb->hram_io[IO_LY] >= gb->display.WY
+			&& gb->hram_io[IO_WX] <= 166)
+	{
+		uint16_t win_line;
+		uint8_t win_x, py;
+		uint8_t *dst;
+
+		win_line = (gb->hram_io[IO_LCDC] & LCDC_WINDOW_MAP) ?
+				    VRAM_BMAP_2 : VRAM_BMAP_1;
+		win_line += (gb->display.window_clear >> 3) * 0x20;
+		py = gb->display.window_clear & 0x07;
+
+		/* The window starts at WX - 7, which is off the left of the
+		 * screen when WX is less than 7. */
+		for(dst = bg + gb->hram_io[IO_WX] - 7, win_x = 0;
+				dst < bg + LCD_WIDTH;
+				dst += 8, win_x += 8)
+		{
+			memcpy(dst, __gb_tile_row(gb,
+					gb->vram[win_line + (win_x >> 3)], py), 8);
+		}
+
+		if(gb->hram_io[IO_WX] < 7)
+			bg_start = 0;
+		else if(gb->hram_io[IO_WX] - 7 < bg_start)
+			bg_start = gb->hram_io[IO_WX] - 7;
+
+		gb->display.window_clear++; // advance window line
+	}
+
+	if(bg_start < LCD_WIDTH)
+		__gb_shade_line(&pixels[bg_start], &bg[bg_start],
+				LCD_WIDTH - bg_start, bg_pal);
+#else
+	/* If background is enabled, draw it. */
+	if(gb->hram_io[IO_LCDC] & LCDC_BG_ENABLE)
+	{
+		uint8_t bg_y, disp_x, bg_x, idx, py, px, t1, t2;
+		uint16_t bg_map, tile;
+
+		/* Calculate current background line to draw. Constant because
+		 * this function draws only this one line each time it is
+		 * called. */
+		bg_y = gb->hram_io[IO_LY] + gb->hram_io[IO_SCY];
+
+		/* Get selected background map address for first tile
+		 * corresponding to current line.
+		 * 0x20 (32) is the width of a background tile, and the bit
+		 * shift is to calculate the address. */
+		bg_map =
+			((gb->hram_io[IO_LCDC] & LCDC_BG_MAP) ?
+			 VRAM_BMAP_2 : VRAM_BMAP_1)
+			+ (bg_y >> 3) * 0x20;
+
+		/* The displays (what the player sees) X coordinate, drawn right
+		 * to left. */
+		disp_x = LCD_WIDTH - 1;
+
+		/* The X coordinate to begin drawing the background at. */
+		bg_x = disp_x + gb->hram_io[IO_SCX];
+
+		/* Get tile index for current background tile. */
+		idx = gb->vram[bg_map + (bg_x >> 3)];
+		/* Y coordinate of tile pixel to draw. */
+		py = (bg_y & 0x07);
+		/* X coordinate of tile pixel to draw. */
+		px = 7 - (bg_x & 0x07);
+
+		/* Select addressing mode. */
+		if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+			tile = VRAM_TILES_1 + idx * 0x10;
+		else
+			tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
+
+		tile += 2 * py;
+
+		/* fetch first tile */
+		t1 = gb->vram[tile] >> px;
+		t2 = gb->vram[tile + 1] >> px;
+
+		for(; disp_x != 0xFF; disp_x--)
+		{
+			uint8_t c;
+
+			if(px == 8)
+			{
+				/* fetch next tile */
+				px = 0;
+				bg_x = disp_x + gb->hram_io[IO_SCX];
+				idx = gb->vram[bg_map + (bg_x >> 3)];
+
+				if(gb->hram_io[IO_LCDC] & LCDC_TILE_SELECT)
+					tile = VRAM_TILES_1 + idx * 0x10;
+				else
+					tile = VRAM_TILES_2 + ((idx + 0x80) % 0x100) * 0x10;
 
 				tile += 2 * py;
 				t1 = gb->vram[tile];
@@ -1636,12 +3201,22 @@ void __gb_draw_line(struct gb_s *gb)
 
 		gb->display.window_clear++; // advance window line
 	}
+#endif /* PEANUT_GB_USE_TILE_CACHE */
 
 	// draw sprites
 	if(gb->hram_io[IO_LCDC] & LCDC_OBJ_ENABLE)
 	{
 		uint8_t sprite_number;
-#if PEANUT_GB_HIGH_LCD_ACCURACY
+#if PEANUT_GB_USE_SPRITE_LINES
+		const uint8_t *sprites_to_render;
+		uint8_t number_of_sprites;
+
+		if(gb->sprite_lines.dirty)
+			__gb_update_sprite_lines(gb);
+
+		sprites_to_render = gb->sprite_lines.sprite[gb->hram_io[IO_LY]];
+		number_of_sprites = gb->sprite_lines.count[gb->hram_io[IO_LY]];
+#elif PEANUT_GB_HIGH_LCD_ACCURACY
 		uint8_t number_of_sprites = 0;
 
 		struct sprite_data sprites_to_render[MAX_SPRITES_LINE];
@@ -1693,7 +3268,11 @@ void __gb_draw_line(struct gb_s *gb)
 				sprite_number != 0xFF;
 				sprite_number--)
 		{
+#if PEANUT_GB_USE_SPRITE_LINES
+			uint8_t s = sprites_to_render[sprite_number];
+#else
 			uint8_t s = sprites_to_render[sprite_number].sprite_number;
+#endif
 #else
 		for (sprite_number = NUM_SPRITES - 1;
 			sprite_number != 0xFF;
@@ -1701,7 +3280,10 @@ void __gb_draw_line(struct gb_s *gb)
 		{
 			uint8_t s = sprite_number;
 #endif
-			uint8_t py, t1, t2, dir, start, end, shift, disp_x;
+			uint8_t py;
+#if !PEANUT_GB_USE_TILE_CACHE
+			uint8_t t1, t2, dir, start, end, shift, disp_x;
+#endif
 			/* Sprite Y position. */
 			uint8_t OY = gb->oam[4 * s + 0];
 			/* Sprite X position. */
@@ -1730,6 +3312,30 @@ void __gb_draw_line(struct gb_s *gb)
 			if(OF & OBJ_FLIP_Y)
 				py = (gb->hram_io[IO_LCDC] & LCDC_OBJ_SIZE ? 15 : 7) - py;
 
+#if PEANUT_GB_USE_TILE_CACHE
+			{
+				uint8_t sp_pal[4];
+
+				for(i = 0; i < 4; i++)
+				{
+					sp_pal[i] = (OF & OBJ_PALETTE)
+						? gb->display.sp_palette[i + 4]
+						: gb->display.sp_palette[i];
+#if PEANUT_GB_12_COLOUR
+					sp_pal[i] |= (OF & OBJ_PALETTE);
+#endif
+				}
+
+				/* Sprites always use the tiles at 0x8000. A tall
+				 * sprite is made of two consecutive tiles. */
+				__gb_draw_sprite_row(&pixels[OX - 8],
+					__gb_tile_cache_row(gb, OT + (py >> 3),
+						py & 0x07),
+					sp_pal, OF & OBJ_FLIP_X,
+					OF & OBJ_PRIORITY,
+					gb->display.bg_palette[0]);
+			}
+#else
 			// fetch the tile
 			t1 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py];
 			t2 = gb->vram[VRAM_TILES_1 + OT * 0x10 + 2 * py + 1];
@@ -1777,699 +3383,1260 @@ void __gb_draw_line(struct gb_s *gb)
 				t1 = t1 >> 1;
 				t2 = t2 >> 1;
 			}
+#endif
 		}
 	}
 
-	gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
-}
+#if PEANUT_GB_USE_LINE_HASH
+	{
+		const uint_fast8_t ly = gb->hram_io[IO_LY];
+		const uint32_t hash = __gb_hash_line(pixels);
+
+		if(hash != gb->display.line_hash[ly])
+		{
+			gb->display.line_hash[ly] = hash;
+			gb->display.line_changed[ly / 8] |= 1 << (ly % 8);
+		}
+	}
 #endif
 
+	if(gb->display.fb != NULL)
+		__gb_write_framebuffer(gb, pixels, gb->hram_io[IO_LY]);
+	else
+		gb->display.lcd_draw_line(gb, pixels, gb->hram_io[IO_LY]);
+}
+
 /**
- * Internal function used to step the CPU.
+ * Internal function used at the end of each frame to count whether the frame
+ * was drawn, and to decide whether the next frame is drawn.
  */
-void __gb_step_cpu(struct gb_s *gb)
+static void __gb_frame_skip_next(struct gb_s *gb)
 {
-	uint8_t opcode;
-	uint_fast16_t inst_cycles;
-	static const uint8_t op_cycles[0x100] =
-	{
-		/* *INDENT-OFF* */
-		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
-		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
-		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
-		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
-		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
-		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
-		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
-		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
-		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
-		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
-		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
-		/* *INDENT-ON* */
-	};
-	static const uint_fast16_t TAC_CYCLES[4] = {1024, 16, 64, 256};
+	bool skip;
 
-	/* Handle interrupts */
-	/* If gb_halt is positive, then an interrupt must have occurred by the
-	 * time we reach here, because on HALT, we jump to the next interrupt
-	 * immediately. */
-	while(gb->gb_halt || (gb->gb_ime &&
-			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
-	{
-		gb->gb_halt = false;
+	/* Frames run by gb_run_frames() without drawing are also skipped. */
+	if(gb->display.skip_frame || gb->display.skip_render)
+		gb->display.frames_skipped++;
+	else
+		gb->display.frames_drawn++;
+
+	/* In the adaptive mode, frames are skipped whilst the front-end is
+	 * behind. At least one frame is drawn every frame_skip_max + 1 frames
+	 * so that the screen is still updated. */
+	if(gb->display.frame_skip_max != 0)
+		skip = gb->display.frame_debt != 0 &&
+			gb->display.frame_skip_count < gb->display.frame_skip_max;
+	else if(gb->display.frame_skip_ratio != 0)
+		skip = gb->display.frame_skip_count <
+			gb->display.frame_skip_ratio;
+	else
+		skip = gb->direct.frame_skip && gb->display.frame_skip_count == 0;
 
-		if(!gb->gb_ime)
-			break;
+	gb->display.frame_skip_count = skip ?
+		gb->display.frame_skip_count + 1 : 0;
+	gb->display.skip_frame = skip;
+}
+#endif
 
-		/* Disable interrupts */
-		gb->gb_ime = false;
+/**
+ * Internal function used to update the timers, serial, RTC and LCD by the
+ * number of cycles executed since they were last updated. If the CPU is
+ * halted, time is advanced until an interrupt occurs.
+ */
+static void __gb_service_events(struct gb_s *gb)
+{
+	uint_fast32_t inst_cycles = gb->counter.sched_cycles;
 
-		/* Push Program Counter */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+	gb->counter.sched_cycles = 0;
 
-		/* Call interrupt handler if required. */
-		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
-		{
-			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= VBLANK_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
-		{
-			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= LCDC_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
-		{
-			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= TIMER_INTR;
-		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
+	do
+	{
+		/* DIV register timing */
+		gb->counter.div_count += inst_cycles;
+		while(gb->counter.div_count >= DIV_CYCLES)
 		{
-			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= SERIAL_INTR;
+			gb->hram_io[IO_DIV]++;
+			gb->counter.div_count -= DIV_CYCLES;
 		}
-		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
+
+		/* Check for RTC tick. */
+		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
 		{
-			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
-			gb->hram_io[IO_IF] ^= CONTROL_INTR;
-		}
+			gb->counter.rtc_count += inst_cycles;
+			while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
+			{
+				gb->counter.rtc_count -= RTC_CYCLES;
 
-		break;
-	}
+				/* Detect invalid rollover. */
+				if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
+				{
+					gb->rtc_real.reg.sec = 0;
+					continue;
+				}
 
-	/* Obtain opcode */
-	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
-	inst_cycles = op_cycles[opcode];
+				if(++gb->rtc_real.reg.sec != 60)
+					continue;
 
-	/* Execute opcode */
-	switch(opcode)
-	{
-	case 0x00: /* NOP */
-		break;
+				gb->rtc_real.reg.sec = 0;
+				if(gb->rtc_real.reg.min == 63)
+				{
+					gb->rtc_real.reg.min = 0;
+					continue;
+				}
+				if(++gb->rtc_real.reg.min != 60)
+					continue;
 
-	case 0x01: /* LD BC, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+				gb->rtc_real.reg.min = 0;
+				if(gb->rtc_real.reg.hour == 31)
+				{
+					gb->rtc_real.reg.hour = 0;
+					continue;
+				}
+				if(++gb->rtc_real.reg.hour != 24)
+					continue;
 
-	case 0x02: /* LD (BC), A */
-		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);
-		break;
+				gb->rtc_real.reg.hour = 0;
+				if(++gb->rtc_real.reg.yday != 0)
+					continue;
 
-	case 0x03: /* INC BC */
-		gb->cpu_reg.bc.reg++;
-		break;
+				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
+					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
 
-	case 0x04: /* INC B */
-		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+				gb->rtc_real.reg.high ^= 1;
+			}
+		}
 
-	case 0x05: /* DEC B */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
-		break;
+		/* Check serial transmission. */
+		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
+		{
+			/* If new transfer, call TX function. */
+			if(gb->counter.serial_count == 0 &&
+				gb->gb_serial_tx != NULL)
+				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
 
-	case 0x06: /* LD B, imm */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+			gb->counter.serial_count += inst_cycles;
 
-	case 0x07: /* RLCA */
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.a & 0x01);
-		break;
+			/* If it's time to receive byte, call RX function. */
+			if(gb->counter.serial_count >= SERIAL_CYCLES)
+			{
+				/* If RX can be done, do it. */
+				/* If RX failed, do not change SB if using external
+				 * clock, or set to 0xFF if using internal clock. */
+				uint8_t rx;
 
-	case 0x08: /* LD (imm), SP */
-	{
-		uint8_t h, l;
-		uint16_t temp;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		temp = PEANUT_GB_U8_TO_U16(h,l);
-		__gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
-		__gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
-		break;
-	}
+				if(gb->gb_serial_rx != NULL &&
+					(gb->gb_serial_rx(gb, &rx) ==
+						GB_SERIAL_RX_SUCCESS))
+				{
+					gb->hram_io[IO_SB] = rx;
 
-	case 0x09: /* ADD HL, BC */
-	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.bc.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
-		break;
-	}
+					/* Inform game of serial TX/RX completion. */
+					gb->hram_io[IO_SC] &= 0x01;
+					gb->hram_io[IO_IF] |= SERIAL_INTR;
+				}
+				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
+				{
+					/* If using internal clock, and console is not
+					 * attached to any external peripheral, shifted
+					 * bits are replaced with logic 1. */
+					gb->hram_io[IO_SB] = 0xFF;
 
-	case 0x0A: /* LD A, (BC) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
-		break;
+					/* Inform game of serial TX/RX completion. */
+					gb->hram_io[IO_SC] &= 0x01;
+					gb->hram_io[IO_IF] |= SERIAL_INTR;
+				}
+				else
+				{
+					/* If using external clock, and console is not
+					 * attached to any external peripheral, bits are
+					 * not shifted, so SB is not modified. */
+				}
 
-	case 0x0B: /* DEC BC */
-		gb->cpu_reg.bc.reg--;
-		break;
+				gb->counter.serial_count = 0;
+			}
+		}
 
-	case 0x0C: /* INC C */
-		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+		/* TIMA register timing */
+		/* TODO: Change tac_enable to struct of TAC timer control bits. */
+		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
+		{
+			gb->counter.tima_count += inst_cycles;
 
-	case 0x0D: /* DEC C */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
-		break;
+			while(gb->counter.tima_count >=
+				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
+			{
+				gb->counter.tima_count -=
+					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
 
-	case 0x0E: /* LD C, imm */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+				if(++gb->hram_io[IO_TIMA] == 0)
+				{
+					gb->hram_io[IO_IF] |= TIMER_INTR;
+					/* On overflow, set TMA to TIMA. */
+					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
+				}
+			}
+		}
 
-	case 0x0F: /* RRCA */
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = gb->cpu_reg.a & 0x01;
-		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
-		break;
+		/* If LCD is off, don't update LCD state or increase the LCD
+		 * ticks. Instead, keep track of the amount of time that is
+		 * being passed. */
+		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
+		{
+			gb->counter.lcd_off_count += inst_cycles;
+			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
+			{
+				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
+				gb->gb_frame = true;
+#if PEANUT_GB_USE_LINE_HASH
+				/* No lines are drawn whilst the LCD is off. */
+				memset(gb->display.line_changed, 0,
+					sizeof(gb->display.line_changed));
+#endif
+			}
+			continue;
+		}
 
-	case 0x10: /* STOP */
-		//gb->gb_halt = true;
-		break;
+		/* LCD Timing */
+		gb->counter.lcd_count += inst_cycles;
 
-	case 0x11: /* LD DE, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+		/* New Scanline. HBlank -> VBlank or OAM Scan */
+		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
+		{
+			gb->counter.lcd_count -= LCD_LINE_CYCLES;
 
-	case 0x12: /* LD (DE), A */
-		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
-		break;
+			/* Next line */
+			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
+			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
+				gb->hram_io[IO_LY] = 0;
 
-	case 0x13: /* INC DE */
-		gb->cpu_reg.de.reg++;
-		break;
+			/* LYC Update */
+			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
+			{
+				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
 
-	case 0x14: /* INC D */
-		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.d);
-		break;
+				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
+			}
+			else
+				gb->hram_io[IO_STAT] &= 0xFB;
 
-	case 0x15: /* DEC D */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
-		break;
+			/* Check if LCD should be in Mode 1 (VBLANK) state */
+			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
+			{
+				gb->hram_io[IO_STAT] =
+					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
+				gb->gb_frame = true;
+				gb->hram_io[IO_IF] |= VBLANK_INTR;
+				gb->lcd_blank = false;
 
-	case 0x16: /* LD D, imm */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
 
-	case 0x17: /* RLA */
-	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f.f_bits.c;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = (temp >> 7) & 0x01;
-		break;
-	}
+#if ENABLE_LCD
+				/* Check if we need to draw the next frame or skip
+				 * it. */
+				__gb_frame_skip_next(gb);
 
-	case 0x18: /* JR imm */
-	{
-		int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.pc.reg += temp;
-		break;
-	}
-
-	case 0x19: /* ADD HL, DE */
-	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			(temp ^ gb->cpu_reg.hl.reg ^ gb->cpu_reg.de.reg) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFFFF0000) ? 1 : 0;
-		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
-		break;
-	}
-
-	case 0x1A: /* LD A, (DE) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
-		break;
-
-	case 0x1B: /* DEC DE */
-		gb->cpu_reg.de.reg--;
-		break;
+				/* If interlaced is activated, change which lines get
+				 * updated. Also, only update lines on frames that are
+				 * actually drawn when frame skip is enabled. */
+				if(gb->direct.interlace && !gb->display.skip_frame)
+				{
+					gb->display.interlace_count =
+						!gb->display.interlace_count;
+				}
+#endif
+                                /* If halted forever, then return on VBLANK. */
+                                if(gb->gb_halt && !gb->hram_io[IO_IE])
+					break;
+			}
+			/* Start of normal Line (not in VBLANK) */
+			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
+			{
+				if(gb->hram_io[IO_LY] == 0)
+				{
+					/* Clear Screen */
+					gb->display.WY = gb->hram_io[IO_WY];
+					gb->display.window_clear = 0;
+#if PEANUT_GB_USE_LINE_HASH
+					memset(gb->display.line_changed, 0,
+						sizeof(gb->display.line_changed));
+#endif
+				}
 
-	case 0x1C: /* INC E */
-		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.e);
-		break;
+				/* OAM Search occurs at the start of the line. */
+				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
+				gb->counter.lcd_count = 0;
 
-	case 0x1D: /* DEC E */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
-		break;
+				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
+					gb->hram_io[IO_IF] |= LCDC_INTR;
 
-	case 0x1E: /* LD E, imm */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+				/* If halted immediately jump to next LCD mode.
+				 * From OAM Search to LCD Draw. */
+				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
+				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
+				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
+			}
+		}
+		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
+				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
+		{
+			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
 
-	case 0x1F: /* RRA */
-	{
-		uint8_t temp = gb->cpu_reg.a;
-		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f.f_bits.c << 7);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.c = temp & 0x1;
-		break;
-	}
+			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
+				gb->hram_io[IO_IF] |= LCDC_INTR;
 
-	case 0x20: /* JR NZ, imm */
-		if(!gb->cpu_reg.f.f_bits.z)
+			/* If halted immediately, jump from OAM Scan to LCD Draw. */
+			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
+				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
+		}
+		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
+		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
+				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
+			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
+#if ENABLE_LCD
+			if(!gb->lcd_blank)
+				__gb_draw_line(gb);
+#endif
+			/* If halted immediately jump to next LCD mode. */
+			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
+				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
 		}
-		else
-			gb->cpu_reg.pc.reg++;
-
-		break;
-
-	case 0x21: /* LD HL, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
+	/* If halted, loop until an interrupt occurs. */
 
-	case 0x22: /* LDI (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg++;
-		break;
+	__gb_schedule_next_event(gb);
+}
 
-	case 0x23: /* INC HL */
-		gb->cpu_reg.hl.reg++;
-		break;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+/**
+ * Returns true if the value read from addr can only be changed by the
+ * servicing of an event or by an interrupt handler.
+ */
+static bool __gb_is_idle_poll_addr(const uint_fast16_t addr)
+{
+	return (addr >= WRAM_0_ADDR && addr < ECHO_ADDR) ||
+		addr >= HRAM_ADDR || addr == IO_ADDR + IO_IF ||
+		addr == IO_ADDR + IO_STAT || addr == IO_ADDR + IO_LY;
+}
 
-	case 0x24: /* INC H */
-		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+/**
+ * Reads a polled address without servicing events, which the caller has
+ * checked are not due.
+ */
+static uint8_t __gb_read_idle_poll(struct gb_s *gb, const uint_fast16_t addr)
+{
+	if(addr >= IO_ADDR)
+		return gb->hram_io[addr - IO_ADDR];
 
-	case 0x25: /* DEC H */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
-		break;
+	return __gb_read(gb, addr);
+}
 
-	case 0x26: /* LD H, imm */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+/**
+ * Executes one iteration of the loop body that starts at PC and ends with a
+ * JR, which is len bytes after PC. Only instructions that do not write to
+ * memory, and whose results only depend on A and on polled memory, may be in
+ * the body. Only A and F are modified.
+ *
+ * \returns	Number of cycles taken by the body, or 0 if the body has any
+ *		other instruction.
+ */
+static uint_fast32_t __gb_run_idle_loop_body(struct gb_s *gb,
+		const uint_fast16_t len)
+{
+	const uint_fast16_t end = gb->cpu_reg.pc.reg + len;
+	uint_fast16_t addr = gb->cpu_reg.pc.reg;
+	uint_fast32_t cycles = 0;
 
-	case 0x27: /* DAA */
+	while(addr < end)
 	{
-		/* The following is from SameBoy. MIT License. */
-		int16_t a = gb->cpu_reg.a;
+		uint8_t val;
 
-		if(gb->cpu_reg.f.f_bits.n)
+		switch(__gb_read(gb, addr))
 		{
-			if(gb->cpu_reg.f.f_bits.h)
-				a = (a - 0x06) & 0xFF;
+		case 0x7E: /* LD A, (HL) */
+			if(!__gb_is_idle_poll_addr(gb->cpu_reg.hl.reg))
+				return 0;
+
+			gb->cpu_reg.a =
+				__gb_read_idle_poll(gb, gb->cpu_reg.hl.reg);
+			addr += 1;
+			cycles += 8;
+			break;
 
-			if(gb->cpu_reg.f.f_bits.c)
-				a -= 0x60;
-		}
-		else
-		{
-			if(gb->cpu_reg.f.f_bits.h || (a & 0x0F) > 9)
-				a += 0x06;
+		case 0xA7: /* AND A */
+			PGB_INSTR_AND_R8(gb->cpu_reg.a);
+			addr += 1;
+			cycles += 4;
+			break;
 
-			if(gb->cpu_reg.f.f_bits.c || a > 0x9F)
-				a += 0x60;
-		}
+		case 0xB7: /* OR A */
+			PGB_INSTR_OR_R8(gb->cpu_reg.a);
+			addr += 1;
+			cycles += 4;
+			break;
 
-		if((a & 0x100) == 0x100)
-			gb->cpu_reg.f.f_bits.c = 1;
+		case 0xCB: /* BIT b, A */
+			val = __gb_read(gb, addr + 1);
+			if((val & 0xC7) != 0x47)
+				return 0;
+
+			gb->cpu_reg.f.reg = (gb->cpu_reg.f.reg &
+					PEANUT_GB_CPUFLAG_MASK_CARRY) |
+				PGB_SET_ZERO(!((gb->cpu_reg.a >>
+						((val >> 3) & 0x7)) & 0x1)) |
+				PGB_SET_HALFC(1);
+			addr += 2;
+			cycles += 8;
+			break;
 
-		gb->cpu_reg.a = a;
-		gb->cpu_reg.f.f_bits.z = (gb->cpu_reg.a == 0);
-		gb->cpu_reg.f.f_bits.h = 0;
+		case 0xE6: /* AND imm */
+			val = __gb_read(gb, addr + 1);
+			PGB_INSTR_AND_R8(val);
+			addr += 2;
+			cycles += 8;
+			break;
 
-		break;
-	}
+		case 0xF0: /* LDH A, (imm) */
+			val = __gb_read(gb, addr + 1);
+			if(!__gb_is_idle_poll_addr(IO_ADDR | val))
+				return 0;
 
-	case 0x28: /* JR Z, imm */
-		if(gb->cpu_reg.f.f_bits.z)
+			gb->cpu_reg.a = __gb_read_idle_poll(gb, IO_ADDR | val);
+			addr += 2;
+			cycles += 12;
+			break;
+
+		case 0xFA: /* LD A, (imm) */
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg++;
+			const uint_fast16_t src = PEANUT_GB_U8_TO_U16(
+					__gb_read(gb, addr + 2),
+					__gb_read(gb, addr + 1));
 
-		break;
+			if(!__gb_is_idle_poll_addr(src))
+				return 0;
 
-	case 0x29: /* ADD HL, HL */
-	{
-		gb->cpu_reg.f.f_bits.c = (gb->cpu_reg.hl.reg & 0x8000) > 0;
-		gb->cpu_reg.hl.reg <<= 1;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = (gb->cpu_reg.hl.reg & 0x1000) > 0;
-		break;
-	}
+			gb->cpu_reg.a = __gb_read_idle_poll(gb, src);
+			addr += 3;
+			cycles += 16;
+			break;
+		}
 
-	case 0x2A: /* LD A, (HL+) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
-		break;
+		case 0xFE: /* CP imm */
+			val = __gb_read(gb, addr + 1);
+			PGB_INSTR_CP_R8(val);
+			addr += 2;
+			cycles += 8;
+			break;
 
-	case 0x2B: /* DEC HL */
-		gb->cpu_reg.hl.reg--;
-		break;
+		default:
+			return 0;
+		}
+	}
 
-	case 0x2C: /* INC L */
-		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+	/* The last instruction must be the JR. An empty loop body is allowed,
+	 * as the JR then waits for an interrupt. */
+	if(addr != end)
+		return 0;
 
-	case 0x2D: /* DEC L */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.l);
-		break;
+	return cycles;
+}
 
-	case 0x2E: /* LD L, imm */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+/**
+ * Called after a JR instruction has jumped backwards to PC. If the loop only
+ * polls memory that changes on events, and the next iteration would leave the
+ * CPU in the same state, then so would every iteration until the next event.
+ * The iterations that complete before the next event is due are then skipped
+ * at once.
+ *
+ * \param offset	Negative offset of the JR instruction.
+ * \param jr_cycles	Cycles taken by the JR instruction.
+ */
+static void __gb_skip_idle_loop(struct gb_s *gb, const int8_t offset,
+		const uint_fast16_t jr_cycles)
+{
+	const uint_fast16_t len = (uint_fast16_t)(-offset) - 2;
+	const uint8_t a = gb->cpu_reg.a;
+	const uint8_t f = gb->cpu_reg.f.reg;
+	const uint_fast32_t done = gb->counter.sched_cycles + jr_cycles;
+	uint_fast32_t body_cycles;
+	uint_fast32_t loop_cycles;
+	uint_fast32_t skip;
+	bool same;
+
+	if(len > IDLE_LOOP_MAX_LEN)
+		return;
 
-	case 0x2F: /* CPL */
-		gb->cpu_reg.a = ~gb->cpu_reg.a;
-		gb->cpu_reg.f.f_bits.n = 1;
-		gb->cpu_reg.f.f_bits.h = 1;
-		break;
+	/* Events must be serviced first. This also means that the polled I/O
+	 * registers are up to date. */
+	if(done >= gb->counter.sched_next)
+		return;
 
-	case 0x30: /* JR NC, imm */
-		if(!gb->cpu_reg.f.f_bits.c)
-		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg++;
+	/* A pending interrupt is handled before the next instruction. */
+	if(gb->gb_ime &&
+			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR)
+		return;
 
-		break;
+	body_cycles = __gb_run_idle_loop_body(gb, len);
+	same = gb->cpu_reg.a == a && gb->cpu_reg.f.reg == f;
+	gb->cpu_reg.a = a;
+	gb->cpu_reg.f.reg = f;
 
-	case 0x31: /* LD SP, imm */
-		gb->cpu_reg.sp.bytes.p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.sp.bytes.s = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		break;
+	if(!same || (body_cycles == 0 && len != 0))
+		return;
 
-	case 0x32: /* LD (HL), A */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
-		gb->cpu_reg.hl.reg--;
-		break;
+	/* Skip the iterations that complete before the next event, as the
+	 * events would have been serviced on the first instruction to complete
+	 * after it was due. */
+	loop_cycles = body_cycles + jr_cycles;
+	skip = ((gb->counter.sched_next - done - 1) / loop_cycles) *
+		loop_cycles;
+	gb->counter.sched_cycles += skip;
+	gb->counter.idle_cycles += skip;
+}
+#endif
 
-	case 0x33: /* INC SP */
-		gb->cpu_reg.sp.reg++;
-		break;
+#if PEANUT_GB_THREADED_DISPATCH
+/* Each opcode also has a label, so that its address may be taken. */
+# define PGB_OPCODE(op)		case op: op_##op
+# define PGB_OPCODE_ROW(r)						\
+	&&op_##r##0, &&op_##r##1, &&op_##r##2, &&op_##r##3,		\
+	&&op_##r##4, &&op_##r##5, &&op_##r##6, &&op_##r##7,		\
+	&&op_##r##8, &&op_##r##9, &&op_##r##A, &&op_##r##B,		\
+	&&op_##r##C, &&op_##r##D, &&op_##r##E, &&op_##r##F
+#else
+# define PGB_OPCODE(op)		case op
+#endif
 
-	case 0x34: /* INC (HL) */
+/**
+ * Executes the instruction at PC, and services any events that are due.
+ * If chain is true and threaded dispatch is enabled, following instructions
+ * are also executed until an event or an interrupt is due.
+ */
+static void __gb_execute(struct gb_s *gb, const bool chain)
+{
+	uint8_t opcode;
+	uint_fast16_t inst_cycles;
+#if PEANUT_GB_THREADED_DISPATCH
+	static const void *const op_dispatch[0x100] =
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
-		PGB_INSTR_INC_R8(temp);
-		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
-		break;
-	}
+		PGB_OPCODE_ROW(0x0), PGB_OPCODE_ROW(0x1),
+		PGB_OPCODE_ROW(0x2), PGB_OPCODE_ROW(0x3),
+		PGB_OPCODE_ROW(0x4), PGB_OPCODE_ROW(0x5),
+		PGB_OPCODE_ROW(0x6), PGB_OPCODE_ROW(0x7),
+		PGB_OPCODE_ROW(0x8), PGB_OPCODE_ROW(0x9),
+		PGB_OPCODE_ROW(0xA), PGB_OPCODE_ROW(0xB),
+		PGB_OPCODE_ROW(0xC), PGB_OPCODE_ROW(0xD),
+		PGB_OPCODE_ROW(0xE), PGB_OPCODE_ROW(0xF)
+	};
+#endif
+	static const uint8_t op_cycles[0x100] =
+	{
+		/* *INDENT-OFF* */
+		/*0 1 2  3  4  5  6  7  8  9  A  B  C  D  E  F	*/
+		4,12, 8, 8, 4, 4, 8, 4,20, 8, 8, 8, 4, 4, 8, 4,	/* 0x00 */
+		4,12, 8, 8, 4, 4, 8, 4,12, 8, 8, 8, 4, 4, 8, 4,	/* 0x10 */
+		8,12, 8, 8, 4, 4, 8, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x20 */
+		8,12, 8, 8,12,12,12, 4, 8, 8, 8, 8, 4, 4, 8, 4,	/* 0x30 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x40 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x50 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x60 */
+		8, 8, 8, 8, 8, 8, 4, 8, 4, 4, 4, 4, 4, 4, 8, 4, /* 0x70 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x80 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0x90 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xA0 */
+		4, 4, 4, 4, 4, 4, 8, 4, 4, 4, 4, 4, 4, 4, 8, 4,	/* 0xB0 */
+		8,12,12,16,12,16, 8,16, 8,16,12, 8,12,24, 8,16,	/* 0xC0 */
+		8,12,12, 0,12,16, 8,16, 8,16,12, 0,12, 0, 8,16,	/* 0xD0 */
+		12,12,8, 0, 0,16, 8,16,16, 4,16, 0, 0, 0, 8,16,	/* 0xE0 */
+		12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16	/* 0xF0 */
+		/* *INDENT-ON* */
+	};
 
-	case 0x35: /* DEC (HL) */
+	/* Handle interrupts */
+	/* If gb_halt is positive, then an interrupt must have occurred by the
+	 * time we reach here, because on HALT, we jump to the next interrupt
+	 * immediately. */
+	while(gb->gb_halt || (gb->gb_ime &&
+			gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & ANY_INTR))
 	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
-		PGB_INSTR_DEC_R8(temp);
-		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
-		break;
-	}
+		gb->gb_halt = false;
 
-	case 0x36: /* LD (HL), imm */
-		__gb_write(gb, gb->cpu_reg.hl.reg, __gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+		if(!gb->gb_ime)
+			break;
 
-	case 0x37: /* SCF */
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = 0;
-		gb->cpu_reg.f.f_bits.c = 1;
-		break;
+		/* Disable interrupts */
+		gb->gb_ime = false;
 
-	case 0x38: /* JR C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
+		/* Push Program Counter */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+
+		/* Call interrupt handler if required. */
+		if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & VBLANK_INTR)
 		{
-			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-			gb->cpu_reg.pc.reg += temp;
-			inst_cycles += 4;
+			gb->cpu_reg.pc.reg = VBLANK_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= VBLANK_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & LCDC_INTR)
+		{
+			gb->cpu_reg.pc.reg = LCDC_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= LCDC_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & TIMER_INTR)
+		{
+			gb->cpu_reg.pc.reg = TIMER_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= TIMER_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & SERIAL_INTR)
+		{
+			gb->cpu_reg.pc.reg = SERIAL_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= SERIAL_INTR;
+		}
+		else if(gb->hram_io[IO_IF] & gb->hram_io[IO_IE] & CONTROL_INTR)
+		{
+			gb->cpu_reg.pc.reg = CONTROL_INTR_ADDR;
+			gb->hram_io[IO_IF] ^= CONTROL_INTR;
 		}
-		else
-			gb->cpu_reg.pc.reg++;
 
 		break;
+	}
+
+	/* Obtain opcode */
+	opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	inst_cycles = op_cycles[opcode];
 
-	case 0x39: /* ADD HL, SP */
+	/* Execute opcode */
+#if PEANUT_GB_THREADED_DISPATCH
+	goto *op_dispatch[opcode];
+#endif
+	switch(opcode)
 	{
-		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.sp.reg;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h =
-			((gb->cpu_reg.hl.reg & 0xFFF) + (gb->cpu_reg.sp.reg & 0xFFF)) & 0x1000 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = temp & 0x10000 ? 1 : 0;
-		gb->cpu_reg.hl.reg = (uint16_t)temp;
+	PGB_OPCODE(0x00): /* NOP */
 		break;
-	}
 
-	case 0x3A: /* LD A, (HL) */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg--);
+	PGB_OPCODE(0x01): /* LD BC, imm */
+		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x3B: /* DEC SP */
-		gb->cpu_reg.sp.reg--;
+	PGB_OPCODE(0x02): /* LD (BC), A */
+		__gb_write(gb, gb->cpu_reg.bc.reg, gb->cpu_reg.a);
 		break;
 
-	case 0x3C: /* INC A */
-		PGB_INSTR_INC_R8(gb->cpu_reg.a);
+	PGB_OPCODE(0x03): /* INC BC */
+		gb->cpu_reg.bc.reg++;
 		break;
 
-	case 0x3D: /* DEC A */
-		PGB_INSTR_DEC_R8(gb->cpu_reg.a);
+	PGB_OPCODE(0x04): /* INC B */
+		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0x3E: /* LD A, imm */
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc.reg++);
+	PGB_OPCODE(0x05): /* DEC B */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0x3F: /* CCF */
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = 0;
-		gb->cpu_reg.f.f_bits.c = ~gb->cpu_reg.f.f_bits.c;
+	PGB_OPCODE(0x06): /* LD B, imm */
+		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x40: /* LD B, B */
+	PGB_OPCODE(0x07): /* RLCA */
+		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | (gb->cpu_reg.a >> 7);
+		gb->cpu_reg.f.reg = PGB_SET_CARRY(gb->cpu_reg.a & 0x01);
 		break;
 
-	case 0x41: /* LD B, C */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.bc.bytes.c;
+	PGB_OPCODE(0x08): /* LD (imm), SP */
+	{
+		uint8_t h, l;
+		uint16_t temp;
+		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		temp = PEANUT_GB_U8_TO_U16(h,l);
+		__gb_write(gb, temp++, gb->cpu_reg.sp.bytes.p);
+		__gb_write(gb, temp, gb->cpu_reg.sp.bytes.s);
 		break;
+	}
 
-	case 0x42: /* LD B, D */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.d;
+	PGB_OPCODE(0x09): /* ADD HL, BC */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.bc.reg;
+		gb->cpu_reg.f.reg =
+			(gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_ZERO) |
+			PGB_SET_HALFC((temp ^ gb->cpu_reg.hl.reg ^
+					gb->cpu_reg.bc.reg) & 0x1000) |
+			PGB_SET_CARRY(temp & 0xFFFF0000);
+		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
 		break;
+	}
 
-	case 0x43: /* LD B, E */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.e;
+	PGB_OPCODE(0x0A): /* LD A, (BC) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.bc.reg);
 		break;
 
-	case 0x44: /* LD B, H */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.h;
+	PGB_OPCODE(0x0B): /* DEC BC */
+		gb->cpu_reg.bc.reg--;
 		break;
 
-	case 0x45: /* LD B, L */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.l;
+	PGB_OPCODE(0x0C): /* INC C */
+		PGB_INSTR_INC_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0x46: /* LD B, (HL) */
-		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OPCODE(0x0D): /* DEC C */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0x47: /* LD B, A */
-		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.a;
+	PGB_OPCODE(0x0E): /* LD C, imm */
+		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x48: /* LD C, B */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.bc.bytes.b;
+	PGB_OPCODE(0x0F): /* RRCA */
+		gb->cpu_reg.f.reg = PGB_SET_CARRY(gb->cpu_reg.a & 0x01);
+		gb->cpu_reg.a = (gb->cpu_reg.a >> 1) | (gb->cpu_reg.a << 7);
 		break;
 
-	case 0x49: /* LD C, C */
+	PGB_OPCODE(0x10): /* STOP */
+		//gb->gb_halt = true;
 		break;
 
-	case 0x4A: /* LD C, D */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.d;
+	PGB_OPCODE(0x11): /* LD DE, imm */
+		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x4B: /* LD C, E */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.e;
+	PGB_OPCODE(0x12): /* LD (DE), A */
+		__gb_write(gb, gb->cpu_reg.de.reg, gb->cpu_reg.a);
 		break;
 
-	case 0x4C: /* LD C, H */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.h;
+	PGB_OPCODE(0x13): /* INC DE */
+		gb->cpu_reg.de.reg++;
 		break;
 
-	case 0x4D: /* LD C, L */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.l;
+	PGB_OPCODE(0x14): /* INC D */
+		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0x4E: /* LD C, (HL) */
-		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OPCODE(0x15): /* DEC D */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0x4F: /* LD C, A */
-		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.a;
+	PGB_OPCODE(0x16): /* LD D, imm */
+		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x50: /* LD D, B */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.b;
+	PGB_OPCODE(0x17): /* RLA */
+	{
+		uint8_t temp = gb->cpu_reg.a;
+		gb->cpu_reg.a = (gb->cpu_reg.a << 1) | gb->cpu_reg.f.f_bits.c;
+		gb->cpu_reg.f.reg = PGB_SET_CARRY(temp >> 7);
 		break;
+	}
 
-	case 0x51: /* LD D, C */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.c;
+	PGB_OPCODE(0x18): /* JR imm */
+	{
+		int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.pc.reg += temp;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+		if(temp < 0)
+			__gb_skip_idle_loop(gb, temp, inst_cycles);
+#endif
 		break;
+	}
 
-	case 0x52: /* LD D, D */
+	PGB_OPCODE(0x19): /* ADD HL, DE */
+	{
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.de.reg;
+		gb->cpu_reg.f.reg =
+			(gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_ZERO) |
+			PGB_SET_HALFC((temp ^ gb->cpu_reg.hl.reg ^
+					gb->cpu_reg.de.reg) & 0x1000) |
+			PGB_SET_CARRY(temp & 0xFFFF0000);
+		gb->cpu_reg.hl.reg = (temp & 0x0000FFFF);
 		break;
+	}
 
-	case 0x53: /* LD D, E */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.de.bytes.e;
+	PGB_OPCODE(0x1A): /* LD A, (DE) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.de.reg);
 		break;
 
-	case 0x54: /* LD D, H */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.h;
+	PGB_OPCODE(0x1B): /* DEC DE */
+		gb->cpu_reg.de.reg--;
 		break;
 
-	case 0x55: /* LD D, L */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.l;
+	PGB_OPCODE(0x1C): /* INC E */
+		PGB_INSTR_INC_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0x56: /* LD D, (HL) */
-		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OPCODE(0x1D): /* DEC E */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0x57: /* LD D, A */
-		gb->cpu_reg.de.bytes.d = gb->cpu_reg.a;
+	PGB_OPCODE(0x1E): /* LD E, imm */
+		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x58: /* LD E, B */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.b;
+	PGB_OPCODE(0x1F): /* RRA */
+	{
+		uint8_t temp = gb->cpu_reg.a;
+		gb->cpu_reg.a = gb->cpu_reg.a >> 1 | (gb->cpu_reg.f.f_bits.c << 7);
+		gb->cpu_reg.f.reg = PGB_SET_CARRY(temp & 0x1);
 		break;
+	}
 
-	case 0x59: /* LD E, C */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.c;
-		break;
+	PGB_OPCODE(0x20): /* JR NZ, imm */
+		if(!gb->cpu_reg.f.f_bits.z)
+		{
+			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			gb->cpu_reg.pc.reg += temp;
+			inst_cycles += 4;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+			if(temp < 0)
+				__gb_skip_idle_loop(gb, temp, inst_cycles);
+#endif
+		}
+		else
+			gb->cpu_reg.pc.reg++;
 
-	case 0x5A: /* LD E, D */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x5B: /* LD E, E */
+	PGB_OPCODE(0x21): /* LD HL, imm */
+		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x5C: /* LD E, H */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.h;
+	PGB_OPCODE(0x22): /* LDI (HL), A */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
+		gb->cpu_reg.hl.reg++;
 		break;
 
-	case 0x5D: /* LD E, L */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.l;
+	PGB_OPCODE(0x23): /* INC HL */
+		gb->cpu_reg.hl.reg++;
 		break;
 
-	case 0x5E: /* LD E, (HL) */
-		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OPCODE(0x24): /* INC H */
+		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0x5F: /* LD E, A */
-		gb->cpu_reg.de.bytes.e = gb->cpu_reg.a;
+	PGB_OPCODE(0x25): /* DEC H */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0x60: /* LD H, B */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.b;
+	PGB_OPCODE(0x26): /* LD H, imm */
+		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x61: /* LD H, C */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.c;
-		break;
+	PGB_OPCODE(0x27): /* DAA */
+	{
+		/* The following is from SameBoy. MIT License. */
+		int16_t a = gb->cpu_reg.a;
 
-	case 0x62: /* LD H, D */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.d;
-		break;
+		if(gb->cpu_reg.f.f_bits.n)
+		{
+			if(gb->cpu_reg.f.f_bits.h)
+				a = (a - 0x06) & 0xFF;
 
-	case 0x63: /* LD H, E */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.e;
-		break;
+			if(gb->cpu_reg.f.f_bits.c)
+				a -= 0x60;
+		}
+		else
+		{
+			if(gb->cpu_reg.f.f_bits.h || (a & 0x0F) > 9)
+				a += 0x06;
+
+			if(gb->cpu_reg.f.f_bits.c || a > 0x9F)
+				a += 0x60;
+		}
+
+		gb->cpu_reg.a = a;
+		gb->cpu_reg.f.reg = (gb->cpu_reg.f.reg &
+				(PEANUT_GB_CPUFLAG_MASK_ARITH |
+				 PEANUT_GB_CPUFLAG_MASK_CARRY)) |
+			PGB_SET_ZERO(gb->cpu_reg.a == 0) |
+			PGB_SET_CARRY(a & 0x100);
 
-	case 0x64: /* LD H, H */
 		break;
+	}
+
+	PGB_OPCODE(0x28): /* JR Z, imm */
+		if(gb->cpu_reg.f.f_bits.z)
+		{
+			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			gb->cpu_reg.pc.reg += temp;
+			inst_cycles += 4;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+			if(temp < 0)
+				__gb_skip_idle_loop(gb, temp, inst_cycles);
+#endif
+		}
+		else
+			gb->cpu_reg.pc.reg++;
 
-	case 0x65: /* LD H, L */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x66: /* LD H, (HL) */
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OPCODE(0x29): /* ADD HL, HL */
+	{
+		const bool carry = (gb->cpu_reg.hl.reg & 0x8000) > 0;
+		gb->cpu_reg.hl.reg <<= 1;
+		gb->cpu_reg.f.reg =
+			(gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_ZERO) |
+			PGB_SET_HALFC(gb->cpu_reg.hl.reg & 0x1000) |
+			PGB_SET_CARRY(carry);
 		break;
+	}
 
-	case 0x67: /* LD H, A */
-		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.a;
+	PGB_OPCODE(0x2A): /* LD A, (HL+) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg++);
 		break;
 
-	case 0x68: /* LD L, B */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.b;
+	PGB_OPCODE(0x2B): /* DEC HL */
+		gb->cpu_reg.hl.reg--;
 		break;
 
-	case 0x69: /* LD L, C */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.c;
+	PGB_OPCODE(0x2C): /* INC L */
+		PGB_INSTR_INC_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0x6A: /* LD L, D */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.d;
+	PGB_OPCODE(0x2D): /* DEC L */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0x6B: /* LD L, E */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.e;
+	PGB_OPCODE(0x2E): /* LD L, imm */
+		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x6C: /* LD L, H */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.hl.bytes.h;
+	PGB_OPCODE(0x2F): /* CPL */
+		gb->cpu_reg.a = ~gb->cpu_reg.a;
+		gb->cpu_reg.f.reg |= PGB_SET_ARITH(1) | PGB_SET_HALFC(1);
 		break;
 
-	case 0x6D: /* LD L, L */
+	PGB_OPCODE(0x30): /* JR NC, imm */
+		if(!gb->cpu_reg.f.f_bits.c)
+		{
+			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			gb->cpu_reg.pc.reg += temp;
+			inst_cycles += 4;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+			if(temp < 0)
+				__gb_skip_idle_loop(gb, temp, inst_cycles);
+#endif
+		}
+		else
+			gb->cpu_reg.pc.reg++;
+
 		break;
 
-	case 0x6E: /* LD L, (HL) */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.hl.reg);
+	PGB_OPCODE(0x31): /* LD SP, imm */
+		gb->cpu_reg.sp.bytes.p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.sp.bytes.s = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		break;
 
-	case 0x6F: /* LD L, A */
-		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.a;
+	PGB_OPCODE(0x32): /* LD (HL), A */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
+		gb->cpu_reg.hl.reg--;
 		break;
 
-	case 0x70: /* LD (HL), B */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.b);
+	PGB_OPCODE(0x33): /* INC SP */
+		gb->cpu_reg.sp.reg++;
 		break;
 
-	case 0x71: /* LD (HL), C */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.c);
+	PGB_OPCODE(0x34): /* INC (HL) */
+	{
+		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_INSTR_INC_R8(temp);
+		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
 		break;
+	}
 
-	case 0x72: /* LD (HL), D */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.d);
+	PGB_OPCODE(0x35): /* DEC (HL) */
+	{
+		uint8_t temp = __gb_read(gb, gb->cpu_reg.hl.reg);
+		PGB_INSTR_DEC_R8(temp);
+		__gb_write(gb, gb->cpu_reg.hl.reg, temp);
 		break;
+	}
 
-	case 0x73: /* LD (HL), E */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.e);
+	PGB_OPCODE(0x36): /* LD (HL), imm */
+		__gb_write(gb, gb->cpu_reg.hl.reg, __gb_read(gb, gb->cpu_reg.pc.reg++));
 		break;
 
-	case 0x74: /* LD (HL), H */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.h);
+	PGB_OPCODE(0x37): /* SCF */
+		gb->cpu_reg.f.reg =
+			(gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_ZERO) |
+			PGB_SET_CARRY(1);
 		break;
 
-	case 0x75: /* LD (HL), L */
-		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.l);
+	PGB_OPCODE(0x38): /* JR C, imm */
+		if(gb->cpu_reg.f.f_bits.c)
+		{
+			int8_t temp = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+			gb->cpu_reg.pc.reg += temp;
+			inst_cycles += 4;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+			if(temp < 0)
+				__gb_skip_idle_loop(gb, temp, inst_cycles);
+#endif
+		}
+		else
+			gb->cpu_reg.pc.reg++;
+
 		break;
 
-	case 0x76: /* HALT */
+	PGB_OPCODE(0x39): /* ADD HL, SP */
 	{
-		int_fast16_t halt_cycles = INT_FAST16_MAX;
+		uint_fast32_t temp = gb->cpu_reg.hl.reg + gb->cpu_reg.sp.reg;
+		gb->cpu_reg.f.reg =
+			(gb->cpu_reg.f.reg & PEANUT_GB_CPUFLAG_MASK_ZERO) |
+			PGB_SET_HALFC(((gb->cpu_reg.hl.reg & 0xFFF) +
+					(gb->cpu_reg.sp.reg & 0xFFF)) & 0x1000) |
+			PGB_SET_CARRY(temp & 0x10000);
+		gb->cpu_reg.hl.reg = (uint16_t)temp;
+		break;
+	}
+
+	PGB_OPCODE(0x3A): /* LD A, (HL) */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg--);
+		break;
+
+	PGB_OPCODE(0x3B): /* DEC SP */
+		gb->cpu_reg.sp.reg--;
+		break;
+
+	PGB_OPCODE(0x3C): /* INC A */
+		PGB_INSTR_INC_R8(gb->cpu_reg.a);
+		break;
+
+	PGB_OPCODE(0x3D): /* DEC A */
+		PGB_INSTR_DEC_R8(gb->cpu_reg.a);
+		break;
+
+	PGB_OPCODE(0x3E): /* LD A, imm */
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		break;
+
+	PGB_OPCODE(0x3F): /* CCF */
+		gb->cpu_reg.f.reg = (gb->cpu_reg.f.reg &
+				(PEANUT_GB_CPUFLAG_MASK_ZERO |
+				 PEANUT_GB_CPUFLAG_MASK_CARRY)) ^
+			PEANUT_GB_CPUFLAG_MASK_CARRY;
+		break;
+
+	PGB_OPCODE(0x40): /* LD B, B */
+		break;
+
+	PGB_OPCODE(0x41): /* LD B, C */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.bc.bytes.c;
+		break;
+
+	PGB_OPCODE(0x42): /* LD B, D */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.d;
+		break;
+
+	PGB_OPCODE(0x43): /* LD B, E */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.de.bytes.e;
+		break;
+
+	PGB_OPCODE(0x44): /* LD B, H */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.h;
+		break;
+
+	PGB_OPCODE(0x45): /* LD B, L */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.hl.bytes.l;
+		break;
+
+	PGB_OPCODE(0x46): /* LD B, (HL) */
+		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	PGB_OPCODE(0x47): /* LD B, A */
+		gb->cpu_reg.bc.bytes.b = gb->cpu_reg.a;
+		break;
+
+	PGB_OPCODE(0x48): /* LD C, B */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.bc.bytes.b;
+		break;
+
+	PGB_OPCODE(0x49): /* LD C, C */
+		break;
+
+	PGB_OPCODE(0x4A): /* LD C, D */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.d;
+		break;
+
+	PGB_OPCODE(0x4B): /* LD C, E */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.de.bytes.e;
+		break;
+
+	PGB_OPCODE(0x4C): /* LD C, H */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.h;
+		break;
+
+	PGB_OPCODE(0x4D): /* LD C, L */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.hl.bytes.l;
+		break;
+
+	PGB_OPCODE(0x4E): /* LD C, (HL) */
+		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	PGB_OPCODE(0x4F): /* LD C, A */
+		gb->cpu_reg.bc.bytes.c = gb->cpu_reg.a;
+		break;
+
+	PGB_OPCODE(0x50): /* LD D, B */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.b;
+		break;
+
+	PGB_OPCODE(0x51): /* LD D, C */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.bc.bytes.c;
+		break;
+
+	PGB_OPCODE(0x52): /* LD D, D */
+		break;
+
+	PGB_OPCODE(0x53): /* LD D, E */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.de.bytes.e;
+		break;
+
+	PGB_OPCODE(0x54): /* LD D, H */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.h;
+		break;
+
+	PGB_OPCODE(0x55): /* LD D, L */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.hl.bytes.l;
+		break;
+
+	PGB_OPCODE(0x56): /* LD D, (HL) */
+		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	PGB_OPCODE(0x57): /* LD D, A */
+		gb->cpu_reg.de.bytes.d = gb->cpu_reg.a;
+		break;
+
+	PGB_OPCODE(0x58): /* LD E, B */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.b;
+		break;
+
+	PGB_OPCODE(0x59): /* LD E, C */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.bc.bytes.c;
+		break;
+
+	PGB_OPCODE(0x5A): /* LD E, D */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.de.bytes.d;
+		break;
+
+	PGB_OPCODE(0x5B): /* LD E, E */
+		break;
+
+	PGB_OPCODE(0x5C): /* LD E, H */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.h;
+		break;
+
+	PGB_OPCODE(0x5D): /* LD E, L */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.hl.bytes.l;
+		break;
+
+	PGB_OPCODE(0x5E): /* LD E, (HL) */
+		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	PGB_OPCODE(0x5F): /* LD E, A */
+		gb->cpu_reg.de.bytes.e = gb->cpu_reg.a;
+		break;
+
+	PGB_OPCODE(0x60): /* LD H, B */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.b;
+		break;
+
+	PGB_OPCODE(0x61): /* LD H, C */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.bc.bytes.c;
+		break;
+
+	PGB_OPCODE(0x62): /* LD H, D */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.d;
+		break;
+
+	PGB_OPCODE(0x63): /* LD H, E */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.de.bytes.e;
+		break;
+
+	PGB_OPCODE(0x64): /* LD H, H */
+		break;
+
+	PGB_OPCODE(0x65): /* LD H, L */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.hl.bytes.l;
+		break;
+
+	PGB_OPCODE(0x66): /* LD H, (HL) */
+		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	PGB_OPCODE(0x67): /* LD H, A */
+		gb->cpu_reg.hl.bytes.h = gb->cpu_reg.a;
+		break;
+
+	PGB_OPCODE(0x68): /* LD L, B */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.b;
+		break;
+
+	PGB_OPCODE(0x69): /* LD L, C */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.bc.bytes.c;
+		break;
+
+	PGB_OPCODE(0x6A): /* LD L, D */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.d;
+		break;
+
+	PGB_OPCODE(0x6B): /* LD L, E */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.de.bytes.e;
+		break;
+
+	PGB_OPCODE(0x6C): /* LD L, H */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.hl.bytes.h;
+		break;
+
+	PGB_OPCODE(0x6D): /* LD L, L */
+		break;
+
+	PGB_OPCODE(0x6E): /* LD L, (HL) */
+		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.hl.reg);
+		break;
+
+	PGB_OPCODE(0x6F): /* LD L, A */
+		gb->cpu_reg.hl.bytes.l = gb->cpu_reg.a;
+		break;
+
+	PGB_OPCODE(0x70): /* LD (HL), B */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.b);
+		break;
+
+	PGB_OPCODE(0x71): /* LD (HL), C */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.bc.bytes.c);
+		break;
+
+	PGB_OPCODE(0x72): /* LD (HL), D */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.d);
+		break;
+
+	PGB_OPCODE(0x73): /* LD (HL), E */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.de.bytes.e);
+		break;
+
+	PGB_OPCODE(0x74): /* LD (HL), H */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.h);
+		break;
+
+	PGB_OPCODE(0x75): /* LD (HL), L */
+		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.hl.bytes.l);
+		break;
+
+	PGB_OPCODE(0x76): /* HALT */
+	{
+		int_fast16_t halt_cycles = INT_FAST16_MAX;
+
+		/* The counters must be up to date to find the next event. */
+		__gb_sync_events(gb);
 
 		/* TODO: Emulate HALT bug? */
 		gb->gb_halt = true;
@@ -2530,306 +4697,304 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0x77: /* LD (HL), A */
+	PGB_OPCODE(0x77): /* LD (HL), A */
 		__gb_write(gb, gb->cpu_reg.hl.reg, gb->cpu_reg.a);
 		break;
 
-	case 0x78: /* LD A, B */
+	PGB_OPCODE(0x78): /* LD A, B */
 		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.b;
 		break;
 
-	case 0x79: /* LD A, C */
+	PGB_OPCODE(0x79): /* LD A, C */
 		gb->cpu_reg.a = gb->cpu_reg.bc.bytes.c;
 		break;
 
-	case 0x7A: /* LD A, D */
+	PGB_OPCODE(0x7A): /* LD A, D */
 		gb->cpu_reg.a = gb->cpu_reg.de.bytes.d;
 		break;
 
-	case 0x7B: /* LD A, E */
+	PGB_OPCODE(0x7B): /* LD A, E */
 		gb->cpu_reg.a = gb->cpu_reg.de.bytes.e;
 		break;
 
-	case 0x7C: /* LD A, H */
+	PGB_OPCODE(0x7C): /* LD A, H */
 		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.h;
 		break;
 
-	case 0x7D: /* LD A, L */
+	PGB_OPCODE(0x7D): /* LD A, L */
 		gb->cpu_reg.a = gb->cpu_reg.hl.bytes.l;
 		break;
 
-	case 0x7E: /* LD A, (HL) */
+	PGB_OPCODE(0x7E): /* LD A, (HL) */
 		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.hl.reg);
 		break;
 
-	case 0x7F: /* LD A, A */
+	PGB_OPCODE(0x7F): /* LD A, A */
 		break;
 
-	case 0x80: /* ADD A, B */
+	PGB_OPCODE(0x80): /* ADD A, B */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, 0);
 		break;
 
-	case 0x81: /* ADD A, C */
+	PGB_OPCODE(0x81): /* ADD A, C */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, 0);
 		break;
 
-	case 0x82: /* ADD A, D */
+	PGB_OPCODE(0x82): /* ADD A, D */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, 0);
 		break;
 
-	case 0x83: /* ADD A, E */
+	PGB_OPCODE(0x83): /* ADD A, E */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, 0);
 		break;
 
-	case 0x84: /* ADD A, H */
+	PGB_OPCODE(0x84): /* ADD A, H */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, 0);
 		break;
 
-	case 0x85: /* ADD A, L */
+	PGB_OPCODE(0x85): /* ADD A, L */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, 0);
 		break;
 
-	case 0x86: /* ADD A, (HL) */
+	PGB_OPCODE(0x86): /* ADD A, (HL) */
 		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
 		break;
 
-	case 0x87: /* ADD A, A */
+	PGB_OPCODE(0x87): /* ADD A, A */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.a, 0);
 		break;
 
-	case 0x88: /* ADC A, B */
+	PGB_OPCODE(0x88): /* ADC A, B */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x89: /* ADC A, C */
+	PGB_OPCODE(0x89): /* ADC A, C */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x8A: /* ADC A, D */
+	PGB_OPCODE(0x8A): /* ADC A, D */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x8B: /* ADC A, E */
+	PGB_OPCODE(0x8B): /* ADC A, E */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x8C: /* ADC A, H */
+	PGB_OPCODE(0x8C): /* ADC A, H */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x8D: /* ADC A, L */
+	PGB_OPCODE(0x8D): /* ADC A, L */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x8E: /* ADC A, (HL) */
+	PGB_OPCODE(0x8E): /* ADC A, (HL) */
 		PGB_INSTR_ADC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x8F: /* ADC A, A */
+	PGB_OPCODE(0x8F): /* ADC A, A */
 		PGB_INSTR_ADC_R8(gb->cpu_reg.a, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x90: /* SUB B */
+	PGB_OPCODE(0x90): /* SUB B */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, 0);
 		break;
 
-	case 0x91: /* SUB C */
+	PGB_OPCODE(0x91): /* SUB C */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, 0);
 		break;
 
-	case 0x92: /* SUB D */
+	PGB_OPCODE(0x92): /* SUB D */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, 0);
 		break;
 
-	case 0x93: /* SUB E */
+	PGB_OPCODE(0x93): /* SUB E */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, 0);
 		break;
 
-	case 0x94: /* SUB H */
+	PGB_OPCODE(0x94): /* SUB H */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, 0);
 		break;
 
-	case 0x95: /* SUB L */
+	PGB_OPCODE(0x95): /* SUB L */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, 0);
 		break;
 
-	case 0x96: /* SUB (HL) */
+	PGB_OPCODE(0x96): /* SUB (HL) */
 		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), 0);
 		break;
 
-	case 0x97: /* SUB A */
+	PGB_OPCODE(0x97): /* SUB A */
 		gb->cpu_reg.a = 0;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.z = 1;
-		gb->cpu_reg.f.f_bits.n = 1;
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(1) | PGB_SET_ARITH(1);
 		break;
 
-	case 0x98: /* SBC A, B */
+	PGB_OPCODE(0x98): /* SBC A, B */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.b, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x99: /* SBC A, C */
+	PGB_OPCODE(0x99): /* SBC A, C */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.bc.bytes.c, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x9A: /* SBC A, D */
+	PGB_OPCODE(0x9A): /* SBC A, D */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.d, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x9B: /* SBC A, E */
+	PGB_OPCODE(0x9B): /* SBC A, E */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.de.bytes.e, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x9C: /* SBC A, H */
+	PGB_OPCODE(0x9C): /* SBC A, H */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.h, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x9D: /* SBC A, L */
+	PGB_OPCODE(0x9D): /* SBC A, L */
 		PGB_INSTR_SBC_R8(gb->cpu_reg.hl.bytes.l, gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x9E: /* SBC A, (HL) */
+	PGB_OPCODE(0x9E): /* SBC A, (HL) */
 		PGB_INSTR_SBC_R8(__gb_read(gb, gb->cpu_reg.hl.reg), gb->cpu_reg.f.f_bits.c);
 		break;
 
-	case 0x9F: /* SBC A, A */
-		gb->cpu_reg.a = gb->cpu_reg.f.f_bits.c ? 0xFF : 0x00;
-		gb->cpu_reg.f.f_bits.z = !gb->cpu_reg.f.f_bits.c;
-		gb->cpu_reg.f.f_bits.n = 1;
-		gb->cpu_reg.f.f_bits.h = gb->cpu_reg.f.f_bits.c;
+	PGB_OPCODE(0x9F): /* SBC A, A */
+	{
+		const bool carry = gb->cpu_reg.f.f_bits.c;
+		gb->cpu_reg.a = carry ? 0xFF : 0x00;
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(!carry) | PGB_SET_ARITH(1) |
+			PGB_SET_HALFC(carry) | PGB_SET_CARRY(carry);
 		break;
+	}
 
-	case 0xA0: /* AND B */
+	PGB_OPCODE(0xA0): /* AND B */
 		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xA1: /* AND C */
+	PGB_OPCODE(0xA1): /* AND C */
 		PGB_INSTR_AND_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xA2: /* AND D */
+	PGB_OPCODE(0xA2): /* AND D */
 		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xA3: /* AND E */
+	PGB_OPCODE(0xA3): /* AND E */
 		PGB_INSTR_AND_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xA4: /* AND H */
+	PGB_OPCODE(0xA4): /* AND H */
 		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xA5: /* AND L */
+	PGB_OPCODE(0xA5): /* AND L */
 		PGB_INSTR_AND_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xA6: /* AND (HL) */
+	PGB_OPCODE(0xA6): /* AND (HL) */
 		PGB_INSTR_AND_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xA7: /* AND A */
+	PGB_OPCODE(0xA7): /* AND A */
 		PGB_INSTR_AND_R8(gb->cpu_reg.a);
 		break;
 
-	case 0xA8: /* XOR B */
+	PGB_OPCODE(0xA8): /* XOR B */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xA9: /* XOR C */
+	PGB_OPCODE(0xA9): /* XOR C */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xAA: /* XOR D */
+	PGB_OPCODE(0xAA): /* XOR D */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xAB: /* XOR E */
+	PGB_OPCODE(0xAB): /* XOR E */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xAC: /* XOR H */
+	PGB_OPCODE(0xAC): /* XOR H */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xAD: /* XOR L */
+	PGB_OPCODE(0xAD): /* XOR L */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xAE: /* XOR (HL) */
+	PGB_OPCODE(0xAE): /* XOR (HL) */
 		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xAF: /* XOR A */
+	PGB_OPCODE(0xAF): /* XOR A */
 		PGB_INSTR_XOR_R8(gb->cpu_reg.a);
 		break;
 
-	case 0xB0: /* OR B */
+	PGB_OPCODE(0xB0): /* OR B */
 		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xB1: /* OR C */
+	PGB_OPCODE(0xB1): /* OR C */
 		PGB_INSTR_OR_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xB2: /* OR D */
+	PGB_OPCODE(0xB2): /* OR D */
 		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xB3: /* OR E */
+	PGB_OPCODE(0xB3): /* OR E */
 		PGB_INSTR_OR_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xB4: /* OR H */
+	PGB_OPCODE(0xB4): /* OR H */
 		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xB5: /* OR L */
+	PGB_OPCODE(0xB5): /* OR L */
 		PGB_INSTR_OR_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xB6: /* OR (HL) */
+	PGB_OPCODE(0xB6): /* OR (HL) */
 		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xB7: /* OR A */
+	PGB_OPCODE(0xB7): /* OR A */
 		PGB_INSTR_OR_R8(gb->cpu_reg.a);
 		break;
 
-	case 0xB8: /* CP B */
+	PGB_OPCODE(0xB8): /* CP B */
 		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.b);
 		break;
 
-	case 0xB9: /* CP C */
+	PGB_OPCODE(0xB9): /* CP C */
 		PGB_INSTR_CP_R8(gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xBA: /* CP D */
+	PGB_OPCODE(0xBA): /* CP D */
 		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.d);
 		break;
 
-	case 0xBB: /* CP E */
+	PGB_OPCODE(0xBB): /* CP E */
 		PGB_INSTR_CP_R8(gb->cpu_reg.de.bytes.e);
 		break;
 
-	case 0xBC: /* CP H */
+	PGB_OPCODE(0xBC): /* CP H */
 		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.h);
 		break;
 
-	case 0xBD: /* CP L */
+	PGB_OPCODE(0xBD): /* CP L */
 		PGB_INSTR_CP_R8(gb->cpu_reg.hl.bytes.l);
 		break;
 
-	case 0xBE: /* CP (HL) */
+	PGB_OPCODE(0xBE): /* CP (HL) */
 		PGB_INSTR_CP_R8(__gb_read(gb, gb->cpu_reg.hl.reg));
 		break;
 
-	case 0xBF: /* CP A */
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.z = 1;
-		gb->cpu_reg.f.f_bits.n = 1;
+	PGB_OPCODE(0xBF): /* CP A */
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(1) | PGB_SET_ARITH(1);
 		break;
 
-	case 0xC0: /* RET NZ */
+	PGB_OPCODE(0xC0): /* RET NZ */
 		if(!gb->cpu_reg.f.f_bits.z)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2839,12 +5004,12 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xC1: /* POP BC */
+	PGB_OPCODE(0xC1): /* POP BC */
 		gb->cpu_reg.bc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.bc.bytes.b = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 
-	case 0xC2: /* JP NZ, imm */
+	PGB_OPCODE(0xC2): /* JP NZ, imm */
 		if(!gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2859,7 +5024,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xC3: /* JP imm */
+	PGB_OPCODE(0xC3): /* JP imm */
 	{
 		uint8_t p, c;
 		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2869,7 +5034,7 @@ void __gb_step_cpu(struct gb_s *gb)
 		break;
 	}
 
-	case 0xC4: /* CALL NZ imm */
+	PGB_OPCODE(0xC4): /* CALL NZ imm */
 		if(!gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2886,25 +5051,25 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xC5: /* PUSH BC */
+	PGB_OPCODE(0xC5): /* PUSH BC */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.b);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.bc.bytes.c);
 		break;
 
-	case 0xC6: /* ADD A, imm */
+	PGB_OPCODE(0xC6): /* ADD A, imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		PGB_INSTR_ADC_R8(val, 0);
 		break;
 	}
 
-	case 0xC7: /* RST 0x0000 */
+	PGB_OPCODE(0xC7): /* RST 0x0000 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0000;
 		break;
 
-	case 0xC8: /* RET Z */
+	PGB_OPCODE(0xC8): /* RET Z */
 		if(gb->cpu_reg.f.f_bits.z)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2913,14 +5078,14 @@ void __gb_step_cpu(struct gb_s *gb)
 		}
 		break;
 
-	case 0xC9: /* RET */
+	PGB_OPCODE(0xC9): /* RET */
 	{
 		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 	}
 
-	case 0xCA: /* JP Z, imm */
+	PGB_OPCODE(0xCA): /* JP Z, imm */
 		if(gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2935,11 +5100,11 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xCB: /* CB INST */
+	PGB_OPCODE(0xCB): /* CB INST */
 		inst_cycles = __gb_execute_cb(gb);
 		break;
 
-	case 0xCC: /* CALL Z, imm */
+	PGB_OPCODE(0xCC): /* CALL Z, imm */
 		if(gb->cpu_reg.f.f_bits.z)
 		{
 			uint8_t p, c;
@@ -2956,7 +5121,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xCD: /* CALL imm */
+	PGB_OPCODE(0xCD): /* CALL imm */
 	{
 		uint8_t p, c;
 		c = __gb_read(gb, gb->cpu_reg.pc.reg++);
@@ -2968,20 +5133,20 @@ void __gb_step_cpu(struct gb_s *gb)
 	}
 	break;
 
-	case 0xCE: /* ADC A, imm */
+	PGB_OPCODE(0xCE): /* ADC A, imm */
 	{
 		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
 		PGB_INSTR_ADC_R8(val, gb->cpu_reg.f.f_bits.c);
 		break;
 	}
 
-	case 0xCF: /* RST 0x0008 */
+	PGB_OPCODE(0xCF): /* RST 0x0008 */
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
 		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
 		gb->cpu_reg.pc.reg = 0x0008;
 		break;
 
-	case 0xD0: /* RET NC */
+	PGB_OPCODE(0xD0): /* RET NC */
 		if(!gb->cpu_reg.f.f_bits.c)
 		{
 			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
@@ -2991,12 +5156,12 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD1: /* POP DE */
+	PGB_OPCODE(0xD1): /* POP DE */
 		gb->cpu_reg.de.bytes.e = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		gb->cpu_reg.de.bytes.d = __gb_read(gb, gb->cpu_reg.sp.reg++);
 		break;
 
-	case 0xD2: /* JP NC, imm */
+	PGB_OPCODE(0xD2): /* JP NC, imm */
 		if(!gb->cpu_reg.f.f_bits.c)
 		{
 			uint8_t p, c;
@@ -3011,7 +5176,7 @@ void __gb_step_cpu(struct gb_s *gb)
 
 		break;
 
-	case 0xD4: /* CALL NC, imm */
+	PGB_OPCODE(0xD4): /* CALL NC, imm */
 		if(!gb->cpu_reg.f.f_bits.c)
 		{
 			uint8_t p, c;
@@ -3026,776 +5191,1741 @@ void __gb_step_cpu(struct gb_s *gb)
 		else
 			gb->cpu_reg.pc.reg += 2;
 
-		break;
+		break;
+
+	PGB_OPCODE(0xD5): /* PUSH DE */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
+		break;
+
+	PGB_OPCODE(0xD6): /* SUB imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		uint16_t temp = gb->cpu_reg.a - val;
+		gb->cpu_reg.f.reg = PGB_SET_ZERO((temp & 0xFF) == 0x00) |
+			PGB_SET_ARITH(1) |
+			PGB_SET_HALFC((gb->cpu_reg.a ^ val ^ temp) & 0x10) |
+			PGB_SET_CARRY(temp & 0xFF00);
+		gb->cpu_reg.a = (temp & 0xFF);
+		break;
+	}
+
+	PGB_OPCODE(0xD7): /* RST 0x0010 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0010;
+		break;
+
+	PGB_OPCODE(0xD8): /* RET C */
+		if(gb->cpu_reg.f.f_bits.c)
+		{
+			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
+			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+			inst_cycles += 12;
+		}
+
+		break;
+
+	PGB_OPCODE(0xD9): /* RETI */
+	{
+		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		gb->gb_ime = true;
+	}
+	break;
+
+	PGB_OPCODE(0xDA): /* JP C, imm */
+		if(gb->cpu_reg.f.f_bits.c)
+		{
+			uint8_t p, c;
+			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			p = __gb_read(gb, gb->cpu_reg.pc.reg);
+			gb->cpu_reg.pc.bytes.c = c;
+			gb->cpu_reg.pc.bytes.p = p;
+			inst_cycles += 4;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
+
+		break;
+
+	PGB_OPCODE(0xDC): /* CALL C, imm */
+		if(gb->cpu_reg.f.f_bits.c)
+		{
+			uint8_t p, c;
+			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+			gb->cpu_reg.pc.bytes.c = c;
+			gb->cpu_reg.pc.bytes.p = p;
+			inst_cycles += 12;
+		}
+		else
+			gb->cpu_reg.pc.reg += 2;
+
+		break;
+
+	PGB_OPCODE(0xDE): /* SBC A, imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		PGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
+		break;
+	}
+
+	PGB_OPCODE(0xDF): /* RST 0x0018 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0018;
+		break;
+
+	PGB_OPCODE(0xE0): /* LD (0xFF00+imm), A */
+		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
+			   gb->cpu_reg.a);
+		break;
+
+	PGB_OPCODE(0xE1): /* POP HL */
+		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		break;
+
+	PGB_OPCODE(0xE2): /* LD (C), A */
+		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
+		break;
+
+	PGB_OPCODE(0xE5): /* PUSH HL */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
+		break;
+
+	PGB_OPCODE(0xE6): /* AND imm */
+	{
+		uint8_t temp = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		PGB_INSTR_AND_R8(temp);
+		break;
+	}
+
+	PGB_OPCODE(0xE7): /* RST 0x0020 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0020;
+		break;
+
+	PGB_OPCODE(0xE8): /* ADD SP, imm */
+	{
+		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.f.reg =
+			PGB_SET_HALFC((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) |
+			PGB_SET_CARRY((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
+		gb->cpu_reg.sp.reg += offset;
+		break;
+	}
+
+	PGB_OPCODE(0xE9): /* JP (HL) */
+		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
+		break;
+
+	PGB_OPCODE(0xEA): /* LD (imm), A */
+	{
+		uint8_t h, l;
+		uint16_t addr;
+		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		addr = PEANUT_GB_U8_TO_U16(h, l);
+		__gb_write(gb, addr, gb->cpu_reg.a);
+		break;
+	}
+
+	PGB_OPCODE(0xEE): /* XOR imm */
+		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
+
+	PGB_OPCODE(0xEF): /* RST 0x0028 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0028;
+		break;
+
+	PGB_OPCODE(0xF0): /* LD A, (0xFF00+imm) */
+		gb->cpu_reg.a =
+			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
+
+	PGB_OPCODE(0xF1): /* POP AF */
+	{
+		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		/* The lower four bits of F are always 0. */
+		gb->cpu_reg.f.reg = temp_8 & 0xF0;
+		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
+		break;
+	}
+
+	PGB_OPCODE(0xF2): /* LD A, (C) */
+		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
+		break;
+
+	PGB_OPCODE(0xF3): /* DI */
+		gb->gb_ime = false;
+		break;
+
+	PGB_OPCODE(0xF5): /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.f.reg & 0xF0);
+		break;
+
+	PGB_OPCODE(0xF6): /* OR imm */
+		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
+		break;
+
+	PGB_OPCODE(0xF7): /* PUSH AF */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0030;
+		break;
+
+	PGB_OPCODE(0xF8): /* LD HL, SP+/-imm */
+	{
+		/* Taken from SameBoy, which is released under MIT Licence. */
+		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
+		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
+		gb->cpu_reg.f.reg =
+			PGB_SET_HALFC((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) |
+			PGB_SET_CARRY((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
+		break;
+	}
+
+	PGB_OPCODE(0xF9): /* LD SP, HL */
+		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
+		break;
+
+	PGB_OPCODE(0xFA): /* LD A, (imm) */
+	{
+		uint8_t h, l;
+		uint16_t addr;
+		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		addr = PEANUT_GB_U8_TO_U16(h, l);
+		gb->cpu_reg.a = __gb_read(gb, addr);
+		break;
+	}
+
+	PGB_OPCODE(0xFB): /* EI */
+		gb->gb_ime = true;
+		break;
+
+	PGB_OPCODE(0xFE): /* CP imm */
+	{
+		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
+		PGB_INSTR_CP_R8(val);
+		break;
+	}
+
+	PGB_OPCODE(0xFF): /* RST 0x0038 */
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
+		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
+		gb->cpu_reg.pc.reg = 0x0038;
+		break;
+
+	default:
+#if PEANUT_GB_THREADED_DISPATCH
+	op_0xD3: op_0xDB: op_0xDD: op_0xE3: op_0xE4: op_0xEB:
+	op_0xEC: op_0xED: op_0xF4: op_0xFC: op_0xFD:
+#endif
+		/* Return address where invalid opcode that was read. */
+		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
+		PGB_UNREACHABLE();
+	}
+
+	gb->counter.sched_cycles += inst_cycles;
+
+	/* The timers, serial, RTC and LCD are only updated once the next of their
+	 * events is due, or when the CPU is halted. */
+	if(PGB_LIKELY(gb->counter.sched_cycles < gb->counter.sched_next) &&
+			!gb->gb_halt)
+	{
+#if PEANUT_GB_THREADED_DISPATCH
+		/* Jump straight to the next instruction, unless an interrupt
+		 * must be handled first. */
+		if(chain && !(gb->gb_ime && gb->hram_io[IO_IF] &
+				gb->hram_io[IO_IE] & ANY_INTR))
+		{
+			opcode = __gb_read(gb, gb->cpu_reg.pc.reg++);
+			inst_cycles = op_cycles[opcode];
+			goto *op_dispatch[opcode];
+		}
+#else
+		(void) chain;
+#endif
+		return;
+	}
+
+	__gb_service_events(gb);
+}
+
+#undef PGB_OPCODE
+#undef PGB_OPCODE_ROW
+
+/**
+ * Internal function used to step the CPU.
+ */
+void __gb_step_cpu(struct gb_s *gb)
+{
+	__gb_execute(gb, false);
+}
+
+void gb_run_frame(struct gb_s *gb)
+{
+	gb->gb_frame = false;
+
+	while(!gb->gb_frame)
+		__gb_execute(gb, true);
+}
+
+void gb_run_frames(struct gb_s *gb, uint_fast32_t frames,
+		unsigned int flags)
+{
+	if(frames == 0)
+		return;
+
+	/* The LCD timing, interrupts and STAT are still emulated for each
+	 * frame; only the drawing of lines is skipped. */
+	gb->display.skip_render = true;
+	while(--frames != 0)
+		gb_run_frame(gb);
+
+	/* The final frame is drawn even if frame skip would skip it, after
+	 * which frame skip starts again from a drawn frame. */
+	gb->display.skip_render = (flags & GB_RUN_NO_RENDER) != 0;
+	if(!gb->display.skip_render)
+	{
+		gb->display.skip_frame = false;
+		gb->display.frame_skip_count = 0;
+	}
+
+	gb_run_frame(gb);
+	gb->display.skip_render = false;
+}
+
+int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
+{
+	const uint_fast16_t ram_size_location = 0x0149;
+	const uint_fast32_t ram_sizes[] =
+	{
+		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
+		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
+	};
+	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+
+	/* MBC2 always has 512 half-bytes of cart RAM.
+	 * This assumes that only the lower nibble of each byte is used; the
+	 * nibbles are not packed. */
+	if(gb->mbc == 2)
+	{
+		*ram_size = 0x200;
+		return 0;
+	}
+
+	/* Return -1 on invalid or unsupported RAM size. */
+	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
+		return -1;
+
+	*ram_size = ram_sizes[ram_size_code];
+	return 0;
+}
+
+PGB_DEPRECATED("Does not return error code. Use gb_get_save_size_s instead.")
+uint_fast32_t gb_get_save_size(struct gb_s *gb)
+{
+	const uint_fast16_t ram_size_location = 0x0149;
+	const uint_fast32_t ram_sizes[] =
+	{
+		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
+		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
+	};
+	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+
+	/* MBC2 always has 512 half-bytes of cart RAM.
+	 * This assumes that only the lower nibble of each byte is used; the
+	 * nibbles are not packed. */
+	if(gb->mbc == 2)
+		return 0x200;
+
+	/* Return 0 on invalid or unsupported RAM size. */
+	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
+		return 0;
+
+	return ram_sizes[ram_size_code];
+}
+
+void gb_init_serial(struct gb_s *gb,
+		    void (*gb_serial_tx)(struct gb_s*, const uint8_t),
+		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
+			    uint8_t*))
+{
+	gb->gb_serial_tx = gb_serial_tx;
+	gb->gb_serial_rx = gb_serial_rx;
+}
+
+uint8_t gb_colour_hash(struct gb_s *gb)
+{
+#define ROM_TITLE_START_ADDR	0x0134
+#define ROM_TITLE_END_ADDR	0x0143
+
+	uint8_t x = 0;
+	uint16_t i;
+
+	for(i = ROM_TITLE_START_ADDR; i <= ROM_TITLE_END_ADDR; i++)
+		x += gb->gb_rom_read(gb, i);
+
+	return x;
+}
+
+/**
+ * Resets the context, and initialises startup values for a DMG console.
+ */
+void gb_reset(struct gb_s *gb)
+{
+	gb->gb_halt = false;
+	gb->gb_ime = true;
+
+	/* Initialise MBC values. */
+	gb->selected_rom_bank = 1;
+	gb->cart_ram_bank = 0;
+	gb->enable_cart_ram = 0;
+	gb->cart_mode_select = 0;
+
+	/* Use values as though the boot ROM was already executed. */
+	if(gb->gb_bootrom_read == NULL)
+	{
+		uint8_t hdr_chk;
+		hdr_chk = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC) != 0;
+
+		gb->cpu_reg.a = 0x01;
+		gb->cpu_reg.f.reg = PGB_SET_ZERO(1) | PGB_SET_HALFC(hdr_chk) |
+			PGB_SET_CARRY(hdr_chk);
+		gb->cpu_reg.bc.reg = 0x0013;
+		gb->cpu_reg.de.reg = 0x00D8;
+		gb->cpu_reg.hl.reg = 0x014D;
+		gb->cpu_reg.sp.reg = 0xFFFE;
+		gb->cpu_reg.pc.reg = 0x0100;
+
+		gb->hram_io[IO_DIV ] = 0xAB;
+		gb->hram_io[IO_LCDC] = 0x91;
+		gb->hram_io[IO_STAT] = 0x85;
+		gb->hram_io[IO_BOOT] = 0x01;
+
+		__gb_write(gb, 0xFF26, 0xF1);
+
+		memset(gb->vram, 0x00, VRAM_SIZE);
+	}
+	else
+	{
+		/* Set value as though the console was just switched on.
+		 * CPU registers are uninitialised. */
+		gb->cpu_reg.pc.reg = 0x0000;
+		gb->hram_io[IO_DIV ] = 0x00;
+		gb->hram_io[IO_LCDC] = 0x00;
+		gb->hram_io[IO_STAT] = 0x84;
+		gb->hram_io[IO_BOOT] = 0x00;
+	}
+
+#if PEANUT_GB_USE_TILE_CACHE
+	/* VRAM may have been modified without the cache being told. */
+	memset(gb->tile_cache.dirty, 0xFF, sizeof(gb->tile_cache.dirty));
+#endif
+#if PEANUT_GB_USE_SPRITE_LINES
+	gb->sprite_lines.dirty = true;
+#endif
+#if PEANUT_GB_USE_DIRTY_PAGES
+	memset(&gb->dirty, 0xFF, sizeof(gb->dirty));
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+	__gb_fork_set_all(gb);
+#endif
+
+	gb->counter.lcd_count = 0;
+	gb->counter.div_count = 0;
+	gb->counter.tima_count = 0;
+	gb->counter.serial_count = 0;
+	gb->counter.rtc_count = 0;
+	gb->counter.lcd_off_count = 0;
+	gb->counter.sched_cycles = 0;
+	gb->counter.sched_next = 0;
+#if PEANUT_GB_IDLE_LOOP_SKIP
+	gb->counter.idle_cycles = 0;
+#endif
+	gb->display.frames_drawn = 0;
+	gb->display.frames_skipped = 0;
+
+	gb->direct.joypad = 0xFF;
+	gb->hram_io[IO_JOYP] = 0xCF;
+	gb->hram_io[IO_SB  ] = 0x00;
+	gb->hram_io[IO_SC  ] = 0x7E;
+	/* DIV */
+	gb->hram_io[IO_TIMA] = 0x00;
+	gb->hram_io[IO_TMA ] = 0x00;
+	gb->hram_io[IO_TAC ] = 0xF8;
+	gb->hram_io[IO_IF  ] = 0xE1;
+
+	/* LCDC */
+	/* STAT */
+	gb->hram_io[IO_SCY ] = 0x00;
+	gb->hram_io[IO_SCX ] = 0x00;
+	gb->hram_io[IO_LY  ] = 0x00;
+	gb->hram_io[IO_LYC ] = 0x00;
+	__gb_write(gb, 0xFF47, 0xFC); // BGP
+	__gb_write(gb, 0xFF48, 0xFF); // OBJP0
+	__gb_write(gb, 0xFF49, 0xFF); // OBJP1
+	gb->hram_io[IO_WY] = 0x00;
+	gb->hram_io[IO_WX] = 0x00;
+	gb->hram_io[IO_IE] = 0x00;
+	gb->hram_io[IO_IF] = 0xE1;
+
+#if PEANUT_GB_USE_PAGE_TABLE
+	__gb_update_page_table(gb);
+#endif
+}
+
+/**
+ * Internal functions used to access the buffers given to gb_init_direct() and
+ * gb_set_cart_ram(). Only used for accesses that are not mapped by the page
+ * table, so they also handle accesses outside of the buffers.
+ */
+static uint8_t __gb_rom_read_direct(struct gb_s *gb, const uint_fast32_t addr)
+{
+	if(addr >= gb->cart_mem.rom_size)
+		return 0xFF;
+
+	return gb->cart_mem.rom[addr];
+}
+
+static uint8_t __gb_cart_ram_read_direct(struct gb_s *gb,
+		const uint_fast32_t addr)
+{
+	if(addr >= gb->cart_mem.ram_size)
+		return 0xFF;
+
+	return gb->cart_mem.ram[addr];
+}
+
+static void __gb_cart_ram_write_direct(struct gb_s *gb,
+		const uint_fast32_t addr, const uint8_t val)
+{
+	if(addr >= gb->cart_mem.ram_size)
+		return;
+
+	gb->cart_mem.ram[addr] = val;
+}
+
+/* Location and size of the part of the cartridge header that is checked by
+ * the header checksum, including the checksum itself. */
+#define ROM_HEADER_LOC		0x0134
+#define ROM_HEADER_SIZE		(ROM_HEADER_CHECKSUM_LOC - ROM_HEADER_LOC + 1)
+
+/**
+ * Internal function used to check and decode the cartridge header.
+ *
+ * \param hdr	Bytes ROM_HEADER_LOC to ROM_HEADER_CHECKSUM_LOC of the ROM.
+ * \param rom	Set to the decoded header. The ROM buffer is not set.
+ */
+static enum gb_init_error_e __gb_decode_header(const uint8_t *hdr,
+		struct gb_rom_s *rom)
+{
+	const uint16_t mbc_location = 0x0147 - ROM_HEADER_LOC;
+	const uint16_t bank_count_location = 0x0148 - ROM_HEADER_LOC;
+	const uint16_t ram_size_location = 0x0149 - ROM_HEADER_LOC;
+	/**
+	 * Table for cartridge type (MBC). -1 if invalid.
+	 * TODO: MMM01 is untested.
+	 * TODO: MBC6 is untested.
+	 * TODO: MBC7 is unsupported.
+	 * TODO: POCKET CAMERA is unsupported.
+	 * TODO: BANDAI TAMA5 is unsupported.
+	 * TODO: HuC3 is unsupported.
+	 * TODO: HuC1 is unsupported.
+	 **/
+	const int8_t cart_mbc[] =
+	{
+		0, 1, 1, 1, -1, 2, 2, -1, 0, 0, -1, 0, 0, 0, -1, 3,
+		3, 3, 3, 3, -1, -1, -1, -1, -1, 5, 5, 5, 5, 5, 5, -1
+	};
+	/* Whether cart has RAM. */
+	const uint8_t cart_ram[] =
+	{
+		0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 0, 0, 0, 0, 0, 0,
+		1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0
+	};
+	/* How large the ROM is in banks of 16 KiB. */
+	const uint16_t num_rom_banks_mask[] =
+	{
+		2, 4, 8, 16, 32, 64, 128, 256, 512
+	};
+	/* How large the cart RAM is in banks of 8 KiB. Code $01 is unused, but
+	 * some early homebrew ROMs supposedly may use this value. */
+	const uint8_t num_ram_banks[] = { 0, 1, 1, 4, 16, 8 };
+
+	/* Check valid ROM using checksum value. */
+	{
+		uint8_t x = 0;
+		uint16_t i;
 
-	case 0xD5: /* PUSH DE */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.d);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.de.bytes.e);
-		break;
+		for(i = 0; i < ROM_HEADER_SIZE - 1; i++)
+			x = x - hdr[i] - 1;
 
-	case 0xD6: /* SUB imm */
-	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		uint16_t temp = gb->cpu_reg.a - val;
-		gb->cpu_reg.f.f_bits.z = ((temp & 0xFF) == 0x00);
-		gb->cpu_reg.f.f_bits.n = 1;
-		gb->cpu_reg.f.f_bits.h =
-			(gb->cpu_reg.a ^ val ^ temp) & 0x10 ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = (temp & 0xFF00) ? 1 : 0;
-		gb->cpu_reg.a = (temp & 0xFF);
-		break;
+		if(x != hdr[ROM_HEADER_SIZE - 1])
+			return GB_INIT_INVALID_CHECKSUM;
 	}
 
-	case 0xD7: /* RST 0x0010 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0010;
-		break;
+	/* Check if cartridge type is supported, and set MBC type. */
+	{
+		const uint8_t mbc_value = hdr[mbc_location];
 
-	case 0xD8: /* RET C */
-		if(gb->cpu_reg.f.f_bits.c)
-		{
-			gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-			gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
-			inst_cycles += 12;
-		}
+		if(mbc_value > sizeof(cart_mbc) - 1 ||
+				(rom->mbc = cart_mbc[mbc_value]) == -1)
+			return GB_INIT_CARTRIDGE_UNSUPPORTED;
+	}
 
-		break;
+	rom->num_rom_banks_mask = num_rom_banks_mask[hdr[bank_count_location]] - 1;
+	rom->cart_ram = cart_ram[hdr[mbc_location]];
+	rom->num_ram_banks = num_ram_banks[hdr[ram_size_location]];
 
-	case 0xD9: /* RETI */
+	/* If the ROM says that it support RAM, but has 0 RAM banks, then
+	 * disable RAM reads from the cartridge. */
+	if(rom->cart_ram == 0 || rom->num_ram_banks == 0)
 	{
-		gb->cpu_reg.pc.bytes.c = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.pc.bytes.p = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->gb_ime = true;
+		rom->cart_ram = 0;
+		rom->num_ram_banks = 0;
 	}
-	break;
 
-	case 0xDA: /* JP C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
-		{
-			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
-			inst_cycles += 4;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
+	/* If MBC3 and number of ROM or RAM banks are larger than 128 or 8,
+	 * respectively, then select MBC3O mode. */
+	rom->cart_is_mbc3O = rom->mbc == 3 &&
+		(rom->num_rom_banks_mask > 128 || rom->num_ram_banks > 4);
 
-		break;
+	/* Note that MBC2 will appear to have no RAM banks, but it actually
+	 * always has 512 half-bytes of RAM. Hence, num_ram_banks must be
+	 * ignored for MBC2. */
 
-	case 0xDC: /* CALL C, imm */
-		if(gb->cpu_reg.f.f_bits.c)
-		{
-			uint8_t p, c;
-			c = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			p = __gb_read(gb, gb->cpu_reg.pc.reg++);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-			__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-			gb->cpu_reg.pc.bytes.c = c;
-			gb->cpu_reg.pc.bytes.p = p;
-			inst_cycles += 12;
-		}
-		else
-			gb->cpu_reg.pc.reg += 2;
+	return GB_INIT_NO_ERROR;
+}
 
-		break;
+/**
+ * Internal function used to initialise a context.
+ *
+ * \param rom	Decoded cartridge header, or NULL to read and decode the
+ *		header with gb_rom_read.
+ */
+static enum gb_init_error_e __gb_init(struct gb_s *gb,
+			     uint8_t (*gb_rom_read)(struct gb_s*, const uint_fast32_t),
+			     uint8_t (*gb_cart_ram_read)(struct gb_s*, const uint_fast32_t),
+			     void (*gb_cart_ram_write)(struct gb_s*, const uint_fast32_t, const uint8_t),
+			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+			     void *priv, const struct gb_rom_s *rom)
+{
+	struct gb_rom_s decoded;
+
+	gb->gb_rom_read = gb_rom_read;
+	gb->gb_cart_ram_read = gb_cart_ram_read;
+	gb->gb_cart_ram_write = gb_cart_ram_write;
+	gb->gb_error = gb_error;
+	gb->direct.priv = priv;
+
+	/* Initialise serial transfer function to NULL. If the front-end does
+	 * not provide serial support, Peanut-GB will emulate no cable connected
+	 * automatically. */
+	gb->gb_serial_tx = NULL;
+	gb->gb_serial_rx = NULL;
+
+	gb->gb_bootrom_read = NULL;
 
-	case 0xDE: /* SBC A, imm */
+	if(rom == NULL)
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_SBC_R8(val, gb->cpu_reg.f.f_bits.c);
-		break;
+		uint8_t hdr[ROM_HEADER_SIZE];
+		enum gb_init_error_e ret;
+		uint_fast8_t i;
+
+		for(i = 0; i < ROM_HEADER_SIZE; i++)
+			hdr[i] = gb->gb_rom_read(gb, ROM_HEADER_LOC + i);
+
+		ret = __gb_decode_header(hdr, &decoded);
+		if(ret != GB_INIT_NO_ERROR)
+			return ret;
+
+		rom = &decoded;
 	}
 
-	case 0xDF: /* RST 0x0018 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0018;
-		break;
+	gb->mbc = rom->mbc;
+	gb->cart_ram = rom->cart_ram;
+	gb->num_rom_banks_mask = rom->num_rom_banks_mask;
+	gb->num_ram_banks = rom->num_ram_banks;
+	gb->cart_is_mbc3O = rom->cart_is_mbc3O;
 
-	case 0xE0: /* LD (0xFF00+imm), A */
-		__gb_write(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++),
-			   gb->cpu_reg.a);
-		break;
+	gb->lcd_blank = false;
+	gb->display.lcd_draw_line = NULL;
+	gb->display.fb = NULL;
+	gb->display.skip_render = false;
+	gb->direct.frame_skip = false;
+	gb->display.skip_frame = false;
+	gb->display.frame_skip_count = 0;
+	gb->display.frame_skip_ratio = 0;
+	gb->display.frame_skip_max = 0;
+	gb->display.frame_debt = 0;
+#if PEANUT_GB_USE_LINE_HASH
+	__gb_reset_line_hash(gb);
+#endif
 
-	case 0xE1: /* POP HL */
-		gb->cpu_reg.hl.bytes.l = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.hl.bytes.h = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
+#if PEANUT_GB_USE_PAGE_TABLE
+	/* gb_reset() writes to I/O registers before the page table is built,
+	 * so make sure that those writes take the slow path. */
+	memset(&gb->page_table, 0, sizeof(gb->page_table));
+#endif
+#if PEANUT_GB_USE_ROM_CACHE
+	memset(gb->rom_cache.tag, 0, sizeof(gb->rom_cache.tag));
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+	gb->fork.parent = NULL;
+	gb->fork.serial = ++__gb_fork_serial;
+#endif
 
-	case 0xE2: /* LD (C), A */
-		__gb_write(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c, gb->cpu_reg.a);
-		break;
+	gb_reset(gb);
 
-	case 0xE5: /* PUSH HL */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.h);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.hl.bytes.l);
-		break;
+	return GB_INIT_NO_ERROR;
+}
 
-	case 0xE6: /* AND imm */
-	{
-		uint8_t temp = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_AND_R8(temp);
-		break;
-	}
+enum gb_init_error_e gb_init(struct gb_s *gb,
+			     uint8_t (*gb_rom_read)(struct gb_s*, const uint_fast32_t),
+			     uint8_t (*gb_cart_ram_read)(struct gb_s*, const uint_fast32_t),
+			     void (*gb_cart_ram_write)(struct gb_s*, const uint_fast32_t, const uint8_t),
+			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+			     void *priv)
+{
+	gb->cart_mem.rom = NULL;
+	gb->cart_mem.rom_size = 0;
+	gb->cart_mem.ram = NULL;
+	gb->cart_mem.ram_size = 0;
+	gb->cart_mem.shared = NULL;
+
+	return __gb_init(gb, gb_rom_read, gb_cart_ram_read, gb_cart_ram_write,
+			 gb_error, priv, NULL);
+}
 
-	case 0xE7: /* RST 0x0020 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0020;
-		break;
+enum gb_init_error_e gb_init_direct(struct gb_s *gb,
+		const uint8_t *rom, size_t rom_size,
+		uint8_t *cart_ram, size_t cart_ram_size,
+		void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+		void *priv)
+{
+	gb->cart_mem.rom = rom;
+	gb->cart_mem.rom_size = rom_size;
+	gb->cart_mem.ram = cart_ram;
+	gb->cart_mem.ram_size = cart_ram == NULL ? 0 : cart_ram_size;
+	gb->cart_mem.shared = NULL;
+
+	return __gb_init(gb, &__gb_rom_read_direct, &__gb_cart_ram_read_direct,
+			 &__gb_cart_ram_write_direct, gb_error, priv, NULL);
+}
 
-	case 0xE8: /* ADD SP, imm */
-	{
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF);
-		gb->cpu_reg.sp.reg += offset;
-		break;
-	}
+enum gb_init_error_e gb_rom_init(struct gb_rom_s *rom, const uint8_t *data,
+		size_t size)
+{
+	rom->data = data;
+	rom->size = size;
+	rom->refs = 0;
 
-	case 0xE9: /* JP (HL) */
-		gb->cpu_reg.pc.reg = gb->cpu_reg.hl.reg;
-		break;
+	/* A ROM too small to hold a header is treated as a bad header. */
+	if(size <= ROM_HEADER_CHECKSUM_LOC)
+		return GB_INIT_INVALID_CHECKSUM;
 
-	case 0xEA: /* LD (imm), A */
-	{
-		uint8_t h, l;
-		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		addr = PEANUT_GB_U8_TO_U16(h, l);
-		__gb_write(gb, addr, gb->cpu_reg.a);
-		break;
-	}
+	return __gb_decode_header(&data[ROM_HEADER_LOC], rom);
+}
 
-	case 0xEE: /* XOR imm */
-		PGB_INSTR_XOR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+enum gb_init_error_e gb_init_rom(struct gb_s *gb, struct gb_rom_s *rom,
+		uint8_t *cart_ram, size_t cart_ram_size,
+		void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+		void *priv)
+{
+	enum gb_init_error_e ret;
 
-	case 0xEF: /* RST 0x0028 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0028;
-		break;
+	gb->cart_mem.rom = rom->data;
+	gb->cart_mem.rom_size = rom->size;
+	gb->cart_mem.ram = cart_ram;
+	gb->cart_mem.ram_size = cart_ram == NULL ? 0 : cart_ram_size;
+	gb->cart_mem.shared = NULL;
 
-	case 0xF0: /* LD A, (0xFF00+imm) */
-		gb->cpu_reg.a =
-			__gb_read(gb, 0xFF00 | __gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+	ret = __gb_init(gb, &__gb_rom_read_direct, &__gb_cart_ram_read_direct,
+			 &__gb_cart_ram_write_direct, gb_error, priv, rom);
 
-	case 0xF1: /* POP AF */
+	if(ret == GB_INIT_NO_ERROR)
 	{
-		uint8_t temp_8 = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		gb->cpu_reg.f.f_bits.z = (temp_8 >> 7) & 1;
-		gb->cpu_reg.f.f_bits.n = (temp_8 >> 6) & 1;
-		gb->cpu_reg.f.f_bits.h = (temp_8 >> 5) & 1;
-		gb->cpu_reg.f.f_bits.c = (temp_8 >> 4) & 1;
-		gb->cpu_reg.a = __gb_read(gb, gb->cpu_reg.sp.reg++);
-		break;
+		gb->cart_mem.shared = rom;
+		rom->refs++;
 	}
 
-	case 0xF2: /* LD A, (C) */
-		gb->cpu_reg.a = __gb_read(gb, 0xFF00 | gb->cpu_reg.bc.bytes.c);
-		break;
+	return ret;
+}
 
-	case 0xF3: /* DI */
-		gb->gb_ime = false;
-		break;
+unsigned int gb_release_rom(struct gb_s *gb)
+{
+	struct gb_rom_s *rom = gb->cart_mem.shared;
 
-	case 0xF5: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.a);
-		__gb_write(gb, --gb->cpu_reg.sp.reg,
-			   gb->cpu_reg.f.f_bits.z << 7 | gb->cpu_reg.f.f_bits.n << 6 |
-			   gb->cpu_reg.f.f_bits.h << 5 | gb->cpu_reg.f.f_bits.c << 4);
-		break;
+	if(rom == NULL)
+		return 0;
 
-	case 0xF6: /* OR imm */
-		PGB_INSTR_OR_R8(__gb_read(gb, gb->cpu_reg.pc.reg++));
-		break;
+	gb->cart_mem.shared = NULL;
+	return --rom->refs;
+}
 
-	case 0xF7: /* PUSH AF */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0030;
-		break;
+#if PEANUT_GB_EXTERNAL_MEMORY
+void gb_init_memory(struct gb_s *gb, uint8_t *wram, uint8_t *vram,
+		uint8_t *oam, uint8_t *hram_io)
+{
+	gb->wram = wram;
+	gb->vram = vram;
+	gb->oam = oam;
+	gb->hram_io = hram_io;
+}
+#endif
+
+void gb_set_cart_ram(struct gb_s *gb, uint8_t *cart_ram, size_t cart_ram_size)
+{
+	gb->cart_mem.ram = cart_ram;
+	gb->cart_mem.ram_size = cart_ram == NULL ? 0 : cart_ram_size;
+	gb->gb_cart_ram_read = &__gb_cart_ram_read_direct;
+	gb->gb_cart_ram_write = &__gb_cart_ram_write_direct;
+
+#if PEANUT_GB_USE_FORK_TRACKING
+	memset(gb->fork.cart_ram, FORK_WRITTEN, sizeof(gb->fork.cart_ram));
+#endif
+#if PEANUT_GB_USE_PAGE_TABLE
+	__gb_update_page_table(gb);
+#endif
+}
+
+/* Saved states start with this magic number, followed by the version of the
+ * format. The version must be incremented whenever the format changes. */
+#define STATE_MAGIC		"PGBS"
+#define STATE_VERSION		1
+/* Size of a saved state, excluding Cart RAM. */
+#define STATE_HEADER_SIZE	13
+#define STATE_SIZE		(STATE_HEADER_SIZE + 55 + WRAM_SIZE + \
+					VRAM_SIZE + OAM_SIZE + HRAM_IO_SIZE)
+/* Set in the flags of a saved state that includes Cart RAM. */
+#define STATE_FLAG_CART_RAM	0x01
 
-	case 0xF8: /* LD HL, SP+/-imm */
+/**
+ * Internal function used to write a little endian value of 1 to 4 bytes to a
+ * saved state.
+ */
+static uint8_t *__gb_state_put(uint8_t *p, uint_fast32_t val,
+		uint_fast8_t bytes)
+{
+	while(bytes--)
 	{
-		/* Taken from SameBoy, which is released under MIT Licence. */
-		int8_t offset = (int8_t) __gb_read(gb, gb->cpu_reg.pc.reg++);
-		gb->cpu_reg.hl.reg = gb->cpu_reg.sp.reg + offset;
-		gb->cpu_reg.f.reg = 0;
-		gb->cpu_reg.f.f_bits.h = ((gb->cpu_reg.sp.reg & 0xF) + (offset & 0xF) > 0xF) ? 1 : 0;
-		gb->cpu_reg.f.f_bits.c = ((gb->cpu_reg.sp.reg & 0xFF) + (offset & 0xFF) > 0xFF) ? 1 : 0;
-		break;
+		*p++ = val & 0xFF;
+		val >>= 8;
 	}
 
-	case 0xF9: /* LD SP, HL */
-		gb->cpu_reg.sp.reg = gb->cpu_reg.hl.reg;
-		break;
+	return p;
+}
+
+/**
+ * Internal function used to read a little endian value of 1 to 4 bytes from a
+ * saved state.
+ */
+static uint_fast32_t __gb_state_get(const uint8_t **p, uint_fast8_t bytes)
+{
+	uint_fast32_t val = 0;
+	uint_fast8_t i;
+
+	for(i = 0; i < bytes; i++)
+		val |= (uint_fast32_t)(*p)[i] << (i * 8);
+
+	*p += bytes;
+	return val;
+}
+
+size_t gb_state_size(const struct gb_s *gb)
+{
+	return STATE_SIZE + gb->cart_mem.ram_size;
+}
+
+void gb_state_save(struct gb_s *gb, void *buf)
+{
+	uint8_t *p = buf;
+	uint_fast8_t i;
+
+	/* Header. The ROM header and global checksums identify the game. */
+	memcpy(p, STATE_MAGIC, 4);
+	p += 4;
+	*p++ = STATE_VERSION;
+	*p++ = gb->cart_mem.ram_size != 0 ? STATE_FLAG_CART_RAM : 0;
+	for(i = 0; i < 3; i++)
+		*p++ = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC + i);
+	p = __gb_state_put(p, gb->cart_mem.ram_size, 4);
+
+	/* CPU. */
+	p = __gb_state_put(p, gb->cpu_reg.a, 1);
+	p = __gb_state_put(p, gb->cpu_reg.f.reg, 1);
+	p = __gb_state_put(p, gb->cpu_reg.bc.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.de.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.hl.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.sp.reg, 2);
+	p = __gb_state_put(p, gb->cpu_reg.pc.reg, 2);
+	p = __gb_state_put(p, gb->gb_halt | gb->gb_ime << 1 |
+			gb->gb_frame << 2 | gb->lcd_blank << 3, 1);
+
+	/* MBC and RTC. */
+	p = __gb_state_put(p, gb->selected_rom_bank, 2);
+	p = __gb_state_put(p, gb->cart_ram_bank, 1);
+	p = __gb_state_put(p, gb->enable_cart_ram, 1);
+	p = __gb_state_put(p, gb->cart_mode_select, 1);
+	memcpy(p, gb->rtc_latched.bytes, sizeof(gb->rtc_latched.bytes));
+	p += sizeof(gb->rtc_latched.bytes);
+	memcpy(p, gb->rtc_real.bytes, sizeof(gb->rtc_real.bytes));
+	p += sizeof(gb->rtc_real.bytes);
+
+	/* Counters. */
+	p = __gb_state_put(p, gb->counter.lcd_count, 2);
+	p = __gb_state_put(p, gb->counter.div_count, 2);
+	p = __gb_state_put(p, gb->counter.tima_count, 2);
+	p = __gb_state_put(p, gb->counter.serial_count, 2);
+	p = __gb_state_put(p, gb->counter.rtc_count, 4);
+	p = __gb_state_put(p, gb->counter.lcd_off_count, 4);
+	p = __gb_state_put(p, gb->counter.sched_cycles, 4);
+	p = __gb_state_put(p, gb->counter.sched_next, 4);
+
+	/* Display. */
+	p = __gb_state_put(p, gb->display.window_clear, 1);
+	p = __gb_state_put(p, gb->display.WY, 1);
+	p = __gb_state_put(p, gb->display.skip_frame |
+			gb->display.interlace_count << 1, 1);
+
+	/* Memory. */
+	memcpy(p, gb->wram, WRAM_SIZE);
+	p += WRAM_SIZE;
+	memcpy(p, gb->vram, VRAM_SIZE);
+	p += VRAM_SIZE;
+	memcpy(p, gb->oam, OAM_SIZE);
+	p += OAM_SIZE;
+	memcpy(p, gb->hram_io, HRAM_IO_SIZE);
+	p += HRAM_IO_SIZE;
+
+	/* Cart RAM is only included if Peanut-GB holds the buffer. */
+	if(gb->cart_mem.ram_size != 0)
+		memcpy(p, gb->cart_mem.ram, gb->cart_mem.ram_size);
+}
+
+enum gb_state_error_e gb_state_load(struct gb_s *gb, const void *buf,
+		size_t size)
+{
+	const uint8_t *p = buf;
+	uint_fast8_t flags, i;
+	uint_fast32_t cart_ram_size;
+
+	if(size < STATE_SIZE || memcmp(p, STATE_MAGIC, 4) != 0)
+		return GB_STATE_INVALID;
 
-	case 0xFA: /* LD A, (imm) */
+	p += 4;
+	if(__gb_state_get(&p, 1) != STATE_VERSION)
+		return GB_STATE_UNSUPPORTED_VERSION;
+
+	flags = __gb_state_get(&p, 1);
+	for(i = 0; i < 3; i++)
 	{
-		uint8_t h, l;
-		uint16_t addr;
-		l = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		h = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		addr = PEANUT_GB_U8_TO_U16(h, l);
-		gb->cpu_reg.a = __gb_read(gb, addr);
-		break;
+		if(*p++ != gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC + i))
+			return GB_STATE_ROM_MISMATCH;
 	}
 
-	case 0xFB: /* EI */
-		gb->gb_ime = true;
-		break;
-
-	case 0xFE: /* CP imm */
+	cart_ram_size = __gb_state_get(&p, 4);
+	if((flags & STATE_FLAG_CART_RAM) && size < STATE_SIZE + cart_ram_size)
+		return GB_STATE_INVALID;
+
+	/* CPU. */
+	gb->cpu_reg.a = __gb_state_get(&p, 1);
+	gb->cpu_reg.f.reg = __gb_state_get(&p, 1) & 0xF0;
+	gb->cpu_reg.bc.reg = __gb_state_get(&p, 2);
+	gb->cpu_reg.de.reg = __gb_state_get(&p, 2);
+	gb->cpu_reg.hl.reg = __gb_state_get(&p, 2);
+	gb->cpu_reg.sp.reg = __gb_state_get(&p, 2);
+	gb->cpu_reg.pc.reg = __gb_state_get(&p, 2);
+	i = __gb_state_get(&p, 1);
+	gb->gb_halt = i & 1;
+	gb->gb_ime = (i >> 1) & 1;
+	gb->gb_frame = (i >> 2) & 1;
+	gb->lcd_blank = (i >> 3) & 1;
+
+	/* MBC and RTC. */
+	gb->selected_rom_bank = __gb_state_get(&p, 2);
+	gb->cart_ram_bank = __gb_state_get(&p, 1);
+	gb->enable_cart_ram = __gb_state_get(&p, 1);
+	gb->cart_mode_select = __gb_state_get(&p, 1);
+	memcpy(gb->rtc_latched.bytes, p, sizeof(gb->rtc_latched.bytes));
+	p += sizeof(gb->rtc_latched.bytes);
+	memcpy(gb->rtc_real.bytes, p, sizeof(gb->rtc_real.bytes));
+	p += sizeof(gb->rtc_real.bytes);
+
+	/* Counters. */
+	gb->counter.lcd_count = __gb_state_get(&p, 2);
+	gb->counter.div_count = __gb_state_get(&p, 2);
+	gb->counter.tima_count = __gb_state_get(&p, 2);
+	gb->counter.serial_count = __gb_state_get(&p, 2);
+	gb->counter.rtc_count = __gb_state_get(&p, 4);
+	gb->counter.lcd_off_count = __gb_state_get(&p, 4);
+	gb->counter.sched_cycles = __gb_state_get(&p, 4);
+	gb->counter.sched_next = __gb_state_get(&p, 4);
+
+	/* Display. */
+	gb->display.window_clear = __gb_state_get(&p, 1);
+	gb->display.WY = __gb_state_get(&p, 1);
+	i = __gb_state_get(&p, 1);
+	gb->display.skip_frame = i & 1;
+	gb->display.interlace_count = (i >> 1) & 1;
+
+	/* Memory. */
+	memcpy(gb->wram, p, WRAM_SIZE);
+	p += WRAM_SIZE;
+	memcpy(gb->vram, p, VRAM_SIZE);
+	p += VRAM_SIZE;
+	memcpy(gb->oam, p, OAM_SIZE);
+	p += OAM_SIZE;
+	memcpy(gb->hram_io, p, HRAM_IO_SIZE);
+	p += HRAM_IO_SIZE;
+
+	/* Cart RAM is only restored into a buffer of the same size. */
+	if((flags & STATE_FLAG_CART_RAM) &&
+			cart_ram_size == gb->cart_mem.ram_size)
+		memcpy(gb->cart_mem.ram, p, cart_ram_size);
+
+	/* Restore the state that is derived from the registers. */
+	for(i = 0; i < 4; i++)
 	{
-		uint8_t val = __gb_read(gb, gb->cpu_reg.pc.reg++);
-		PGB_INSTR_CP_R8(val);
-		break;
+		gb->display.bg_palette[i] =
+			(gb->hram_io[IO_BGP] >> (i * 2)) & 0x03;
+		gb->display.sp_palette[i] =
+			(gb->hram_io[IO_OBP0] >> (i * 2)) & 0x03;
+		gb->display.sp_palette[i + 4] =
+			(gb->hram_io[IO_OBP1] >> (i * 2)) & 0x03;
 	}
 
-	case 0xFF: /* RST 0x0038 */
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.p);
-		__gb_write(gb, --gb->cpu_reg.sp.reg, gb->cpu_reg.pc.bytes.c);
-		gb->cpu_reg.pc.reg = 0x0038;
-		break;
+#if PEANUT_GB_USE_PAGE_TABLE
+	__gb_update_page_table(gb);
+#endif
+#if PEANUT_GB_USE_TILE_CACHE
+	memset(gb->tile_cache.dirty, 0xFF, sizeof(gb->tile_cache.dirty));
+#endif
+#if PEANUT_GB_USE_SPRITE_LINES
+	gb->sprite_lines.dirty = true;
+#endif
+#if PEANUT_GB_USE_DIRTY_PAGES
+	memset(&gb->dirty, 0xFF, sizeof(gb->dirty));
+#endif
+#if PEANUT_GB_USE_FORK_TRACKING
+	__gb_fork_set_all(gb);
+#endif
 
-	default:
-		/* Return address where invalid opcode that was read. */
-		(gb->gb_error)(gb, GB_INVALID_OPCODE, gb->cpu_reg.pc.reg - 1);
-		PGB_UNREACHABLE();
-	}
+	return GB_STATE_NO_ERROR;
+}
+
+#if PEANUT_GB_USE_FORK_TRACKING
+/**
+ * Internal function used to copy the pages of a memory that were written to
+ * by the destination of gb_fork() since it was last forked into, or all pages
+ * if full is set. The pages that are copied are marked as changed in the
+ * destination, and each tile within them is marked in the tile cache bitmap
+ * tiles if it is not NULL.
+ */
+static void __gb_fork_copy(uint8_t *dst, const uint8_t *src, uint8_t *flags,
+		size_t pages, bool full, uint8_t *tiles)
+{
+	size_t p;
 
-	do
+	for(p = 0; p < pages; p++)
 	{
-		/* DIV register timing */
-		gb->counter.div_count += inst_cycles;
-		while(gb->counter.div_count >= DIV_CYCLES)
-		{
-			gb->hram_io[IO_DIV]++;
-			gb->counter.div_count -= DIV_CYCLES;
-		}
+		if(!full && (flags[p] & FORK_WRITTEN_DST) == 0)
+			continue;
 
-		/* Check for RTC tick. */
-		if(gb->mbc == 3 && (gb->rtc_real.reg.high & 0x40) == 0)
-		{
-			gb->counter.rtc_count += inst_cycles;
-			while(PGB_UNLIKELY(gb->counter.rtc_count >= RTC_CYCLES))
-			{
-				gb->counter.rtc_count -= RTC_CYCLES;
+		memcpy(&dst[p * DIRTY_PAGE_SIZE], &src[p * DIRTY_PAGE_SIZE],
+				DIRTY_PAGE_SIZE);
+		flags[p] = FORK_WRITTEN_SRC;
 
-				/* Detect invalid rollover. */
-				if(PGB_UNLIKELY(gb->rtc_real.reg.sec == 63))
-				{
-					gb->rtc_real.reg.sec = 0;
-					continue;
-				}
+#if PEANUT_GB_USE_TILE_CACHE
+		if(tiles != NULL && p * DIRTY_PAGE_SIZE < VRAM_TILES_SIZE)
+			memset(&tiles[p * DIRTY_PAGE_SIZE / VRAM_TILE_SIZE / 8],
+					0xFF, DIRTY_PAGE_SIZE / VRAM_TILE_SIZE / 8);
+#else
+		(void)tiles;
+#endif
+	}
+}
 
-				if(++gb->rtc_real.reg.sec != 60)
-					continue;
+/**
+ * Internal function used to clear the given flag of each page. Returns true if
+ * the flag was set for any page.
+ */
+static bool __gb_fork_clear(uint8_t *flags, size_t pages, uint8_t flag)
+{
+	bool was_set = false;
+	size_t p;
 
-				gb->rtc_real.reg.sec = 0;
-				if(gb->rtc_real.reg.min == 63)
-				{
-					gb->rtc_real.reg.min = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.min != 60)
-					continue;
+	for(p = 0; p < pages; p++)
+	{
+		was_set |= (flags[p] & flag) != 0;
+		flags[p] &= ~flag;
+	}
 
-				gb->rtc_real.reg.min = 0;
-				if(gb->rtc_real.reg.hour == 31)
-				{
-					gb->rtc_real.reg.hour = 0;
-					continue;
-				}
-				if(++gb->rtc_real.reg.hour != 24)
-					continue;
+	return was_set;
+}
+#endif
 
-				gb->rtc_real.reg.hour = 0;
-				if(++gb->rtc_real.reg.yday != 0)
-					continue;
+enum gb_state_error_e gb_fork(struct gb_s *src, struct gb_s *dst)
+{
+	bool same_cart_ram;
+	uint_fast8_t i;
 
-				if(gb->rtc_real.reg.high & 1)  /* Bit 8 of days*/
-					gb->rtc_real.reg.high |= 0x80; /* Overflow bit */
+	if(src == dst)
+		return GB_STATE_NO_ERROR;
 
-				gb->rtc_real.reg.high ^= 1;
-			}
-		}
+	for(i = 0; i < 3; i++)
+	{
+		if(src->gb_rom_read(src, ROM_HEADER_CHECKSUM_LOC + i) !=
+				dst->gb_rom_read(dst, ROM_HEADER_CHECKSUM_LOC + i))
+			return GB_STATE_ROM_MISMATCH;
+	}
 
-		/* Check serial transmission. */
-		if(gb->hram_io[IO_SC] & SERIAL_SC_TX_START)
-		{
-			/* If new transfer, call TX function. */
-			if(gb->counter.serial_count == 0 &&
-				gb->gb_serial_tx != NULL)
-				(gb->gb_serial_tx)(gb, gb->hram_io[IO_SB]);
+	/* The same state as is saved by gb_state_save(). */
+	dst->cpu_reg = src->cpu_reg;
+	dst->gb_halt = src->gb_halt;
+	dst->gb_ime = src->gb_ime;
+	dst->gb_frame = src->gb_frame;
+	dst->lcd_blank = src->lcd_blank;
+
+	dst->selected_rom_bank = src->selected_rom_bank;
+	dst->cart_ram_bank = src->cart_ram_bank;
+	dst->enable_cart_ram = src->enable_cart_ram;
+	dst->cart_mode_select = src->cart_mode_select;
+	dst->rtc_latched = src->rtc_latched;
+	dst->rtc_real = src->rtc_real;
+
+	dst->counter = src->counter;
+
+	memcpy(dst->display.bg_palette, src->display.bg_palette,
+			sizeof(dst->display.bg_palette));
+	memcpy(dst->display.sp_palette, src->display.sp_palette,
+			sizeof(dst->display.sp_palette));
+	dst->display.window_clear = src->display.window_clear;
+	dst->display.WY = src->display.WY;
+	dst->display.skip_frame = src->display.skip_frame;
+	dst->display.frame_skip_count = src->display.frame_skip_count;
+	dst->display.interlace_count = src->display.interlace_count;
+
+	memcpy(dst->oam, src->oam, OAM_SIZE);
+	memcpy(dst->hram_io, src->hram_io, HRAM_IO_SIZE);
+
+	/* Cart RAM is only copied into a buffer of the same size. */
+	same_cart_ram = src->cart_mem.ram_size != 0 &&
+		src->cart_mem.ram_size == dst->cart_mem.ram_size;
+
+#if PEANUT_GB_USE_FORK_TRACKING
+	{
+		const size_t cram_pages = same_cart_ram &&
+			src->cart_mem.ram_size <= DIRTY_CRAM_SIZE ?
+			src->cart_mem.ram_size / DIRTY_PAGE_SIZE : 0;
+		bool full;
+		uint8_t *tiles = NULL;
+
+		/* The source is given a new serial if it was changed since
+		 * it was last forked from, so that contexts forked from it
+		 * before then are copied in full. */
+		if(__gb_fork_clear(src->fork.wram, WRAM_SIZE / DIRTY_PAGE_SIZE,
+					FORK_WRITTEN_SRC) |
+				__gb_fork_clear(src->fork.vram,
+					VRAM_SIZE / DIRTY_PAGE_SIZE,
+					FORK_WRITTEN_SRC) |
+				__gb_fork_clear(src->fork.cart_ram,
+					cram_pages, FORK_WRITTEN_SRC))
+			src->fork.serial = ++__gb_fork_serial;
+
+		full = dst->fork.parent != src ||
+			dst->fork.parent_serial != src->fork.serial;
+
+#if PEANUT_GB_USE_TILE_CACHE
+		tiles = dst->tile_cache.dirty;
+#endif
+		__gb_fork_copy(dst->wram, src->wram, dst->fork.wram,
+				WRAM_SIZE / DIRTY_PAGE_SIZE, full, NULL);
+		__gb_fork_copy(dst->vram, src->vram, dst->fork.vram,
+				VRAM_SIZE / DIRTY_PAGE_SIZE, full, tiles);
+
+		if(cram_pages == 0 && same_cart_ram)
+			memcpy(dst->cart_mem.ram, src->cart_mem.ram,
+					src->cart_mem.ram_size);
+		else
+			__gb_fork_copy(dst->cart_mem.ram, src->cart_mem.ram,
+					dst->fork.cart_ram, cram_pages, full,
+					NULL);
 
-			gb->counter.serial_count += inst_cycles;
+		dst->fork.parent = src;
+		dst->fork.parent_serial = src->fork.serial;
+	}
+#else
+	memcpy(dst->wram, src->wram, WRAM_SIZE);
+	memcpy(dst->vram, src->vram, VRAM_SIZE);
 
-			/* If it's time to receive byte, call RX function. */
-			if(gb->counter.serial_count >= SERIAL_CYCLES)
-			{
-				/* If RX can be done, do it. */
-				/* If RX failed, do not change SB if using external
-				 * clock, or set to 0xFF if using internal clock. */
-				uint8_t rx;
+	if(same_cart_ram)
+		memcpy(dst->cart_mem.ram, src->cart_mem.ram,
+				src->cart_mem.ram_size);
 
-				if(gb->gb_serial_rx != NULL &&
-					(gb->gb_serial_rx(gb, &rx) ==
-						GB_SERIAL_RX_SUCCESS))
-				{
-					gb->hram_io[IO_SB] = rx;
+# if PEANUT_GB_USE_TILE_CACHE
+	memset(dst->tile_cache.dirty, 0xFF, sizeof(dst->tile_cache.dirty));
+# endif
+#endif
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else if(gb->hram_io[IO_SC] & SERIAL_SC_CLOCK_SRC)
-				{
-					/* If using internal clock, and console is not
-					 * attached to any external peripheral, shifted
-					 * bits are replaced with logic 1. */
-					gb->hram_io[IO_SB] = 0xFF;
+#if PEANUT_GB_USE_PAGE_TABLE
+	__gb_update_page_table(dst);
+#endif
+#if PEANUT_GB_USE_SPRITE_LINES
+	dst->sprite_lines.dirty = true;
+#endif
+#if PEANUT_GB_USE_DIRTY_PAGES
+	memset(&dst->dirty, 0xFF, sizeof(dst->dirty));
+#endif
 
-					/* Inform game of serial TX/RX completion. */
-					gb->hram_io[IO_SC] &= 0x01;
-					gb->hram_io[IO_IF] |= SERIAL_INTR;
-				}
-				else
-				{
-					/* If using external clock, and console is not
-					 * attached to any external peripheral, bits are
-					 * not shifted, so SB is not modified. */
-				}
+	return GB_STATE_NO_ERROR;
+}
 
-				gb->counter.serial_count = 0;
-			}
-		}
+/* Size of the length stored before and after each delta in the rewind ring. */
+#define REWIND_LEN_SIZE		4
+/* Runs of fewer unchanged bytes than this are kept within a literal. */
+#define REWIND_MIN_SKIP		4
 
-		/* TIMA register timing */
-		/* TODO: Change tac_enable to struct of TAC timer control bits. */
-		if(gb->hram_io[IO_TAC] & IO_TAC_ENABLE_MASK)
-		{
-			gb->counter.tima_count += inst_cycles;
+/**
+ * Internal function used to write a byte to the rewind ring.
+ */
+static void __gb_rewind_put(struct gb_rewind_s *rw, uint8_t val)
+{
+	rw->ring[rw->head] = val;
+	if(++rw->head == rw->ring_size)
+		rw->head = 0;
+}
 
-			while(gb->counter.tima_count >=
-				TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK])
-			{
-				gb->counter.tima_count -=
-					TAC_CYCLES[gb->hram_io[IO_TAC] & IO_TAC_RATE_MASK];
+/**
+ * Internal function used to write a variable length value to the rewind ring.
+ * Returns the number of bytes written. If rw is NULL, only returns the number
+ * of bytes that would be written.
+ */
+static size_t __gb_rewind_put_var(struct gb_rewind_s *rw, size_t val)
+{
+	size_t len = 1;
 
-				if(++gb->hram_io[IO_TIMA] == 0)
-				{
-					gb->hram_io[IO_IF] |= TIMER_INTR;
-					/* On overflow, set TMA to TIMA. */
-					gb->hram_io[IO_TIMA] = gb->hram_io[IO_TMA];
-				}
-			}
-		}
+	while(val >= 0x80)
+	{
+		if(rw != NULL)
+			__gb_rewind_put(rw, (val & 0x7F) | 0x80);
+		val >>= 7;
+		len++;
+	}
 
-		/* If LCD is off, don't update LCD state or increase the LCD
-		 * ticks. Instead, keep track of the amount of time that is
-		 * being passed. */
-		if(!(gb->hram_io[IO_LCDC] & LCDC_ENABLE))
-		{
-			gb->counter.lcd_off_count += inst_cycles;
-			if(gb->counter.lcd_off_count >= LCD_FRAME_CYCLES)
-			{
-				gb->counter.lcd_off_count -= LCD_FRAME_CYCLES;
-				gb->gb_frame = true;
-			}
-			continue;
-		}
+	if(rw != NULL)
+		__gb_rewind_put(rw, val);
 
-		/* LCD Timing */
-		gb->counter.lcd_count += inst_cycles;
+	return len;
+}
 
-		/* New Scanline. HBlank -> VBlank or OAM Scan */
-		if(gb->counter.lcd_count >= LCD_LINE_CYCLES)
-		{
-			gb->counter.lcd_count -= LCD_LINE_CYCLES;
+/**
+ * Internal function used to read a byte from the rewind ring.
+ */
+static uint8_t __gb_rewind_get(const struct gb_rewind_s *rw, size_t *off)
+{
+	uint8_t val = rw->ring[*off];
 
-			/* Next line */
-			gb->hram_io[IO_LY] = gb->hram_io[IO_LY] + 1;
-			if (gb->hram_io[IO_LY] == LCD_VERT_LINES)
-				gb->hram_io[IO_LY] = 0;
+	if(++*off == rw->ring_size)
+		*off = 0;
 
-			/* LYC Update */
-			if(gb->hram_io[IO_LY] == gb->hram_io[IO_LYC])
-			{
-				gb->hram_io[IO_STAT] |= STAT_LYC_COINC;
+	return val;
+}
 
-				if(gb->hram_io[IO_STAT] & STAT_LYC_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
-			}
-			else
-				gb->hram_io[IO_STAT] &= 0xFB;
+/**
+ * Internal function used to read a variable length value from the rewind ring.
+ */
+static size_t __gb_rewind_get_var(const struct gb_rewind_s *rw, size_t *off,
+		size_t *len)
+{
+	size_t val = 0;
+	uint_fast8_t shift = 0;
+	uint8_t b;
 
-			/* Check if LCD should be in Mode 1 (VBLANK) state */
-			if(gb->hram_io[IO_LY] == LCD_HEIGHT)
-			{
-				gb->hram_io[IO_STAT] =
-					(gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_VBLANK;
-				gb->gb_frame = true;
-				gb->hram_io[IO_IF] |= VBLANK_INTR;
-				gb->lcd_blank = false;
+	do
+	{
+		b = __gb_rewind_get(rw, off);
+		val |= (size_t)(b & 0x7F) << shift;
+		shift += 7;
+		(*len)--;
+	} while((b & 0x80) && *len != 0);
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_1_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+	return val;
+}
 
-#if ENABLE_LCD
-				/* If frame skip is activated, check if we need to draw
-				 * the frame or skip it. */
-				if(gb->direct.frame_skip)
-				{
-					gb->display.frame_skip_count =
-						!gb->display.frame_skip_count;
-				}
+/**
+ * Internal function used to read the length of a delta at the given offset of
+ * the rewind ring.
+ */
+static size_t __gb_rewind_get_len(const struct gb_rewind_s *rw, size_t off)
+{
+	size_t len = 0;
+	uint_fast8_t i;
 
-				/* If interlaced is activated, change which lines get
-				 * updated. Also, only update lines on frames that are
-				 * actually drawn when frame skip is enabled. */
-				if(gb->direct.interlace &&
-						(!gb->direct.frame_skip ||
-						 gb->display.frame_skip_count))
-				{
-					gb->display.interlace_count =
-						!gb->display.interlace_count;
-				}
-#endif
-                                /* If halted forever, then return on VBLANK. */
-                                if(gb->gb_halt && !gb->hram_io[IO_IE])
-					break;
-			}
-			/* Start of normal Line (not in VBLANK) */
-			else if(gb->hram_io[IO_LY] < LCD_HEIGHT)
-			{
-				if(gb->hram_io[IO_LY] == 0)
-				{
-					/* Clear Screen */
-					gb->display.WY = gb->hram_io[IO_WY];
-					gb->display.window_clear = 0;
-				}
+	for(i = 0; i < REWIND_LEN_SIZE; i++)
+		len |= (size_t)__gb_rewind_get(rw, &off) << (i * 8);
 
-				/* OAM Search occurs at the start of the line. */
-				gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_OAM_SCAN;
-				gb->counter.lcd_count = 0;
+	return len;
+}
 
-				if(gb->hram_io[IO_STAT] & STAT_MODE_2_INTR)
-					gb->hram_io[IO_IF] |= LCDC_INTR;
+/**
+ * Internal function used to encode the difference between the newest state
+ * and the next state as runs of unchanged bytes followed by runs of changed
+ * bytes, XORed with the newest state. Returns the size of the encoded delta.
+ * The delta is only written to the rewind ring if write is true.
+ */
+static size_t __gb_rewind_encode(struct gb_rewind_s *rw, bool write)
+{
+	const uint8_t *a = rw->state;
+	const uint8_t *b = rw->next;
+	const size_t size = rw->state_size;
+	struct gb_rewind_s *out = write ? rw : NULL;
+	size_t pos = 0, len = 0;
 
-				/* If halted immediately jump to next LCD mode.
-				 * From OAM Search to LCD Draw. */
-				//if(gb->counter.lcd_count < LCD_MODE2_OAM_SCAN_END)
-				//	inst_cycles = LCD_MODE2_OAM_SCAN_END - gb->counter.lcd_count;
-				inst_cycles = LCD_MODE2_OAM_SCAN_DURATION;
-			}
-		}
-		/* Go from Mode 3 (LCD Draw) to Mode 0 (HBLANK). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_LCD_DRAW &&
-				gb->counter.lcd_count >= LCD_MODE3_LCD_DRAW_END)
-		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_HBLANK;
+	while(1)
+	{
+		size_t start, end, same;
 
-			if(gb->hram_io[IO_STAT] & STAT_MODE_0_INTR)
-				gb->hram_io[IO_IF] |= LCDC_INTR;
+		/* Skip unchanged bytes, eight at a time where possible. */
+		start = pos;
+		while(pos + 8 <= size && memcmp(&a[pos], &b[pos], 8) == 0)
+			pos += 8;
+		while(pos < size && a[pos] == b[pos])
+			pos++;
 
-			/* If halted immediately, jump from OAM Scan to LCD Draw. */
-			if (gb->counter.lcd_count < LCD_MODE0_HBLANK_MAX_DRUATION)
-				inst_cycles = LCD_MODE0_HBLANK_MAX_DRUATION - gb->counter.lcd_count;
+		if(pos == size)
+			break;
+
+		/* A literal ends at the first run of unchanged bytes that is
+		 * long enough to be worth skipping. */
+		end = pos;
+		same = 0;
+		while(end < size && same < REWIND_MIN_SKIP)
+		{
+			same = a[end] == b[end] ? same + 1 : 0;
+			end++;
 		}
-		/* Go from Mode 2 (OAM Scan) to Mode 3 (LCD Draw). */
-		else if((gb->hram_io[IO_STAT] & STAT_MODE) == IO_STAT_MODE_OAM_SCAN &&
-				gb->counter.lcd_count >= LCD_MODE2_OAM_SCAN_END)
+		end -= same;
+
+		len += __gb_rewind_put_var(out, pos - start);
+		len += __gb_rewind_put_var(out, end - pos);
+		len += end - pos;
+
+		if(write)
 		{
-			gb->hram_io[IO_STAT] = (gb->hram_io[IO_STAT] & ~STAT_MODE) | IO_STAT_MODE_LCD_DRAW;
-#if ENABLE_LCD
-			if(!gb->lcd_blank)
-				__gb_draw_line(gb);
-#endif
-			/* If halted immediately jump to next LCD mode. */
-			if (gb->counter.lcd_count < LCD_MODE3_LCD_DRAW_MIN_DURATION)
-				inst_cycles = LCD_MODE3_LCD_DRAW_MIN_DURATION - gb->counter.lcd_count;
+			for(; pos < end; pos++)
+				__gb_rewind_put(rw, a[pos] ^ b[pos]);
 		}
-	} while(gb->gb_halt && (gb->hram_io[IO_IF] & gb->hram_io[IO_IE]) == 0);
-	/* If halted, loop until an interrupt occurs. */
+
+		pos = end;
+	}
+
+	return len;
 }
 
-void gb_run_frame(struct gb_s *gb)
+/**
+ * Internal function used to discard the oldest delta in the rewind ring.
+ */
+static void __gb_rewind_drop_oldest(struct gb_rewind_s *rw)
 {
-	gb->gb_frame = false;
+	size_t tail = (rw->head + rw->ring_size - rw->used) % rw->ring_size;
+	size_t len = __gb_rewind_get_len(rw, tail);
 
-	while(!gb->gb_frame)
-		__gb_step_cpu(gb);
+	rw->used -= len + 2 * REWIND_LEN_SIZE;
+	rw->count--;
 }
 
-int gb_get_save_size_s(struct gb_s *gb, size_t *ram_size)
+int gb_rewind_init(struct gb_rewind_s *rw, struct gb_s *gb, void *arena,
+		size_t arena_size)
 {
-	const uint_fast16_t ram_size_location = 0x0149;
-	const uint_fast32_t ram_sizes[] =
+	const size_t state_size = gb_state_size(gb);
+
+	/* The arena must at least hold two states and a small delta. */
+	if(arena_size < 2 * state_size + 4 * REWIND_LEN_SIZE)
+		return -1;
+
+	rw->state = arena;
+	rw->next = rw->state + state_size;
+	rw->state_size = state_size;
+	rw->has_state = false;
+	rw->ring = rw->next + state_size;
+	rw->ring_size = arena_size - 2 * state_size;
+	rw->head = 0;
+	rw->used = 0;
+	rw->count = 0;
+
+	return 0;
+}
+
+void gb_rewind_push(struct gb_rewind_s *rw, struct gb_s *gb)
+{
+	uint8_t *tmp;
+	size_t len, need;
+	uint_fast8_t i;
+
+	gb_state_save(gb, rw->next);
+
+	if(!rw->has_state)
 	{
-		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
-		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
-	};
-	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+		memcpy(rw->state, rw->next, rw->state_size);
+		rw->has_state = true;
+		return;
+	}
 
-	/* MBC2 always has 512 half-bytes of cart RAM.
-	 * This assumes that only the lower nibble of each byte is used; the
-	 * nibbles are not packed. */
-	if(gb->mbc == 2)
+	len = __gb_rewind_encode(rw, false);
+	need = len + 2 * REWIND_LEN_SIZE;
+
+	if(need > rw->ring_size)
 	{
-		*ram_size = 0x200;
-		return 0;
+		/* The delta will never fit, so the history is lost. */
+		rw->head = 0;
+		rw->used = 0;
+		rw->count = 0;
 	}
+	else
+	{
+		while(rw->used + need > rw->ring_size)
+			__gb_rewind_drop_oldest(rw);
 
-	/* Return -1 on invalid or unsupported RAM size. */
-	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
-		return -1;
+		for(i = 0; i < REWIND_LEN_SIZE; i++)
+			__gb_rewind_put(rw, len >> (i * 8));
+		__gb_rewind_encode(rw, true);
+		for(i = 0; i < REWIND_LEN_SIZE; i++)
+			__gb_rewind_put(rw, len >> (i * 8));
 
-	*ram_size = ram_sizes[ram_size_code];
-	return 0;
+		rw->used += need;
+		rw->count++;
+	}
+
+	/* The next state becomes the newest state. */
+	tmp = rw->state;
+	rw->state = rw->next;
+	rw->next = tmp;
 }
 
-PGB_DEPRECATED("Does not return error code. Use gb_get_save_size_s instead.")
-uint_fast32_t gb_get_save_size(struct gb_s *gb)
+int gb_rewind_pop(struct gb_rewind_s *rw, struct gb_s *gb)
 {
-	const uint_fast16_t ram_size_location = 0x0149;
-	const uint_fast32_t ram_sizes[] =
-	{
-		/* 0,  2KiB,   8KiB,  32KiB,  128KiB,   64KiB */
-		0x00, 0x800, 0x2000, 0x8000, 0x20000, 0x10000
-	};
-	uint8_t ram_size_code = gb->gb_rom_read(gb, ram_size_location);
+	size_t off, len, pos, lit;
 
-	/* MBC2 always has 512 half-bytes of cart RAM.
-	 * This assumes that only the lower nibble of each byte is used; the
-	 * nibbles are not packed. */
-	if(gb->mbc == 2)
-		return 0x200;
+	if(!rw->has_state)
+		return -1;
 
-	/* Return 0 on invalid or unsupported RAM size. */
-	if(ram_size_code >= PEANUT_GB_ARRAYSIZE(ram_sizes))
+	gb_state_load(gb, rw->state, rw->state_size);
+
+	/* The oldest state is kept so that it may be loaded again. */
+	if(rw->count == 0)
 		return 0;
 
-	return ram_sizes[ram_size_code];
+	/* Undo the newest delta to obtain the previous state. */
+	off = (rw->head + rw->ring_size - REWIND_LEN_SIZE) % rw->ring_size;
+	len = __gb_rewind_get_len(rw, off);
+	off = (off + rw->ring_size - len) % rw->ring_size;
+	rw->head = (off + rw->ring_size - REWIND_LEN_SIZE) % rw->ring_size;
+	rw->used -= len + 2 * REWIND_LEN_SIZE;
+	rw->count--;
+
+	for(pos = 0; len != 0;)
+	{
+		pos += __gb_rewind_get_var(rw, &off, &len);
+		lit = __gb_rewind_get_var(rw, &off, &len);
+		len -= lit;
+
+		for(; lit != 0; lit--)
+			rw->state[pos++] ^= __gb_rewind_get(rw, &off);
+	}
+
+	return 0;
 }
 
-void gb_init_serial(struct gb_s *gb,
-		    void (*gb_serial_tx)(struct gb_s*, const uint8_t),
-		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
-			    uint8_t*))
+/* Size of the number of frames and of the size of the log in bytes, which are
+ * at the start of an input log. */
+#define INPUT_LOG_FIELD_SIZE	4
+#define INPUT_LOG_HEADER_SIZE	(2 * INPUT_LOG_FIELD_SIZE)
+/* Largest size of a change of the joypad in an input log. */
+#define INPUT_LOG_CHANGE_MAX	6
+/* Frame of the next change when the end of an input log is reached. */
+#define INPUT_LOG_NO_CHANGE	UINT32_MAX
+
+/**
+ * Internal function used to save a keyframe if the frame to be replayed next
+ * is at the end of the keyframes saved so far.
+ */
+static void __gb_input_log_keyframe(struct gb_input_log_s *log,
+		struct gb_s *gb)
 {
-	gb->gb_serial_tx = gb_serial_tx;
-	gb->gb_serial_rx = gb_serial_rx;
+	uint_fast32_t k;
+
+	if(log->interval == 0 || log->frame == 0 ||
+			log->frame % log->interval != 0)
+		return;
+
+	k = log->frame / log->interval - 1;
+	if(k != log->keyframe_count || k >= log->keyframe_max)
+		return;
+
+	gb_state_save(gb, &log->keyframes[k * log->state_size]);
+	log->keyframe_count++;
 }
 
-uint8_t gb_colour_hash(struct gb_s *gb)
+/**
+ * Internal function used to read the frame of the next change of the joypad.
+ */
+static void __gb_input_log_next(struct gb_input_log_s *log)
 {
-#define ROM_TITLE_START_ADDR	0x0134
-#define ROM_TITLE_END_ADDR	0x0143
+	uint_fast32_t delta = 0;
+	uint_fast8_t shift = 0;
+	uint8_t b;
 
-	uint8_t x = 0;
-	uint16_t i;
+	if(log->pos >= log->used)
+	{
+		log->change_frame = INPUT_LOG_NO_CHANGE;
+		return;
+	}
 
-	for(i = ROM_TITLE_START_ADDR; i <= ROM_TITLE_END_ADDR; i++)
-		x += gb->gb_rom_read(gb, i);
+	do
+	{
+		b = log->data[log->pos++];
+		delta |= (uint_fast32_t)(b & 0x7F) << shift;
+		shift += 7;
+	} while((b & 0x80) && log->pos < log->used);
 
-	return x;
+	log->change_frame += delta;
 }
 
 /**
- * Resets the context, and initialises startup values for a DMG console.
+ * Internal function used to apply the changes of the joypad that are before
+ * the given frame.
  */
-void gb_reset(struct gb_s *gb)
+static void __gb_input_log_scan(struct gb_input_log_s *log,
+		uint_fast32_t frame)
 {
-	gb->gb_halt = false;
-	gb->gb_ime = true;
+	while(log->change_frame < frame && log->pos < log->used)
+	{
+		log->joypad = log->data[log->pos++];
+		__gb_input_log_next(log);
+	}
 
-	/* Initialise MBC values. */
-	gb->selected_rom_bank = 1;
-	gb->cart_ram_bank = 0;
-	gb->enable_cart_ram = 0;
-	gb->cart_mode_select = 0;
+	if(log->change_frame < frame)
+		log->change_frame = INPUT_LOG_NO_CHANGE;
+}
 
-	/* Use values as though the boot ROM was already executed. */
-	if(gb->gb_bootrom_read == NULL)
-	{
-		uint8_t hdr_chk;
-		hdr_chk = gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC) != 0;
+int gb_input_log_init(struct gb_input_log_s *log, struct gb_s *gb,
+		void *buf, size_t size, void *keyframes, size_t keyframes_size,
+		uint_fast32_t interval)
+{
+	const size_t state_size = gb_state_size(gb);
 
-		gb->cpu_reg.a = 0x01;
-		gb->cpu_reg.f.f_bits.z = 1;
-		gb->cpu_reg.f.f_bits.n = 0;
-		gb->cpu_reg.f.f_bits.h = hdr_chk;
-		gb->cpu_reg.f.f_bits.c = hdr_chk;
-		gb->cpu_reg.bc.reg = 0x0013;
-		gb->cpu_reg.de.reg = 0x00D8;
-		gb->cpu_reg.hl.reg = 0x014D;
-		gb->cpu_reg.sp.reg = 0xFFFE;
-		gb->cpu_reg.pc.reg = 0x0100;
+	if(size < INPUT_LOG_HEADER_SIZE + state_size + INPUT_LOG_CHANGE_MAX)
+		return -1;
 
-		gb->hram_io[IO_DIV ] = 0xAB;
-		gb->hram_io[IO_LCDC] = 0x91;
-		gb->hram_io[IO_STAT] = 0x85;
-		gb->hram_io[IO_BOOT] = 0x01;
+	log->data = buf;
+	log->size = size;
+	log->used = INPUT_LOG_HEADER_SIZE + state_size;
+	log->state_size = state_size;
+	log->frames = 0;
+	log->keyframes = keyframes;
+	log->keyframe_max = keyframes == NULL ? 0 : keyframes_size / state_size;
+	log->keyframe_count = 0;
+	log->interval = interval;
+	log->frame = 0;
+	log->joypad = gb->direct.joypad;
+	log->change_frame = 0;
+	log->pos = log->used;
+
+	__gb_state_put(__gb_state_put(log->data, 0, INPUT_LOG_FIELD_SIZE),
+			log->used, INPUT_LOG_FIELD_SIZE);
+	gb_state_save(gb, log->data + INPUT_LOG_HEADER_SIZE);
 
-		__gb_write(gb, 0xFF26, 0xF1);
+	return 0;
+}
 
-		memset(gb->vram, 0x00, VRAM_SIZE);
-	}
-	else
+int gb_input_log_record(struct gb_input_log_s *log, struct gb_s *gb)
+{
+	const uint8_t joypad = gb->direct.joypad;
+
+	if(log->frame == 0 || joypad != log->joypad)
 	{
-		/* Set value as though the console was just switched on.
-		 * CPU registers are uninitialised. */
-		gb->cpu_reg.pc.reg = 0x0000;
-		gb->hram_io[IO_DIV ] = 0x00;
-		gb->hram_io[IO_LCDC] = 0x00;
-		gb->hram_io[IO_STAT] = 0x84;
-		gb->hram_io[IO_BOOT] = 0x00;
+		uint8_t *p = log->data + log->used;
+		uint_fast32_t delta = log->frame - log->change_frame;
+
+		if(log->used + INPUT_LOG_CHANGE_MAX > log->size)
+			return -1;
+
+		while(delta >= 0x80)
+		{
+			*p++ = (delta & 0x7F) | 0x80;
+			delta >>= 7;
+		}
+
+		*p++ = delta;
+		*p++ = joypad;
+		log->used = p - log->data;
+		log->change_frame = log->frame;
+		log->joypad = joypad;
 	}
 
-	gb->counter.lcd_count = 0;
-	gb->counter.div_count = 0;
-	gb->counter.tima_count = 0;
-	gb->counter.serial_count = 0;
-	gb->counter.rtc_count = 0;
-	gb->counter.lcd_off_count = 0;
+	__gb_input_log_keyframe(log, gb);
 
-	gb->direct.joypad = 0xFF;
-	gb->hram_io[IO_JOYP] = 0xCF;
-	gb->hram_io[IO_SB  ] = 0x00;
-	gb->hram_io[IO_SC  ] = 0x7E;
-	/* DIV */
-	gb->hram_io[IO_TIMA] = 0x00;
-	gb->hram_io[IO_TMA ] = 0x00;
-	gb->hram_io[IO_TAC ] = 0xF8;
-	gb->hram_io[IO_IF  ] = 0xE1;
+	log->frames = ++log->frame;
+	__gb_state_put(__gb_state_put(log->data, log->frames,
+				INPUT_LOG_FIELD_SIZE),
+			log->used, INPUT_LOG_FIELD_SIZE);
 
-	/* LCDC */
-	/* STAT */
-	gb->hram_io[IO_SCY ] = 0x00;
-	gb->hram_io[IO_SCX ] = 0x00;
-	gb->hram_io[IO_LY  ] = 0x00;
-	gb->hram_io[IO_LYC ] = 0x00;
-	__gb_write(gb, 0xFF47, 0xFC); // BGP
-	__gb_write(gb, 0xFF48, 0xFF); // OBJP0
-	__gb_write(gb, 0xFF49, 0xFF); // OBJP1
-	gb->hram_io[IO_WY] = 0x00;
-	gb->hram_io[IO_WX] = 0x00;
-	gb->hram_io[IO_IE] = 0x00;
-	gb->hram_io[IO_IF] = 0xE1;
+	return 0;
 }
 
-enum gb_init_error_e gb_init(struct gb_s *gb,
-			     uint8_t (*gb_rom_read)(struct gb_s*, const uint_fast32_t),
-			     uint8_t (*gb_cart_ram_read)(struct gb_s*, const uint_fast32_t),
-			     void (*gb_cart_ram_write)(struct gb_s*, const uint_fast32_t, const uint8_t),
-			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
-			     void *priv)
+int gb_input_log_open(struct gb_input_log_s *log, struct gb_s *gb,
+		void *buf, size_t size, void *keyframes, size_t keyframes_size,
+		uint_fast32_t interval)
 {
-	const uint16_t mbc_location = 0x0147;
-	const uint16_t bank_count_location = 0x0148;
-	const uint16_t ram_size_location = 0x0149;
-	/**
-	 * Table for cartridge type (MBC). -1 if invalid.
-	 * TODO: MMM01 is untested.
-	 * TODO: MBC6 is untested.
-	 * TODO: MBC7 is unsupported.
-	 * TODO: POCKET CAMERA is unsupported.
-	 * TODO: BANDAI TAMA5 is unsupported.
-	 * TODO: HuC3 is unsupported.
-	 * TODO: HuC1 is unsupported.
-	 **/
-	const int8_t cart_mbc[] =
-	{
-		0, 1, 1, 1, -1, 2, 2, -1, 0, 0, -1, 0, 0, 0, -1, 3,
-		3, 3, 3, 3, -1, -1, -1, -1, -1, 5, 5, 5, 5, 5, 5, -1
-	};
-	/* Whether cart has RAM. */
-	const uint8_t cart_ram[] =
-	{
-		0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 0, 0, 0, 0, 0, 0,
-		1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0
-	};
-	/* How large the ROM is in banks of 16 KiB. */
-	const uint16_t num_rom_banks_mask[] =
-	{
-		2, 4, 8, 16, 32, 64, 128, 256, 512
-	};
-	/* How large the cart RAM is in banks of 8 KiB. Code $01 is unused, but
-	 * some early homebrew ROMs supposedly may use this value. */
-	const uint8_t num_ram_banks[] = { 0, 1, 1, 4, 16, 8 };
+	const size_t state_size = gb_state_size(gb);
+	const uint8_t *p = buf;
+	uint_fast32_t frames, used;
 
-	gb->gb_rom_read = gb_rom_read;
-	gb->gb_cart_ram_read = gb_cart_ram_read;
-	gb->gb_cart_ram_write = gb_cart_ram_write;
-	gb->gb_error = gb_error;
-	gb->direct.priv = priv;
+	if(size < INPUT_LOG_HEADER_SIZE + state_size)
+		return -1;
 
-	/* Initialise serial transfer function to NULL. If the front-end does
-	 * not provide serial support, Peanut-GB will emulate no cable connected
-	 * automatically. */
-	gb->gb_serial_tx = NULL;
-	gb->gb_serial_rx = NULL;
+	/* The buffer may be larger than the log, such as when the whole
+	 * buffer of the recording was saved. */
+	frames = __gb_state_get(&p, INPUT_LOG_FIELD_SIZE);
+	used = __gb_state_get(&p, INPUT_LOG_FIELD_SIZE);
+	if(used < INPUT_LOG_HEADER_SIZE + state_size || used > size)
+		return -1;
+
+	if(gb_state_load(gb, p, state_size) != GB_STATE_NO_ERROR)
+		return -1;
+
+	log->data = buf;
+	log->size = size;
+	log->used = used;
+	log->state_size = state_size;
+	log->frames = frames;
+	log->keyframes = keyframes;
+	log->keyframe_max = keyframes == NULL ? 0 : keyframes_size / state_size;
+	log->keyframe_count = 0;
+	log->interval = interval;
+	log->frame = 0;
+	log->joypad = gb->direct.joypad;
+	log->change_frame = 0;
+	log->pos = INPUT_LOG_HEADER_SIZE + state_size;
+	__gb_input_log_next(log);
+
+	return 0;
+}
+
+int gb_input_log_play(struct gb_input_log_s *log, struct gb_s *gb)
+{
+	if(log->frame >= log->frames)
+		return -1;
+
+	__gb_input_log_scan(log, log->frame + 1);
+	__gb_input_log_keyframe(log, gb);
+
+	gb->direct.joypad = log->joypad;
+	gb_run_frame(gb);
+	log->frame++;
+
+	return 0;
+}
+
+int gb_input_log_seek(struct gb_input_log_s *log, struct gb_s *gb,
+		uint_fast32_t frame)
+{
+	uint_fast32_t k = 0;
+	const uint8_t *state = log->data + INPUT_LOG_HEADER_SIZE;
+
+	if(frame > log->frames)
+		return -1;
+
+	/* Start from the nearest keyframe before the frame. */
+	if(log->interval != 0)
+		k = frame / log->interval;
 
-	gb->gb_bootrom_read = NULL;
+	if(k > log->keyframe_count)
+		k = log->keyframe_count;
 
-	/* Check valid ROM using checksum value. */
-	{
-		uint8_t x = 0;
-		uint16_t i;
+	if(k != 0)
+		state = &log->keyframes[(k - 1) * log->state_size];
 
-		for(i = 0x0134; i <= 0x014C; i++)
-			x = x - gb->gb_rom_read(gb, i) - 1;
+	if(gb_state_load(gb, state, log->state_size) != GB_STATE_NO_ERROR)
+		return -1;
 
-		if(x != gb->gb_rom_read(gb, ROM_HEADER_CHECKSUM_LOC))
-			return GB_INIT_INVALID_CHECKSUM;
-	}
+	/* Find the joypad at the keyframe. */
+	log->frame = k * log->interval;
+	log->change_frame = 0;
+	log->pos = INPUT_LOG_HEADER_SIZE + log->state_size;
+	__gb_input_log_next(log);
+	__gb_input_log_scan(log, log->frame);
 
-	/* Check if cartridge type is supported, and set MBC type. */
-	{
-		const uint8_t mbc_value = gb->gb_rom_read(gb, mbc_location);
+	while(log->frame < frame)
+		gb_input_log_play(log, gb);
 
-		if(mbc_value > sizeof(cart_mbc) - 1 ||
-				(gb->mbc = cart_mbc[mbc_value]) == -1)
-			return GB_INIT_CARTRIDGE_UNSUPPORTED;
-	}
+	return 0;
+}
 
-	gb->num_rom_banks_mask = num_rom_banks_mask[gb->gb_rom_read(gb, bank_count_location)] - 1;
-	gb->cart_ram = cart_ram[gb->gb_rom_read(gb, mbc_location)];
-	gb->num_ram_banks = num_ram_banks[gb->gb_rom_read(gb, ram_size_location)];
+#if PEANUT_GB_USE_DIRTY_PAGES
+/**
+ * Internal function used to get the dirty page bitmap of a memory.
+ */
+static uint8_t *__gb_dirty_bitmap(struct gb_s *gb, enum gb_dirty_mem_e mem,
+		size_t *pages)
+{
+	size_t size;
 
-	/* If the ROM says that it support RAM, but has 0 RAM banks, then
-	 * disable RAM reads from the cartridge. */
-	if(gb->cart_ram == 0 || gb->num_ram_banks == 0)
+	switch(mem)
 	{
-		gb->cart_ram = 0;
-		gb->num_ram_banks = 0;
-	}
+	case GB_DIRTY_WRAM:
+		*pages = WRAM_SIZE / DIRTY_PAGE_SIZE;
+		return gb->dirty.wram;
 
-	/* If MBC3 and number of ROM or RAM banks are larger than 128 or 8,
-	 * respectively, then select MBC3O mode. */
-	if(gb->mbc == 3)
-		gb->cart_is_mbc3O = gb->num_rom_banks_mask > 128 || gb->num_ram_banks > 4;
+	case GB_DIRTY_VRAM:
+		*pages = VRAM_SIZE / DIRTY_PAGE_SIZE;
+		return gb->dirty.vram;
 
-	/* Note that MBC2 will appear to have no RAM banks, but it actually
-	 * always has 512 half-bytes of RAM. Hence, gb->num_ram_banks must be
-	 * ignored for MBC2. */
+	case GB_DIRTY_OAM:
+		*pages = 1;
+		return gb->dirty.oam;
 
-	gb->lcd_blank = false;
-	gb->display.lcd_draw_line = NULL;
+	case GB_DIRTY_CART_RAM:
+		if(gb_get_save_size_s(gb, &size) < 0 || size > DIRTY_CRAM_SIZE)
+			size = DIRTY_CRAM_SIZE;
 
-	gb_reset(gb);
+		*pages = (size + DIRTY_PAGE_SIZE - 1) / DIRTY_PAGE_SIZE;
+		return gb->dirty.cart_ram;
 
-	return GB_INIT_NO_ERROR;
+	default:
+		*pages = 0;
+		return NULL;
+	}
+}
+
+const uint8_t *gb_dirty_get(struct gb_s *gb, enum gb_dirty_mem_e mem,
+		size_t *pages)
+{
+	return __gb_dirty_bitmap(gb, mem, pages);
+}
+
+void gb_dirty_clear(struct gb_s *gb, enum gb_dirty_mem_e mem)
+{
+	size_t pages;
+	uint8_t *bitmap = __gb_dirty_bitmap(gb, mem, &pages);
+
+	if(bitmap != NULL)
+		memset(bitmap, 0, (pages + 7) / 8);
 }
+#endif
 
 const char* gb_get_rom_name(struct gb_s* gb, char *title_str)
 {
@@ -3828,17 +6958,142 @@ void gb_init_lcd(struct gb_s *gb,
 			const uint_fast8_t line))
 {
 	gb->display.lcd_draw_line = lcd_draw_line;
+	gb->display.fb = NULL;
 
 	gb->direct.interlace = false;
 	gb->display.interlace_count = false;
 	gb->direct.frame_skip = false;
-	gb->display.frame_skip_count = false;
+	gb->display.skip_frame = false;
+	gb->display.frame_skip_count = 0;
+	gb->display.frame_skip_ratio = 0;
+	gb->display.frame_skip_max = 0;
+	gb->display.frame_debt = 0;
+#if PEANUT_GB_USE_LINE_HASH
+	__gb_reset_line_hash(gb);
+#endif
 
 	gb->display.window_clear = 0;
 	gb->display.WY = 0;
 
 	return;
 }
+
+void gb_init_framebuffer(struct gb_s *gb, void *fb, size_t pitch,
+		enum gb_framebuffer_format_e format, const uint32_t lut[12])
+{
+	uint_fast8_t i;
+
+	gb->display.lcd_draw_line = NULL;
+	gb->display.fb = fb;
+	gb->display.fb_pitch = pitch;
+	gb->display.fb_format = format;
+
+	/* Expand the LUT so that it is indexed by the pixel value, which has
+	 * the layer (OBJ0, OBJ1, BG) in bits 5-4 and the shade in bits 1-0.
+	 * Without PEANUT_GB_12_COLOUR, only the shade is given. */
+	for(i = 0; i < sizeof(gb->display.fb_lut) / sizeof(gb->display.fb_lut[0]);
+			i++)
+	{
+#if PEANUT_GB_12_COLOUR
+		uint_fast8_t idx = ((i & LCD_PALETTE_ALL) >> 2) | (i & LCD_COLOUR);
+#else
+		uint_fast8_t idx = i & LCD_COLOUR;
+#endif
+		gb->display.fb_lut[i] = lut != NULL ? lut[idx] : idx;
+	}
+
+	gb->direct.interlace = false;
+	gb->display.interlace_count = false;
+	gb->direct.frame_skip = false;
+	gb->display.skip_frame = false;
+	gb->display.frame_skip_count = 0;
+	gb->display.frame_skip_ratio = 0;
+	gb->display.frame_skip_max = 0;
+	gb->display.frame_debt = 0;
+#if PEANUT_GB_USE_LINE_HASH
+	__gb_reset_line_hash(gb);
+#endif
+
+	gb->display.window_clear = 0;
+	gb->display.WY = 0;
+}
+#endif
+
+#if ENABLE_LCD
+void gb_set_frame_skip(struct gb_s *gb, uint_fast8_t skip)
+{
+	gb->display.frame_skip_ratio = skip;
+	gb->display.frame_skip_max = 0;
+}
+
+void gb_set_frame_skip_auto(struct gb_s *gb, uint_fast8_t max_skip)
+{
+	gb->display.frame_skip_max = max_skip;
+	gb->display.frame_debt = 0;
+}
+
+void gb_frame_skip_report(struct gb_s *gb, uint_fast32_t used,
+		uint_fast32_t budget)
+{
+	uint_fast32_t debt = gb->display.frame_debt + used;
+
+	/* Time saved by quick frames only pays back time that was lost, and
+	 * the debt is limited so that skipping stops soon after the
+	 * front-end catches up. */
+	debt = debt > budget ? debt - budget : 0;
+	if(debt > budget * 4)
+		debt = budget * 4;
+
+	gb->display.frame_debt = debt;
+}
+
+void gb_get_frame_skip_stats(const struct gb_s *gb, uint_fast32_t *drawn,
+		uint_fast32_t *skipped)
+{
+	*drawn = gb->display.frames_drawn;
+	*skipped = gb->display.frames_skipped;
+}
+#endif
+
+#if PEANUT_GB_USE_LINE_HASH
+bool gb_frame_changed(const struct gb_s *gb)
+{
+	uint_fast8_t i;
+
+	for(i = 0; i < sizeof(gb->display.line_changed); i++)
+	{
+		if(gb->display.line_changed[i] != 0)
+			return true;
+	}
+
+	return false;
+}
+
+const uint8_t *gb_lines_changed(const struct gb_s *gb)
+{
+	return gb->display.line_changed;
+}
+
+uint32_t gb_frame_hash(const struct gb_s *gb)
+{
+	uint32_t hash = 2166136261u;
+	uint_fast8_t y;
+
+	for(y = 0; y < LCD_HEIGHT; y++)
+	{
+		hash ^= gb->display.line_hash[y];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+#endif
+
+#if PEANUT_GB_IDLE_LOOP_SKIP
+uint_least64_t gb_get_idle_cycles(const struct gb_s *gb)
+{
+	return gb->counter.idle_cycles;
+}
 #endif
 
 void gb_set_bootrom(struct gb_s *gb,
@@ -3894,6 +7149,78 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
 			     void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
 			     void *priv);
 
+/**
+ * Initialises the emulator context with a ROM and cart RAM that are held in
+ * memory. Peanut-GB reads and writes these buffers itself, which is faster
+ * than using the callbacks given to gb_init(). The buffers must remain valid
+ * for the lifetime of the context.
+ *
+ * \param gb	Allocated emulator context. Must not be NULL.
+ * \param rom	ROM image. Must not be NULL.
+ * \param rom_size Size of the ROM image in bytes. Reads past the end of the
+ * 		ROM image return 0xFF.
+ * \param cart_ram Cart RAM. May be NULL if the game does not have cart RAM,
+ * 		or if it is set later with gb_set_cart_ram().
+ * \param cart_ram_size Size of cart RAM in bytes. See gb_get_save_size_s().
+ * \param gb_error Pointer to function that is called when an unrecoverable
+ *		error occurs. Must not be NULL.
+ * \param priv	Private data that is stored within the emulator context. Set to
+ * 		NULL if unused.
+ * \returns	0 on success or an enum that describes the error.
+ */
+enum gb_init_error_e gb_init_direct(struct gb_s *gb,
+		const uint8_t *rom, size_t rom_size,
+		uint8_t *cart_ram, size_t cart_ram_size,
+		void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+		void *priv);
+
+/**
+ * Checks and decodes the cartridge header of a ROM held in memory, so that the
+ * ROM may be shared by many contexts with gb_init_rom(). The ROM may be
+ * read only, such as a file mapped into memory.
+ *
+ * \param rom	Shared ROM to initialise. Must not be NULL.
+ * \param data	ROM image. Must remain valid whilst the shared ROM is used.
+ * \param size	Size of the ROM image in bytes.
+ * \returns	0 on success or an enum that describes the error.
+ */
+enum gb_init_error_e gb_rom_init(struct gb_rom_s *rom, const uint8_t *data,
+		size_t size);
+
+/**
+ * Initialises the emulator context with a shared ROM, in the same way as
+ * gb_init_direct(), but without checking and decoding the cartridge header
+ * again. Increments the number of references to the shared ROM.
+ * Contexts that share a ROM must not be initialised or released at the same
+ * time from different threads.
+ *
+ * \param gb	Allocated emulator context. Must not be NULL.
+ * \param rom	Shared ROM on which gb_rom_init() succeeded. Must not be NULL.
+ * \param cart_ram Cart RAM. May be NULL if the game does not have cart RAM,
+ * 		or if it is set later with gb_set_cart_ram().
+ * \param cart_ram_size Size of cart RAM in bytes. See gb_get_save_size_s().
+ * \param gb_error Pointer to function that is called when an unrecoverable
+ *		error occurs. Must not be NULL.
+ * \param priv	Private data that is stored within the emulator context. Set to
+ * 		NULL if unused.
+ * \returns	0 on success or an enum that describes the error.
+ */
+enum gb_init_error_e gb_init_rom(struct gb_s *gb, struct gb_rom_s *rom,
+		uint8_t *cart_ram, size_t cart_ram_size,
+		void (*gb_error)(struct gb_s*, const enum gb_error_e, const uint16_t),
+		void *priv);
+
+/**
+ * Releases the shared ROM of a context initialised with gb_init_rom(). The
+ * context must not be run afterwards.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Number of contexts still using the shared ROM. The shared ROM
+ *		may be freed once this is 0. Also 0 if the context does not
+ *		use a shared ROM.
+ */
+unsigned int gb_release_rom(struct gb_s *gb);
+
 /**
  * Executes the emulator and runs for the duration of time equal to one frame.
  *
@@ -3901,6 +7228,21 @@ enum gb_init_error_e gb_init(struct gb_s *gb,
  */
 void gb_run_frame(struct gb_s *gb);
 
+/**
+ * Runs the given number of frames, only drawing the lines of the last frame.
+ * The LCD is otherwise emulated as usual, so that games that wait on LY or on
+ * STAT interrupts behave the same. This is quicker than calling gb_run_frame()
+ * for each frame when only the final frame is shown, such as when fast
+ * forwarding or when training an agent. The last frame is drawn even if frame
+ * skip would have skipped it, unless GB_RUN_NO_RENDER is given.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param frames Number of frames to run.
+ * \param flags	GB_RUN_* flags, or 0.
+ */
+void gb_run_frames(struct gb_s *gb, uint_fast32_t frames,
+		unsigned int flags);
+
 /**
  * Internal function used to step the CPU. Used mainly for testing.
  * Use gb_run_frame() instead.
@@ -3937,6 +7279,28 @@ void gb_init_lcd(struct gb_s *gb,
 		void (*lcd_draw_line)(struct gb_s *gb,
 			const uint8_t *pixels,
 			const uint_fast8_t line));
+
+/**
+ * Initialises the display context of the emulator to write each line straight
+ * into a frame buffer owned by the front-end, instead of calling
+ * lcd_draw_line. Only available when ENABLE_LCD is defined to a non-zero
+ * value. Replaces any function set with gb_init_lcd().
+ * Each pixel is converted through lut, which is indexed by the layer and shade
+ * of the pixel: entries 0-3 are OBJ0, 4-7 are OBJ1 and 8-11 are BG, each from
+ * white to black. If PEANUT_GB_12_COLOUR is 0, only entries 0-3 are used.
+ * This function can be called at any time.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param fb	Frame buffer of at least LCD_HEIGHT lines of LCD_WIDTH
+ *		pixels, aligned for the pixel format. Must not be NULL.
+ * \param pitch	Number of bytes from the start of one line to the next.
+ * \param format	Pixel format of the frame buffer.
+ * \param lut	12 colours, in the pixel format. The LUT is copied into the
+ *		context. If NULL, the index into the LUT is written instead,
+ *		which is mainly useful with GB_FRAMEBUFFER_INDEX8.
+ */
+void gb_init_framebuffer(struct gb_s *gb, void *fb, size_t pitch,
+		enum gb_framebuffer_format_e format, const uint32_t lut[12]);
 #endif
 
 /**
@@ -3956,6 +7320,236 @@ void gb_init_serial(struct gb_s *gb,
 		    enum gb_serial_rx_ret_e (*gb_serial_rx)(struct gb_s*,
 			    uint8_t*));
 
+#if PEANUT_GB_EXTERNAL_MEMORY
+/**
+ * Sets the buffers holding the WRAM, VRAM, OAM and I/O registers of the
+ * context. Must be called before the context is initialised, and the buffers
+ * must remain valid for the lifetime of the context. Only available if
+ * PEANUT_GB_EXTERNAL_MEMORY is set.
+ *
+ * \param gb	Allocated emulator context. Must not be NULL.
+ * \param wram	WRAM of WRAM_SIZE bytes. Must not be NULL.
+ * \param vram	VRAM of VRAM_SIZE bytes. Must not be NULL.
+ * \param oam	OAM of OAM_SIZE bytes. Must not be NULL.
+ * \param hram_io I/O registers and HRAM of HRAM_IO_SIZE bytes. Must not be
+ *		NULL.
+ */
+void gb_init_memory(struct gb_s *gb, uint8_t *wram, uint8_t *vram,
+		uint8_t *oam, uint8_t *hram_io);
+#endif
+
+/**
+ * Sets the buffer holding the Cart RAM. Accesses to Cart RAM will use this
+ * buffer instead of the gb_cart_ram_read and gb_cart_ram_write callbacks.
+ * Usually called after gb_get_save_size_s(), as the size of Cart RAM is only
+ * known once the context is initialised.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param cart_ram Cart RAM. Must remain valid for the lifetime of the context.
+ * \param cart_ram_size Size of cart_ram in bytes.
+ */
+void gb_set_cart_ram(struct gb_s *gb, uint8_t *cart_ram, size_t cart_ram_size);
+
+/**
+ * Returns the size of the buffer required by gb_state_save().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Size of a saved state in bytes. This includes the Cart RAM
+ *		only if it was given with gb_init_direct() or
+ *		gb_set_cart_ram().
+ */
+size_t gb_state_size(const struct gb_s *gb);
+
+/**
+ * Saves the state of the emulation, such as the CPU registers, timers, memory
+ * banking, RTC, WRAM, VRAM, OAM and I/O registers, to a buffer. The format is
+ * packed, does not contain any pointers and is the same on all platforms.
+ * Cart RAM is only included if it was given with gb_init_direct() or
+ * gb_set_cart_ram(); otherwise the front-end must save it separately.
+ * This is fast enough to be called every frame.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Buffer of at least gb_state_size() bytes. Must not be NULL.
+ */
+void gb_state_save(struct gb_s *gb, void *buf);
+
+/**
+ * Loads a state saved by gb_state_save() with the same game. The callbacks,
+ * buffers and display settings of the context are kept.
+ * If the saved state includes Cart RAM, it is only restored if the Cart RAM
+ * buffer of the context has the same size.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Saved state. Must not be NULL.
+ * \param size	Size of buf in bytes.
+ * \returns	GB_STATE_NO_ERROR on success. The context is unchanged
+ *		on error.
+ */
+enum gb_state_error_e gb_state_load(struct gb_s *gb, const void *buf,
+		size_t size);
+
+/**
+ * Copies the state of the emulation from one context to another, as though it
+ * was saved with gb_state_save() and loaded with gb_state_load(), without the
+ * intermediate buffer. Both contexts must have been initialised with the same
+ * game. The callbacks, buffers and display settings of dst are kept.
+ * Cart RAM is only copied if both contexts were given Cart RAM of the same
+ * size with gb_init_direct() or gb_set_cart_ram().
+ *
+ * If PEANUT_GB_USE_FORK_TRACKING is set, forking again from the same source
+ * only copies the pages of WRAM, VRAM and Cart RAM that dst wrote to since it
+ * was last forked, provided that src was not changed in the meantime. This
+ * makes branching many times from one state cheap. The serials that track
+ * whether src changed are shared by all contexts, so gb_init() and gb_fork()
+ * must not be called from more than one thread at a time.
+ *
+ * \param src	Context to copy from. Must not be NULL.
+ * \param dst	Context to copy to. Must not be NULL.
+ * \returns	GB_STATE_NO_ERROR on success, or GB_STATE_ROM_MISMATCH if
+ *		the contexts were initialised with different games, in which
+ *		case dst is unchanged.
+ */
+enum gb_state_error_e gb_fork(struct gb_s *src, struct gb_s *dst);
+
+/**
+ * Initialises rewind history within an arena given by the front-end. The
+ * arena holds two saved states, and the rest of the arena holds the older
+ * states as deltas, which are usually a few hundred bytes each. Must be called
+ * again if the Cart RAM buffer of the context is changed.
+ *
+ * \param rw	Rewind history to initialise. Must not be NULL.
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param arena	Memory used for the history. Must remain valid for the
+ *		lifetime of rw.
+ * \param arena_size Size of arena in bytes.
+ * \returns	0 on success, or -1 if the arena is too small.
+ */
+int gb_rewind_init(struct gb_rewind_s *rw, struct gb_s *gb, void *arena,
+		size_t arena_size);
+
+/**
+ * Adds the current state of the emulation to the rewind history, usually once
+ * per frame. The oldest states are discarded if the arena is full.
+ *
+ * \param rw	Rewind history. Must not be NULL.
+ * \param gb	Emulator context given to gb_rewind_init(). Must not be NULL.
+ */
+void gb_rewind_push(struct gb_rewind_s *rw, struct gb_s *gb);
+
+/**
+ * Loads the newest state in the rewind history and removes it from the
+ * history, so that the next call loads the state before it. The oldest state
+ * is never removed.
+ *
+ * \param rw	Rewind history. Must not be NULL.
+ * \param gb	Emulator context given to gb_rewind_init(). Must not be NULL.
+ * \returns	0 on success, or -1 if the history is empty.
+ */
+int gb_rewind_pop(struct gb_rewind_s *rw, struct gb_s *gb);
+
+/**
+ * Starts recording the joypad input from the current state of the emulation.
+ * gb_input_log_record() must then be called before each call to
+ * gb_run_frame().
+ *
+ * \param log	Input log to initialise. Must not be NULL.
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Buffer that the log is recorded to, which must hold a saved
+ *		state and a few bytes for each change of the joypad. Must
+ *		remain valid for the lifetime of log.
+ * \param size	Size of buf in bytes.
+ * \param keyframes Buffer for the keyframes, each of gb_state_size() bytes.
+ *		May be NULL. Must remain valid for the lifetime of log.
+ * \param keyframes_size Size of keyframes in bytes.
+ * \param interval Number of frames between keyframes, such as 3600 for one
+ *		keyframe per minute. 0 disables keyframes.
+ * \returns	0 on success, or -1 if buf is too small.
+ */
+int gb_input_log_init(struct gb_input_log_s *log, struct gb_s *gb,
+		void *buf, size_t size, void *keyframes, size_t keyframes_size,
+		uint_fast32_t interval);
+
+/**
+ * Records the joypad for the next frame. Must be called once before each call
+ * to gb_run_frame() while recording, after the joypad was set.
+ *
+ * \param log	Input log given to gb_input_log_init().
+ * \param gb	Emulator context given to gb_input_log_init().
+ * \returns	0 on success, or -1 if the buffer of the log is full, in
+ *		which case the frame is not recorded.
+ */
+int gb_input_log_record(struct gb_input_log_s *log, struct gb_s *gb);
+
+/**
+ * Opens an input log that was recorded with gb_input_log_record() for
+ * replaying, and loads the state at its first frame. The context must be
+ * initialised with the same game and Cart RAM size as when it was recorded.
+ *
+ * \param log	Input log to initialise. Must not be NULL.
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param buf	Buffer holding at least the first log->used bytes of
+ *		log->data of the recording. Bytes after the end of the log are
+ *		ignored. Must remain valid for the lifetime of log.
+ * \param size	Size of buf in bytes.
+ * \param keyframes See gb_input_log_init(). Keyframes are saved as the log is
+ *		replayed.
+ * \param keyframes_size Size of keyframes in bytes.
+ * \param interval Number of frames between keyframes.
+ * \returns	0 on success, or -1 if buf does not hold a valid log.
+ */
+int gb_input_log_open(struct gb_input_log_s *log, struct gb_s *gb,
+		void *buf, size_t size, void *keyframes, size_t keyframes_size,
+		uint_fast32_t interval);
+
+/**
+ * Sets the joypad to the recorded input and runs the next frame of the log.
+ *
+ * \param log	Input log given to gb_input_log_open().
+ * \param gb	Emulator context given to gb_input_log_open().
+ * \returns	0 on success, or -1 if the end of the log was reached.
+ */
+int gb_input_log_play(struct gb_input_log_s *log, struct gb_s *gb);
+
+/**
+ * Restores the state of the emulation at the start of the given frame of the
+ * log, by loading the nearest keyframe before it and replaying the frames
+ * since. Frames of a log that is being recorded may also be seeked to, but
+ * recording must not then be continued.
+ *
+ * \param log	Input log.
+ * \param gb	Emulator context given to the log.
+ * \param frame	Frame to seek to, up to log->frames.
+ * \returns	0 on success, or -1 if the frame is beyond the end of the log.
+ */
+int gb_input_log_seek(struct gb_input_log_s *log, struct gb_s *gb,
+		uint_fast32_t frame);
+
+#if PEANUT_GB_USE_DIRTY_PAGES
+/**
+ * Returns a bitmap of the 256 byte pages of a memory that were written to since
+ * the last call to gb_dirty_clear(). Bit n % 8 of byte n / 8 is set if page n
+ * was written to. All pages are marked as written to by gb_reset() and
+ * gb_state_load(). Only available if PEANUT_GB_USE_DIRTY_PAGES is set.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param mem	Memory to get the bitmap of.
+ * \param pages	Set to the number of pages in the bitmap. Must not be NULL.
+ *		For Cart RAM, this is the save size of the game.
+ * \returns	Bitmap of (pages + 7) / 8 bytes, which remains valid for
+ *		the lifetime of the context, or NULL if mem is invalid.
+ */
+const uint8_t *gb_dirty_get(struct gb_s *gb, enum gb_dirty_mem_e mem,
+		size_t *pages);
+
+/**
+ * Marks all pages of a memory as not written to.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param mem	Memory to clear the bitmap of.
+ */
+void gb_dirty_clear(struct gb_s *gb, enum gb_dirty_mem_e mem);
+#endif
+
 /**
  * Obtains the save size of the game (size of the Cart RAM). Required by the
  * frontend to allocate enough memory for the Cart RAM.
@@ -4016,6 +7610,100 @@ void gb_tick_rtc(struct gb_s *gb);
  */
 void gb_set_rtc(struct gb_s *gb, const struct tm * const time);
 
+#if ENABLE_LCD
+/**
+ * Skips drawing the given number of frames for each frame that is drawn, such
+ * as 1 for 30 FPS or 2 for 20 FPS. The emulation itself is not affected.
+ * Replaces direct.frame_skip unless skip is 0, and disables the adaptive
+ * frame skip.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param skip	Number of frames to skip after each frame that is drawn.
+ */
+void gb_set_frame_skip(struct gb_s *gb, uint_fast8_t skip);
+
+/**
+ * Enables the adaptive frame skip, in which frames are skipped whilst the
+ * front-end reports with gb_frame_skip_report() that it is slower than real
+ * time. This allows slow hosts to keep emulating at full speed, at a lower
+ * frame rate.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param max_skip Most frames to skip in a row, or 0 to disable the adaptive
+ *		frame skip.
+ */
+void gb_set_frame_skip_auto(struct gb_s *gb, uint_fast8_t max_skip);
+
+/**
+ * Reports the time that the front-end took to run and show the last frame, and
+ * the time that it may take for each frame, such as 16743 microseconds to run
+ * in real time. Used by the adaptive frame skip to decide whether the next
+ * frame is drawn. Any unit of time may be used.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param used	Time taken by the last frame.
+ * \param budget Time that may be taken by each frame.
+ */
+void gb_frame_skip_report(struct gb_s *gb, uint_fast32_t used,
+		uint_fast32_t budget);
+
+/**
+ * Gets the number of frames that were drawn and skipped since the last reset.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \param drawn Set to the number of frames drawn. Must not be NULL.
+ * \param skipped Set to the number of frames skipped. Must not be NULL.
+ */
+void gb_get_frame_skip_stats(const struct gb_s *gb, uint_fast32_t *drawn,
+		uint_fast32_t *skipped);
+#endif
+
+#if PEANUT_GB_USE_LINE_HASH
+/**
+ * Returns whether any line drawn in the last frame differs from the line that
+ * was drawn before it, in which case the front-end must show the frame again.
+ * Frames that were skipped are unchanged. Only available if
+ * PEANUT_GB_USE_LINE_HASH is set.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	true if the frame changed.
+ */
+bool gb_frame_changed(const struct gb_s *gb);
+
+/**
+ * Returns a bitmap of the lines that changed in the last frame. Bit y % 8 of
+ * byte y / 8 is set if line y changed. All lines are marked as changed when
+ * the LCD output is set with gb_init_lcd() or gb_init_framebuffer().
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Bitmap of LCD_HEIGHT / 8 bytes, which remains valid for the
+ *		lifetime of the context.
+ */
+const uint8_t *gb_lines_changed(const struct gb_s *gb);
+
+/**
+ * Returns a hash of the lines that were last drawn, such as to find repeated
+ * frames when encoding a video. The hash is of the shades and palettes given
+ * to the LCD output, so does not change if the colours of the front-end do.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Hash of the frame.
+ */
+uint32_t gb_frame_hash(const struct gb_s *gb);
+#endif
+
+/**
+ * Returns the number of cycles that were skipped in idle loops since the last
+ * reset, instead of being executed instruction by instruction. Only available
+ * when PEANUT_GB_IDLE_LOOP_SKIP is defined to a non-zero value.
+ *
+ * \param gb	An initialised emulator context. Must not be NULL.
+ * \returns	Number of skipped cycles.
+ */
+#if PEANUT_GB_IDLE_LOOP_SKIP
+uint_least64_t gb_get_idle_cycles(const struct gb_s *gb);
+#endif
+
 /**
  * Use boot ROM on reset. gb_reset() must be called for this to take affect.
  * \param gb 	An initialised emulator context. Must not be NULL.
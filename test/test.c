@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "dmg-acid2.gb.h" /* Generated via `xxd -i` */
+#include "cpu_instrs.h"
 
 /* Hash of correct LCD output for DMG-Acid2 Test. */
 #define DMG_ACID2_HASH 0xF91DF416u
@@ -48,7 +49,6 @@ static uint32_t fnv1a_hash(const void *data, size_t len)
  */
 uint8_t gb_rom_read_cpu_instrs(struct gb_s *gb, const uint_fast32_t addr)
 {
-#include "cpu_instrs.h"
 	assert(addr < cpu_instrs_gb_len);
 	return cpu_instrs_gb[addr];
 }
@@ -112,6 +112,23 @@ void gb_serial_tx(struct gb_s *gb, const uint8_t tx)
 	p->str[p->count++] = c;
 }
 
+/**
+ * Gives the context memory outside of itself if PEANUT_GB_EXTERNAL_MEMORY is
+ * set. n selects one of the contexts that are used at the same time.
+ */
+static void init_memory(struct gb_s *gb, unsigned int n)
+{
+#if PEANUT_GB_EXTERNAL_MEMORY
+	static struct gb_memory_s mem[3];
+
+	gb_init_memory(gb, mem[n].wram, mem[n].vram, mem[n].oam,
+			mem[n].hram_io);
+#else
+	(void)gb;
+	(void)n;
+#endif
+}
+
 static void acid_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
                                const uint_fast8_t line)
 {
@@ -128,6 +145,7 @@ void test_cpu_inst(void)
 	enum gb_init_error_e gb_err;
 
 	/* Run ROM test. */
+	init_memory(&gb, 0);
 	gb_err = gb_init(&gb, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
 			&gb_cart_ram_write, &gb_error, &p);
 	lok(gb_err == GB_INIT_NO_ERROR);
@@ -150,6 +168,37 @@ void test_cpu_inst(void)
 	return;
 }
 
+void test_cpu_inst_direct(void)
+{
+	struct gb_s gb;
+	const unsigned short pc_end = 0x06F1; /* Test ends when PC is this value. */
+	struct priv p = { .count = 0 };
+	enum gb_init_error_e gb_err;
+
+	/* Run ROM test with the ROM buffer given directly to Peanut-GB. */
+	init_memory(&gb, 0);
+	gb_err = gb_init_direct(&gb, cpu_instrs_gb, cpu_instrs_gb_len,
+			NULL, 0, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_serial(&gb, &gb_serial_tx, NULL);
+
+	printf("Serial: ");
+
+	/* Step CPU until test is complete. */
+	while(gb.cpu_reg.pc.reg != pc_end)
+		__gb_step_cpu(&gb);
+
+	p.str[p.count++] = '\0';
+
+	/* Check test results. */
+	lok(strstr(p.str, "Passed all tests") != NULL);
+
+	return;
+}
+
 void test_instr_timing(void)
 {
 	struct gb_s gb;
@@ -158,6 +207,7 @@ void test_instr_timing(void)
 	enum gb_init_error_e gb_err;
 
 	/* Run ROM test. */
+	init_memory(&gb, 0);
 	gb_err = gb_init(&gb, &gb_rom_read_instr_timing, &gb_cart_ram_read,
 			&gb_cart_ram_write, &gb_error, &p);
 	lok(gb_err == GB_INIT_NO_ERROR);
@@ -186,6 +236,7 @@ void test_dmg_acid2(void)
 	struct acid_priv p = {0};
 	enum gb_init_error_e gb_err;
 
+	init_memory(&gb, 0);
 	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
 	                &gb_cart_ram_write, &gb_error, &p);
 	lok(gb_err == GB_INIT_NO_ERROR);
@@ -206,10 +257,683 @@ void test_dmg_acid2(void)
 	}
 }
 
+void test_dmg_acid2_framebuffer(void)
+{
+	struct gb_s gb;
+	/* Lines are padded to check that the pitch is used. */
+	static uint32_t fb[LCD_HEIGHT][LCD_WIDTH + 8];
+	struct acid_priv p = {0};
+	uint32_t lut[12];
+	enum gb_init_error_e gb_err;
+
+	init_memory(&gb, 0);
+	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	/* Convert each LUT entry back to the pixel given to lcd_draw_line, so
+	 * that the same hash is expected. */
+	for(unsigned int i = 0; i < 12; i++)
+		lut[i] = ((i >> 2) << 4) | (i & 3);
+
+	gb_init_framebuffer(&gb, fb, sizeof(fb[0]), GB_FRAMEBUFFER_XRGB8888,
+			lut);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb);
+
+	for(unsigned int y = 0; y < LCD_HEIGHT; y++)
+		for(unsigned int x = 0; x < LCD_WIDTH; x++)
+			p.fb[y][x] = (uint8_t)fb[y][x];
+
+	{
+		uint32_t hash = fnv1a_hash(&p.fb[0][0],
+				LCD_WIDTH * LCD_HEIGHT);
+		if(hash != DMG_ACID2_HASH)
+			printf("dmg-acid2 frame buffer hash: 0x%08X\n", hash);
+		lok(hash == DMG_ACID2_HASH);
+	}
+}
+
+/* Number of lines drawn by counting_lcd_draw_line. */
+static unsigned int lines_drawn;
+
+static void counting_lcd_draw_line(struct gb_s *gb, const uint8_t *pixels,
+		const uint_fast8_t line)
+{
+	lines_drawn++;
+	acid_lcd_draw_line(gb, pixels, line);
+}
+
+void test_run_frames(void)
+{
+	struct gb_s gb[2];
+	struct acid_priv p[2];
+	uint8_t *state[2];
+	size_t size;
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		memset(&p[i], 0, sizeof(p[i]));
+		init_memory(&gb[i], i);
+		lok(gb_init(&gb[i], &gb_rom_read_acid, &gb_cart_ram_read,
+				&gb_cart_ram_write, &gb_error, &p[i]) ==
+				GB_INIT_NO_ERROR);
+		gb_init_lcd(&gb[i], counting_lcd_draw_line);
+	}
+
+	size = gb_state_size(&gb[0]);
+	state[0] = malloc(size);
+	state[1] = malloc(size);
+
+	/* WRAM is not cleared on reset, so start both from the same state. */
+	gb_state_save(&gb[0], state[0]);
+	lok(gb_state_load(&gb[1], state[0], size) == GB_STATE_NO_ERROR);
+
+	/* Only the last frame is drawn, and the emulation is unchanged. */
+	lines_drawn = 0;
+	gb_run_frames(&gb[0], 100, 0);
+	lequal((int)lines_drawn, LCD_HEIGHT);
+	lok(fnv1a_hash(&p[0].fb[0][0], LCD_WIDTH * LCD_HEIGHT) ==
+			DMG_ACID2_HASH);
+
+	for(unsigned int i = 0; i < 100; i++)
+		gb_run_frame(&gb[1]);
+
+	gb_state_save(&gb[0], state[0]);
+	gb_state_save(&gb[1], state[1]);
+	lequal(memcmp(state[0], state[1], size), 0);
+
+	lines_drawn = 0;
+	gb_run_frames(&gb[0], 10, GB_RUN_NO_RENDER);
+	gb_run_frames(&gb[0], 0, 0);
+	lequal((int)lines_drawn, 0);
+
+	/* Lines are drawn again by gb_run_frame(). */
+	gb_run_frame(&gb[0]);
+	lequal((int)lines_drawn, LCD_HEIGHT);
+
+	/* The last frame is drawn even when frame skip is on. */
+	gb_set_frame_skip(&gb[0], 1);
+	for(unsigned int i = 0; i < 4; i++)
+	{
+		lines_drawn = 0;
+		gb_run_frames(&gb[0], 2, 0);
+		lequal((int)lines_drawn, LCD_HEIGHT);
+	}
+
+	free(state[0]);
+	free(state[1]);
+}
+
+/* Runs frames and returns the number of frames drawn and skipped. */
+static void run_frame_skip(struct gb_s *gb, unsigned int frames,
+		uint_fast32_t used, uint_fast32_t *drawn, uint_fast32_t *skipped)
+{
+	uint_fast32_t d, s;
+
+	gb_get_frame_skip_stats(gb, &d, &s);
+	for(unsigned int i = 0; i < frames; i++)
+	{
+		gb_run_frame(gb);
+		gb_frame_skip_report(gb, used, 100);
+	}
+
+	gb_get_frame_skip_stats(gb, drawn, skipped);
+	*drawn -= d;
+	*skipped -= s;
+}
+
+void test_frame_skip(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	uint_fast32_t drawn, skipped, d, s;
+
+	init_memory(&gb, 0);
+	lok(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, counting_lcd_draw_line);
+
+	/* Frames are only counted once the game has switched the LCD on. */
+	run_frame_skip(&gb, 30, 0, &drawn, &skipped);
+	lok(drawn != 0);
+	lequal((int)skipped, 0);
+
+	/* One frame in three is drawn. */
+	gb_set_frame_skip(&gb, 2);
+	lines_drawn = 0;
+	run_frame_skip(&gb, 30, 0, &drawn, &skipped);
+	lequal((int)drawn, 10);
+	lequal((int)skipped, 20);
+	lequal((int)lines_drawn, 10 * LCD_HEIGHT);
+
+	/* Whilst the front-end is slow, up to 3 frames are skipped in a row.
+	 * No frames are skipped once it has caught up. */
+	gb_set_frame_skip_auto(&gb, 3);
+	run_frame_skip(&gb, 20, 200, &drawn, &skipped);
+	lok(drawn >= 5 && drawn <= 6);
+	lequal((int)(drawn + skipped), 20);
+
+	run_frame_skip(&gb, 20, 50, &drawn, &skipped);
+	lok(skipped < 8);
+	run_frame_skip(&gb, 20, 50, &drawn, &skipped);
+	lequal((int)skipped, 0);
+
+	/* The fixed frame skip of 30 FPS is still supported. */
+	gb_set_frame_skip_auto(&gb, 0);
+	gb_set_frame_skip(&gb, 0);
+	gb.direct.frame_skip = true;
+	run_frame_skip(&gb, 20, 0, &drawn, &skipped);
+	lequal((int)drawn, 10);
+	lequal((int)skipped, 10);
+
+	/* Frames not drawn by gb_run_frames() are counted as skipped. */
+	gb.direct.frame_skip = false;
+	gb_get_frame_skip_stats(&gb, &d, &s);
+	gb_run_frames(&gb, 10, 0);
+	gb_get_frame_skip_stats(&gb, &drawn, &skipped);
+	lequal((int)(drawn - d), 1);
+	lequal((int)(skipped - s), 9);
+}
+
+void test_shared_rom(void)
+{
+	struct gb_rom_s rom;
+	struct gb_s gb[2];
+	struct acid_priv p[2];
+	uint8_t bad[0x150];
+
+	lok(gb_rom_init(&rom, dmg_acid2_gb, dmg_acid2_gb_len) ==
+			GB_INIT_NO_ERROR);
+
+	for(unsigned int i = 0; i < 2; i++)
+	{
+		memset(&p[i], 0, sizeof(p[i]));
+		init_memory(&gb[i], i);
+		lok(gb_init_rom(&gb[i], &rom, NULL, 0, &gb_error, &p[i]) ==
+				GB_INIT_NO_ERROR);
+		gb_init_lcd(&gb[i], acid_lcd_draw_line);
+	}
+
+	lequal((int)rom.refs, 2);
+
+	for(unsigned int f = 0; f < 100; f++)
+	{
+		gb_run_frame(&gb[0]);
+		gb_run_frame(&gb[1]);
+	}
+
+	for(unsigned int i = 0; i < 2; i++)
+		lok(fnv1a_hash(&p[i].fb[0][0], LCD_WIDTH * LCD_HEIGHT) ==
+				DMG_ACID2_HASH);
+
+	lequal((int)gb_release_rom(&gb[0]), 1);
+	lequal((int)gb_release_rom(&gb[1]), 0);
+
+	/* The header is checked once. */
+	memcpy(bad, dmg_acid2_gb, sizeof(bad));
+	bad[0x14D] ^= 0xFF;
+	lok(gb_rom_init(&rom, bad, sizeof(bad)) == GB_INIT_INVALID_CHECKSUM);
+	lok(gb_rom_init(&rom, bad, 0x100) == GB_INIT_INVALID_CHECKSUM);
+}
+
+void test_state_save_load(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	enum gb_init_error_e gb_err;
+	uint8_t *start, *end, *reload;
+	size_t size;
+
+	init_memory(&gb, 0);
+	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	size = gb_state_size(&gb);
+	start = malloc(size);
+	end = malloc(size);
+	reload = malloc(size);
+
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&gb);
+
+	gb_state_save(&gb, start);
+
+	for(unsigned int i = 30; i < 100; i++)
+		gb_run_frame(&gb);
+
+	gb_state_save(&gb, end);
+
+	/* Running again from the saved state must give the same state and
+	 * LCD output. */
+	memset(&p, 0, sizeof(p));
+	lok(gb_state_load(&gb, start, size) == GB_STATE_NO_ERROR);
+
+	for(unsigned int i = 30; i < 100; i++)
+		gb_run_frame(&gb);
+
+	gb_state_save(&gb, reload);
+	lok(memcmp(end, reload, size) == 0);
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+
+	/* Invalid states are rejected. */
+	lok(gb_state_load(&gb, start, size - 1) == GB_STATE_INVALID);
+	start[0] ^= 0xFF;
+	lok(gb_state_load(&gb, start, size) == GB_STATE_INVALID);
+
+	free(start);
+	free(end);
+	free(reload);
+}
+
+void test_rewind(void)
+{
+	const unsigned int frames = 100;
+	struct gb_s gb;
+	struct gb_rewind_s rw;
+	struct acid_priv p = {0};
+	enum gb_init_error_e gb_err;
+	uint8_t *states, *arena, *cur;
+	size_t size, arena_size;
+	unsigned int i, oldest;
+
+	init_memory(&gb, 0);
+	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	/* The arena is kept small so that the oldest states are discarded. */
+	size = gb_state_size(&gb);
+	arena_size = 2 * size + 1024;
+	states = malloc(size * frames);
+	arena = malloc(arena_size);
+	cur = malloc(size);
+
+	lok(gb_rewind_init(&rw, &gb, arena, size) == -1);
+	lok(gb_rewind_init(&rw, &gb, arena, arena_size) == 0);
+	lok(gb_rewind_pop(&rw, &gb) == -1);
+
+	for(i = 0; i < frames; i++)
+	{
+		gb_run_frame(&gb);
+		gb_state_save(&gb, &states[i * size]);
+		gb_rewind_push(&rw, &gb);
+	}
+
+	lok(rw.count > 0 && rw.count < frames - 1);
+	oldest = frames - 1 - rw.count;
+
+	/* Each step back must load the exact state that was pushed. */
+	for(i = frames; i-- > oldest;)
+	{
+		lok(gb_rewind_pop(&rw, &gb) == 0);
+		gb_state_save(&gb, cur);
+		lequal(memcmp(cur, &states[i * size], size), 0);
+	}
+
+	/* The oldest state is kept. */
+	lok(rw.count == 0);
+	lok(gb_rewind_pop(&rw, &gb) == 0);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, &states[oldest * size], size), 0);
+
+	free(states);
+	free(arena);
+	free(cur);
+}
+
+void test_input_log(void)
+{
+	const unsigned int frames = 200, interval = 50;
+	struct gb_s gb;
+	struct gb_input_log_s log;
+	struct acid_priv p = {0};
+	uint8_t joypad[200];
+	uint8_t *buf, *keyframes, *states, *cur;
+	size_t size;
+
+	init_memory(&gb, 0);
+	lok(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	size = gb_state_size(&gb);
+	buf = malloc(size + 1024);
+	keyframes = malloc(2 * size);
+	states = malloc(size * 4);
+	cur = malloc(size);
+
+	lok(gb_input_log_init(&log, &gb, buf, size, NULL, 0, 0) == -1);
+	lok(gb_input_log_init(&log, &gb, buf, size + 1024, keyframes,
+				2 * size, interval) == 0);
+
+	/* Hold each input for a few frames. States are kept at the start of
+	 * frames 0, 75, 120 and 200. */
+	for(unsigned int i = 0; i < frames; i++)
+	{
+		if(i == 0 || i == 75 || i == 120)
+			gb_state_save(&gb, &states[(i == 0 ? 0 :
+						i == 75 ? 1 : 2) * size]);
+
+		joypad[i] = ~(1 << (i / 7 % 8));
+		gb.direct.joypad = joypad[i];
+		lok(gb_input_log_record(&log, &gb) == 0);
+		gb_run_frame(&gb);
+	}
+
+	gb_state_save(&gb, &states[3 * size]);
+	lequal((int)log.frames, (int)frames);
+	lequal((int)log.keyframe_count, 2);
+
+	/* Replay the recording in full, from the recorded buffer. */
+	lok(gb_input_log_open(&log, &gb, buf, log.used, keyframes, 2 * size,
+				interval) == 0);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, &states[0], size), 0);
+
+	for(unsigned int i = 0; i < frames; i++)
+	{
+		lok(gb_input_log_play(&log, &gb) == 0);
+		if(gb.direct.joypad != joypad[i])
+			break;
+	}
+
+	lequal(gb.direct.joypad, joypad[frames - 1]);
+	lok(gb_input_log_play(&log, &gb) == -1);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, &states[3 * size], size), 0);
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+
+	/* Seek back and forward, from the keyframes saved while replaying. */
+	lok(gb_input_log_seek(&log, &gb, 120) == 0);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, &states[2 * size], size), 0);
+
+	lok(gb_input_log_seek(&log, &gb, 75) == 0);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, &states[1 * size], size), 0);
+	lok(gb_input_log_play(&log, &gb) == 0);
+	lequal(gb.direct.joypad, joypad[75]);
+
+	lok(gb_input_log_seek(&log, &gb, frames + 1) == -1);
+
+	/* The log may be opened from the whole of its buffer, of which the
+	 * bytes after the end of the log are not read as changes. */
+	memset(buf + log.used, 0, size + 1024 - log.used);
+	lok(gb_input_log_open(&log, &gb, buf, size + 1024, NULL, 0, 0) == 0);
+	for(unsigned int i = 0; i < frames; i++)
+	{
+		lok(gb_input_log_play(&log, &gb) == 0);
+		if(gb.direct.joypad != joypad[i])
+			break;
+	}
+
+	lequal(gb.direct.joypad, joypad[frames - 1]);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, &states[3 * size], size), 0);
+
+	/* A log that is cut short is not opened. */
+	lok(gb_input_log_open(&log, &gb, buf, log.used - 1, NULL, 0, 0) == -1);
+
+	free(buf);
+	free(keyframes);
+	free(states);
+	free(cur);
+}
+
+void test_fork(void)
+{
+	struct gb_s root, gb, other;
+	struct acid_priv p = {0};
+	struct priv other_p = { .count = 0 };
+	uint8_t *start, *cur;
+	size_t size;
+
+	init_memory(&root, 0);
+	init_memory(&gb, 1);
+	init_memory(&other, 2);
+	lok(gb_init(&root, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, NULL) == GB_INIT_NO_ERROR);
+	lok(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	size = gb_state_size(&root);
+	start = malloc(size);
+	cur = malloc(size);
+
+	for(unsigned int i = 0; i < 30; i++)
+		gb_run_frame(&root);
+
+	gb_state_save(&root, start);
+
+	/* Branch twice from the same state, so that the second fork may only
+	 * copy what the first branch changed. */
+	lok(gb_fork(&root, &gb) == GB_STATE_NO_ERROR);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, start, size), 0);
+
+	for(unsigned int i = 30; i < 50; i++)
+		gb_run_frame(&gb);
+
+	lok(gb_fork(&root, &gb) == GB_STATE_NO_ERROR);
+	gb_state_save(&gb, cur);
+	lequal(memcmp(cur, start, size), 0);
+
+	for(unsigned int i = 30; i < 100; i++)
+		gb_run_frame(&gb);
+
+	lok(fnv1a_hash(&p.fb[0][0], LCD_WIDTH * LCD_HEIGHT) == DMG_ACID2_HASH);
+
+	/* Forking from a branch that changed since gives its new state. */
+	gb_state_save(&gb, start);
+	lok(gb_fork(&gb, &root) == GB_STATE_NO_ERROR);
+	gb_state_save(&root, cur);
+	lequal(memcmp(cur, start, size), 0);
+
+	/* Initialising the source again must not let it be mistaken for the
+	 * state that was last forked from it. */
+	lok(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	memset(gb.wram, 0x55, WRAM_SIZE);
+	for(unsigned int i = 0; i < 10; i++)
+		gb_run_frame(&gb);
+
+	gb_state_save(&gb, start);
+	lok(gb_fork(&gb, &root) == GB_STATE_NO_ERROR);
+	gb_state_save(&root, cur);
+	lequal(memcmp(cur, start, size), 0);
+
+	/* Contexts must run the same game. */
+	lok(gb_init(&other, &gb_rom_read_cpu_instrs, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &other_p) ==
+			GB_INIT_NO_ERROR);
+	lok(gb_fork(&root, &other) == GB_STATE_ROM_MISMATCH);
+
+	free(start);
+	free(cur);
+}
+
+#if PEANUT_GB_USE_DIRTY_PAGES
+/* Checks that each page of mem that differs from old is marked as dirty. */
+static int dirty_pages_match(struct gb_s *gb, enum gb_dirty_mem_e mem,
+		const uint8_t *cur, const uint8_t *old, size_t size)
+{
+	const uint8_t *bitmap;
+	size_t pages;
+
+	bitmap = gb_dirty_get(gb, mem, &pages);
+	for(size_t i = 0; i < pages && i * 0x100 < size; i++)
+	{
+		size_t len = size - i * 0x100 < 0x100 ? size - i * 0x100 : 0x100;
+
+		if(memcmp(&cur[i * 0x100], &old[i * 0x100], len) != 0 &&
+				(bitmap[i / 8] & (1 << (i % 8))) == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+void test_dirty_pages(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	enum gb_init_error_e gb_err;
+	uint8_t wram[WRAM_SIZE], vram[VRAM_SIZE], oam[OAM_SIZE];
+	const uint8_t *bitmap;
+	size_t pages;
+
+	init_memory(&gb, 0);
+	gb_err = gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p);
+	lok(gb_err == GB_INIT_NO_ERROR);
+	if(gb_err != GB_INIT_NO_ERROR)
+		return;
+
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	/* All pages are dirty after a reset. */
+	bitmap = gb_dirty_get(&gb, GB_DIRTY_WRAM, &pages);
+	lequal((int)pages, WRAM_SIZE / 0x100);
+	lequal(bitmap[0], 0xFF);
+
+	for(int mem = 0; mem < GB_DIRTY_MEM_MAX; mem++)
+		gb_dirty_clear(&gb, mem);
+
+	/* Writes through WRAM, echo RAM, VRAM and OAM. */
+	__gb_write(&gb, 0xC123, 0x55);
+	__gb_write(&gb, 0xFD00, 0x55);
+	__gb_write(&gb, 0x9800, 0x55);
+	__gb_write(&gb, 0xFE10, 0x55);
+
+	bitmap = gb_dirty_get(&gb, GB_DIRTY_WRAM, &pages);
+	lequal(bitmap[0], 0x02);
+	lequal(bitmap[3], 0x20);
+	bitmap = gb_dirty_get(&gb, GB_DIRTY_VRAM, &pages);
+	lequal(bitmap[3], 0x01);
+	bitmap = gb_dirty_get(&gb, GB_DIRTY_OAM, &pages);
+	lequal(bitmap[0], 0x01);
+
+	/* Every page changed by the game must be marked as dirty. */
+	for(unsigned int i = 0; i < 10; i++)
+	{
+		memcpy(wram, gb.wram, WRAM_SIZE);
+		memcpy(vram, gb.vram, VRAM_SIZE);
+		memcpy(oam, gb.oam, OAM_SIZE);
+		for(int mem = 0; mem < GB_DIRTY_MEM_MAX; mem++)
+			gb_dirty_clear(&gb, mem);
+
+		gb_run_frame(&gb);
+
+		lok(dirty_pages_match(&gb, GB_DIRTY_WRAM, gb.wram, wram,
+					WRAM_SIZE));
+		lok(dirty_pages_match(&gb, GB_DIRTY_VRAM, gb.vram, vram,
+					VRAM_SIZE));
+		lok(dirty_pages_match(&gb, GB_DIRTY_OAM, gb.oam, oam,
+					OAM_SIZE));
+	}
+}
+#endif
+
+#if PEANUT_GB_USE_LINE_HASH
+void test_line_hash(void)
+{
+	struct gb_s gb;
+	struct acid_priv p = {0};
+	uint8_t prev[LCD_HEIGHT][LCD_WIDTH];
+	const uint8_t *changed;
+	unsigned int frames_changed = 0;
+	uint32_t hash;
+
+	init_memory(&gb, 0);
+	lok(gb_init(&gb, &gb_rom_read_acid, &gb_cart_ram_read,
+			&gb_cart_ram_write, &gb_error, &p) == GB_INIT_NO_ERROR);
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+
+	/* Every line is changed in the first frame. */
+	lok(gb_frame_changed(&gb));
+	gb_run_frame(&gb);
+	lok(gb_frame_changed(&gb));
+
+	/* Each line that differs from the last frame must be marked as
+	 * changed, and no others. Frames whilst the LCD is off are unchanged. */
+	for(unsigned int i = 0; i < 100; i++)
+	{
+		int lines_match = 1;
+		int frame_same;
+
+		memcpy(prev, p.fb, sizeof(prev));
+		gb_run_frame(&gb);
+		changed = gb_lines_changed(&gb);
+		frame_same = memcmp(prev, p.fb, sizeof(prev)) == 0;
+
+		for(unsigned int y = 0; y < LCD_HEIGHT; y++)
+		{
+			int line_same = memcmp(prev[y], p.fb[y], LCD_WIDTH) == 0;
+			int line_changed = (changed[y / 8] >> (y % 8)) & 1;
+
+			if(line_same == line_changed)
+				lines_match = 0;
+		}
+
+		lok(lines_match);
+		lok(gb_frame_changed(&gb) == !frame_same);
+		frames_changed += !frame_same;
+	}
+
+	/* The test screen is drawn once, and is then static. */
+	lok(frames_changed != 0 && frames_changed < 10);
+	lok(fnv1a_hash(p.fb, sizeof(p.fb)) == DMG_ACID2_HASH);
+
+	hash = gb_frame_hash(&gb);
+	gb_run_frame(&gb);
+	lok(!gb_frame_changed(&gb));
+	lequal((int)gb_frame_hash(&gb), (int)hash);
+
+	/* Every line is drawn again to a new LCD output. */
+	gb_init_lcd(&gb, acid_lcd_draw_line);
+	lok(gb_frame_changed(&gb));
+	gb_run_frame(&gb);
+	lok(gb_frame_changed(&gb));
+	gb_run_frame(&gb);
+	lok(!gb_frame_changed(&gb));
+	lequal((int)gb_frame_hash(&gb), (int)hash);
+}
+#endif
+
 int main(void)
 {
 	lrun("cpu_inst blarrg tests    ", test_cpu_inst);
+	lrun("cpu_inst direct ROM tests", test_cpu_inst_direct);
 	lrun("instr_timing blarrg tests", test_instr_timing);
 	lrun("dmg-acid2 lcd test     ", test_dmg_acid2);
+	lrun("dmg-acid2 fb test      ", test_dmg_acid2_framebuffer);
+	lrun("run frames test        ", test_run_frames);
+	lrun("frame skip test        ", test_frame_skip);
+	lrun("shared ROM test        ", test_shared_rom);
+	lrun("save state test        ", test_state_save_load);
+	lrun("rewind test            ", test_rewind);
+	lrun("input log test         ", test_input_log);
+	lrun("fork test              ", test_fork);
+#if PEANUT_GB_USE_DIRTY_PAGES
+	lrun("dirty pages test       ", test_dirty_pages);
+#endif
+#if PEANUT_GB_USE_LINE_HASH
+	lrun("line hash test         ", test_line_hash);
+#endif
 	return lfails != 0;
 }